@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h> 
 #include <time.h>
@@ -50,6 +52,84 @@ void benchmarkPutsNoSyncIntValue()
     assert(kLogStoreOK == LogStoreClose(&s));
 }
 
+// The same puts, through a 64 KiB append buffer, and a sync at the end.
+
+void benchmarkPutsBufferedIntValue() 
+{
+    unlink("log-buffered");
+    unlink("log-buffered-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.appendBufferSize = 64 * 1024;
+    options.flushInterval = 100;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log-buffered", 
+                                                  &options));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<kPutCount; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, &i, sizeof(int), 0));
+    }
+
+    assert(kLogStoreOK == LogStoreSync(s));
+
+    gettimeofday(&end, NULL);
+    double putsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u puts / second\n", __FUNCTION__, (unsigned)putsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    unlink("log-buffered");
+    unlink("log-buffered-index");
+}
+
+#define kPutManyBatch 1000
+
+void benchmarkPutManyNoSyncIntValue() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStorePutEntry *entries = malloc(kPutManyBatch * sizeof(LogStorePutEntry));
+    int *values = malloc(kPutManyBatch * sizeof(int));
+    int *results = malloc(kPutManyBatch * sizeof(int));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<kPutCount; i += kPutManyBatch) 
+    {
+        for (int j=0; j<kPutManyBatch; ++j) 
+        {
+            values[j] = i + j;
+            assert(kLogStoreOK == LogStoreMakeID(s, &entries[j].id));
+            entries[j].data = &values[j];
+            entries[j].size = sizeof(int);
+            entries[j].rev = 0;
+        }
+
+        assert(kLogStoreOK == LogStorePutMany(s, entries, kPutManyBatch, 
+                                              results));
+    }
+
+    gettimeofday(&end, NULL);
+    free(entries);
+    free(values);
+    free(results);
+
+    double putsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u puts / second\n", __FUNCTION__, (unsigned)putsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
 void benchmarkPutsSyncEveryPutIntValue() 
 {
     printf("%s: this might take a while...\n", __FUNCTION__);
@@ -118,8 +198,187 @@ void benchmarkPutsSyncOncePerSecondIntValue()
     assert(kLogStoreOK == LogStoreClose(&s));
 }
 
+// Every thread syncs after each of its puts.  Syncs from concurrent threads
+// are group-committed so the durable put rate should grow with the number of
+// threads.
+
+#define kDurablePutCount 4096
+
+static void *durablePutThread(void *arg) 
+{
+    LogStore s = ((void **)arg)[0];
+    int count = *(int *)((void **)arg)[1];
+
+    for (int i=0; i<count; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, &i, sizeof(int), 0));
+        assert(kLogStoreOK == LogStoreSync(s));
+    }
+
+    return NULL;
+}
+
+void benchmarkDurablePutsIntValue(int threadCount) 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    int count = kDurablePutCount / threadCount;
+    void *arg[2] = { s, &count };
+
+    pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_create(&threads[i], NULL, durablePutThread, arg));
+    }
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    gettimeofday(&end, NULL);
+    free(threads);
+
+    double putsPerSec = count * threadCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %d threads: %u durable puts / second\n", 
+           __FUNCTION__, threadCount, (unsigned)putsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// A sync after every put, at each durability level the store can be opened
+// with.
+
+void benchmarkPutsSyncEveryPutAtLevel(int durability) 
+{
+    static const char *levels[] = { "full", "data", "ordered", "none" };
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.durability = durability;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<kDurablePutCount; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, &i, sizeof(int), 0));
+        assert(kLogStoreOK == LogStoreSync(s));
+    }
+
+    gettimeofday(&end, NULL);
+
+    double putsPerSec = kDurablePutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %s: %u puts / second\n", __FUNCTION__, levels[durability], 
+           (unsigned)putsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Data syncs after every 1 KiB put, with the log preallocated in chunks of
+// the given size or not (0).  Without preallocation, each fdatasync also has
+// to write back the grown size of the file and the blocks allocated for it.
+
+void benchmarkPutsSyncEveryPutPreallocated(size_t preallocateSize) 
+{
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.durability = kLogStoreDurabilityData;
+    options.preallocateSize = preallocateSize;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    char value[1024];
+    memset(value, 'v', sizeof(value));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<kDurablePutCount; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, value, sizeof(value), 0));
+        assert(kLogStoreOK == LogStoreSync(s));
+    }
+
+    gettimeofday(&end, NULL);
+
+    double putsPerSec = kDurablePutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %zu: %u puts / second\n", __FUNCTION__, preallocateSize, 
+           (unsigned)putsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
 LogStoreID firstPut1KiBID = 0;
 
+// Threads make IDs at once, one at a time.  Making an ID does not take the
+// store's lock, so the rate should hold up as threads are added.
+
+#define kMakeIDCount 4000000
+
+static void *makeIDThread(void *arg) 
+{
+    LogStore s = ((void **)arg)[0];
+    int count = *(int *)((void **)arg)[1];
+
+    for (int i=0; i<count; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+    }
+
+    return NULL;
+}
+
+void benchmarkConcurrentMakeIDs(int threadCount) 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    int count = kMakeIDCount / threadCount;
+    void *arg[2] = { s, &count };
+
+    pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_create(&threads[i], NULL, makeIDThread, arg));
+    }
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    gettimeofday(&end, NULL);
+    free(threads);
+
+    double idsPerSec = count * threadCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %d threads: %u IDs / second (%d index file growths)\n", 
+           __FUNCTION__, threadCount, (unsigned)idsPerSec, 
+           s->indexFileGrowthCount);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
 void benchmarkPutsNoSync1KiBValue() 
 {
     LogStore s = NULL;
@@ -154,6 +413,86 @@ void benchmarkPutsNoSync1KiBValue()
     assert(kLogStoreOK == LogStoreClose(&s));
 }
 
+// Threads put 1 KiB values to a store sharded over 'shardCount' logs.  With a
+// shard per thread, puts do not contend for a lock and the put rate should
+// grow with the number of threads, up to the number of cores.
+
+#define kConcurrentPutCount 200000
+
+static void *concurrentPutThread(void *arg) 
+{
+    LogStore s = ((void **)arg)[0];
+    int count = *(int *)((void **)arg)[1];
+
+    char data[1024];
+    memset(data, 'x', sizeof(data));
+
+    for (int i=0; i<count; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, data, sizeof(data), 0));
+    }
+
+    return NULL;
+}
+
+void benchmarkConcurrentPuts1KiBValue(int threadCount, int shardCount) 
+{
+    char paths[16][32];
+    const char *pathPointers[16];
+    assert(shardCount <= 16);
+    for (int i=0; i<shardCount; ++i) 
+    {
+        snprintf(paths[i], sizeof(paths[i]), "log-shard%d", i);
+        pathPointers[i] = paths[i];
+        unlink(paths[i]);
+        char indexPath[48];
+        snprintf(indexPath, sizeof(indexPath), "%s-index", paths[i]);
+        unlink(indexPath);
+    }
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenSharded(&s, pathPointers, shardCount, 
+                                              NULL));
+
+    int count = kConcurrentPutCount / threadCount;
+    void *arg[2] = { s, &count };
+
+    pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_create(&threads[i], NULL, concurrentPutThread, 
+                                   arg));
+    }
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    gettimeofday(&end, NULL);
+    free(threads);
+
+    double putsPerSec = count * threadCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %d threads, %d shards: %u puts / second\n", 
+           __FUNCTION__, threadCount, shardCount, (unsigned)putsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    for (int i=0; i<shardCount; ++i) 
+    {
+        unlink(paths[i]);
+        char indexPath[48];
+        snprintf(indexPath, sizeof(indexPath), "%s-index", paths[i]);
+        unlink(indexPath);
+    }
+}
+
 void benchmarkPutsSyncOncePerSecond1KiBValue() 
 {
     LogStore s = NULL;
@@ -254,6 +593,55 @@ void benchmarkRandomGetsIntValue()
     assert(kLogStoreOK == LogStoreClose(&s));
 }
 
+// The same gets, of values kept in the index as well as the log.
+
+void benchmarkRandomGetsInlineIntValue() 
+{
+    unlink("log-inline");
+    unlink("log-inline-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.inlineSize = sizeof(int);
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log-inline", &options));
+
+    LogStoreID firstID;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, kPutCount, &firstID));
+
+    for (int i=0; i<kPutCount; ++i) 
+        assert(kLogStoreOK == LogStorePut(s, firstID + i, &i, sizeof(i), 0));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    srand(time(NULL));
+
+    for (int i=0; i<kPutCount; ++i) 
+    {
+        LogStoreID randomID = (rand() / (double)RAND_MAX) * (kPutCount - 1);
+
+        void *data = NULL;
+        size_t size = 0;
+        assert(kLogStoreOK == LogStoreGet(s, firstID + randomID, 
+                                          &data, &size, NULL));
+        assert(NULL != data);
+        assert(size == sizeof(int));
+        assert(*(int *)data == randomID);
+        free(data);
+    }
+
+    gettimeofday(&end, NULL);
+    double getsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u gets / second\n", __FUNCTION__, (unsigned)getsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    unlink("log-inline");
+    unlink("log-inline-index");
+}
+
 void benchmarkSequentialGets1KiBValue() 
 {
     LogStore s = NULL;
@@ -312,21 +700,604 @@ void benchmarkRandomGets1KiBValue()
     assert(kLogStoreOK == LogStoreClose(&s));
 }
 
+// The same random gets, kept 'inFlight' at a time with LogStoreGetAsync,
+// through io_uring or the store's threads.
+
+typedef struct AsyncGets 
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int outstanding;
+} AsyncGets;
+
+static void asyncGetDone(void *context, int result, void *data, size_t size,
+                         LogStoreRevision rev) 
+{
+    AsyncGets *gets = context;
+    assert(kLogStoreOK == result && size == 1024);
+    free(data);
+    pthread_mutex_lock(&gets->mutex);
+    gets->outstanding--;
+    pthread_cond_signal(&gets->cond);
+    pthread_mutex_unlock(&gets->mutex);
+}
+
+void benchmarkAsyncRandomGets1KiBValue(int inFlight, int flags) 
+{
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.flags = flags;
+    options.asyncThreads = 4;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    AsyncGets gets = 
+    { 
+        PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 
+    };
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+    srand(time(NULL));
+
+    for (int i=0; i<kPutCount; ++i) 
+    {
+        pthread_mutex_lock(&gets.mutex);
+        while (gets.outstanding >= inFlight) 
+            pthread_cond_wait(&gets.cond, &gets.mutex);
+        gets.outstanding++;
+        pthread_mutex_unlock(&gets.mutex);
+
+        LogStoreID randomID = (rand() / (double)RAND_MAX) * (kPutCount - 1);
+        assert(kLogStoreOK == LogStoreGetAsync(s, firstPut1KiBID + randomID, 
+                                               asyncGetDone, &gets));
+    }
+
+    pthread_mutex_lock(&gets.mutex);
+    while (gets.outstanding > 0) 
+        pthread_cond_wait(&gets.cond, &gets.mutex);
+    pthread_mutex_unlock(&gets.mutex);
+
+    gettimeofday(&end, NULL);
+    double getsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %d in flight, %s: %u gets / second\n", __FUNCTION__, 
+           inFlight, logStoreAsyncUsesRing(s->async) ? "io_uring" : "threads",
+           (unsigned)getsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Views point into a mapping of the log; no allocation or copy per get.
+
+void benchmarkRandomGetViews1KiBValue() 
+{
+    LogStoreOptions options = { kLogStoreOptionMapLog };
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+    srand(time(NULL));
+
+    for (int i=0; i<kPutCount; ++i) 
+    {
+        LogStoreID randomID = (rand() / (double)RAND_MAX) * (kPutCount - 1);
+        const void *data = NULL;
+        size_t size = 0;
+        LogStoreView view;
+        assert(kLogStoreOK == LogStoreGetView(s, firstPut1KiBID + randomID, 
+                                              &data, &size, &view));
+        assert(size == 1024);
+        assert(kLogStoreOK == LogStoreReleaseView(s, &view));
+    }
+
+    gettimeofday(&end, NULL);
+    double getsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u gets / second\n", __FUNCTION__, (unsigned)getsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Fetch random 1 KiB values through a cache that holds a quarter of them.
+
+void benchmarkCachedRandomGets1KiBValue() 
+{
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.cacheSize = kPutCount / 4 * 1024;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+    srand(time(NULL));
+
+    char value[1024];
+
+    for (int i=0; i<kPutCount; ++i) 
+    {
+        LogStoreID randomID = (rand() / (double)RAND_MAX) * (kPutCount - 1);
+        assert(kLogStoreOK == LogStoreGetInto(s, firstPut1KiBID + randomID, 
+                                              value, sizeof(value), 
+                                              NULL, NULL));
+    }
+
+    gettimeofday(&end, NULL);
+    double getsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+
+    LogStoreCacheStats stats;
+    assert(kLogStoreOK == LogStoreGetCacheStats(s, &stats));
+    printf("%s: %u gets / second (%llu hits, %llu misses)\n", __FUNCTION__, 
+           (unsigned)getsPerSec, (unsigned long long)stats.hits,
+           (unsigned long long)stats.misses);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Fetch random 1 KiB values in batches, as a page render fanning out to many
+// objects would.
+
+#define kGetManyBatch 100
+
+void benchmarkRandomGetMany1KiBValue() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreID ids[kGetManyBatch];
+    void *data[kGetManyBatch];
+    int results[kGetManyBatch];
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+    srand(time(NULL));
+
+    for (int i=0; i<kPutCount; i += kGetManyBatch) 
+    {
+        for (int j=0; j<kGetManyBatch; ++j) 
+        {
+            ids[j] = firstPut1KiBID + 
+                     (LogStoreID)((rand() / (double)RAND_MAX) * (kPutCount - 1));
+            data[j] = NULL;
+        }
+
+        assert(kLogStoreOK == LogStoreGetMany(s, ids, kGetManyBatch, data, 
+                                              NULL, NULL, results));
+
+        for (int j=0; j<kGetManyBatch; ++j) 
+        {
+            free(data[j]);
+        }
+    }
+
+    gettimeofday(&end, NULL);
+    double getsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u gets / second\n", __FUNCTION__, (unsigned)getsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Stats are answered from the index without touching the log, so they run at
+// memory speed.
+
+#define kStatCount (10 * 1000 * 1000)
+
+void benchmarkRandomStats1KiBValue() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+    unsigned seed = time(NULL);
+
+    size_t total = 0;
+
+    for (int i=0; i<kStatCount; ++i) 
+    {
+        LogStoreID randomID = rand_r(&seed) % kPutCount;
+        int exists = 0;
+        size_t size = 0;
+        assert(kLogStoreOK == LogStoreStat(s, firstPut1KiBID + randomID, 
+                                           &exists, &size, NULL));
+        total += size;
+    }
+
+    gettimeofday(&end, NULL);
+    assert(total == (size_t)kStatCount * 1024);
+    double statsPerSec = kStatCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u stats / second\n", __FUNCTION__, (unsigned)statsPerSec);
+
+    LogStoreID ids[kGetManyBatch];
+    size_t sizes[kGetManyBatch];
+    LogStoreRevision revs[kGetManyBatch];
+
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<kStatCount; i += kGetManyBatch) 
+    {
+        for (int j=0; j<kGetManyBatch; ++j) 
+            ids[j] = firstPut1KiBID + rand_r(&seed) % kPutCount;
+
+        assert(kLogStoreOK == LogStoreStatMany(s, ids, kGetManyBatch, NULL, 
+                                               sizes, revs));
+    }
+
+    gettimeofday(&end, NULL);
+    statsPerSec = kStatCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u batched stats / second\n", __FUNCTION__, 
+           (unsigned)statsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Iterating over the whole store reads the log sequentially, where a get per
+// ID seeks.
+
+static int countValue(void *context, LogStoreID id, const void *data, 
+                      size_t size, LogStoreRevision rev) 
+{
+    uint64_t *counts = context;
+    counts[0]++;
+    counts[1] += size;
+    return kLogStoreOK;
+}
+
+void benchmarkIterate() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    for (int flags=0; flags<=kLogStoreIterateNoCache; ++flags) 
+    {
+        struct timeval start, end; 
+        gettimeofday(&start, NULL);
+
+        uint64_t counts[2] = { 0, 0 };
+        assert(kLogStoreOK == LogStoreIterate(s, countValue, counts, flags));
+
+        gettimeofday(&end, NULL);
+        assert(counts[0] >= 2 * kPutCount);
+        double seconds = TIME_DELTA_SECONDS(start, end);
+        printf("%s: %u values / second, %.1f MiB / second%s\n", __FUNCTION__, 
+               (unsigned)(counts[0] / seconds), counts[1] / seconds / 1048576,
+               flags & kLogStoreIterateNoCache ? " (no cache)" : "");
+    }
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Puts while a snapshot is open save the pages of the index they change
+// first.
+
+void benchmarkPutsWithSnapshotIntValue() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreID firstID;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, kPutCount, &firstID));
+
+    for (int i=0; i<kPutCount; ++i) 
+        assert(kLogStoreOK == LogStorePut(s, firstID + i, &i, sizeof(i), 0));
+
+    for (int rev=1; rev<=2; ++rev) 
+    {
+        LogStoreSnapshot snapshot = NULL;
+
+        if (rev == 2) 
+            assert(kLogStoreOK == LogStoreSnapshotOpen(s, &snapshot));
+
+        struct timeval start, end; 
+        gettimeofday(&start, NULL);
+
+        for (int i=0; i<kPutCount; ++i) 
+            assert(kLogStoreOK == LogStorePut(s, firstID + i, &i, sizeof(i), 
+                                              rev));
+
+        gettimeofday(&end, NULL);
+        double putsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+        printf("%s: %u puts / second%s\n", __FUNCTION__, (unsigned)putsPerSec,
+               snapshot ? " (snapshot open)" : "");
+
+        if (snapshot) 
+            assert(kLogStoreOK == LogStoreSnapshotClose(&snapshot));
+    }
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Gets do not serialize on the store's lock so random gets from several
+// threads should scale with the number of threads (as far as the disk allows).
+
+#define kConcurrentGetCount 64000
+
+static void *randomGetThread(void *arg) 
+{
+    LogStore s = ((void **)arg)[0];
+    int count = *(int *)((void **)arg)[1];
+    unsigned seed = time(NULL) ^ (uintptr_t)&seed;
+
+    for (int i=0; i<count; ++i) 
+    {
+        LogStoreID randomID = (rand_r(&seed) / (double)RAND_MAX) * 1000;
+        void *data = NULL;
+        size_t size = 0;
+        assert(kLogStoreOK == LogStoreGet(s, firstPut1KiBID + randomID, 
+                                          &data, &size, NULL));
+        assert(size == 1024);
+        free(data);
+    }
+
+    return NULL;
+}
+
+void benchmarkConcurrentRandomGets1KiBValue(int threadCount) 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    int count = kConcurrentGetCount / threadCount;
+    void *arg[2] = { s, &count };
+
+    pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_create(&threads[i], NULL, randomGetThread, arg));
+    }
+
+    for (int i=0; i<threadCount; ++i) 
+    {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    gettimeofday(&end, NULL);
+    free(threads);
+
+    double getsPerSec = count * threadCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %d threads: %u gets / second\n", 
+           __FUNCTION__, threadCount, (unsigned)getsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Put and get JSON-ish 1 KiB values that compress well, with compression on.
+
+void benchmarkCompressible1KiBValue() 
+{
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.flags = kLogStoreOptionCompress;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    char data[1024];
+    int length = 0;
+    while (length < sizeof(data)) 
+    {
+        length += snprintf(data + length, sizeof(data) - length,
+                           "{\"id\": %d, \"name\": \"object %d\", "
+                           "\"tags\": [\"a\", \"b\"]}, ", 
+                           length, length % 7);
+    }
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    off_t sizeBefore = s->logFileSize;
+    LogStoreID firstID = 0;
+
+    for (int i=0; i<kPutCount; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, data, sizeof(data), 0));
+
+        if (i == 0) 
+        {
+            firstID = id;
+        }
+    }
+
+    gettimeofday(&end, NULL);
+
+    double putsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u puts / second\n", __FUNCTION__, (unsigned)putsPerSec);
+    printf("%s: %u bytes appended per put\n", __FUNCTION__, 
+           (unsigned)((s->logFileSize - sizeBefore) / kPutCount));
+
+    gettimeofday(&start, NULL);
+    srand(time(NULL));
+
+    for (int i=0; i<kPutCount; ++i) 
+    {
+        LogStoreID randomID = (rand() / (double)RAND_MAX) * (kPutCount - 1);
+        char value[1024];
+        size_t size = 0;
+        assert(kLogStoreOK == LogStoreGetInto(s, firstID + randomID, value, 
+                                              sizeof(value), &size, NULL));
+        assert(size == sizeof(data));
+    }
+
+    gettimeofday(&end, NULL);
+    double getsPerSec = kPutCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u gets / second\n", __FUNCTION__, (unsigned)getsPerSec);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Puts, a sync, and random gets of 'valueSize' bytes through a 1 MiB append
+// buffer, with the page cache (flags 0) or without it (kLogStoreOptionDirect).
+// Each run has a log of its own of about 64 MiB.
+
+#define kDirectLogSize (64 * 1024 * 1024)
+#define kDirectGetCount 20000
+
+void benchmarkDirect(size_t valueSize, int flags) 
+{
+    unlink("log-direct");
+    unlink("log-direct-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.flags = flags;
+    options.appendBufferSize = 1024 * 1024;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log-direct", 
+                                                  &options));
+
+    int count = kDirectLogSize / valueSize;
+    if (count > kPutCount) 
+        count = kPutCount;
+
+    char *value = malloc(valueSize);
+    for (size_t i = 0; i < valueSize; ++i) 
+        value[i] = rand();
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, count, &first));
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    for (int i=0; i<count; ++i) 
+        assert(kLogStoreOK == LogStorePut(s, first + i, value, valueSize, 0));
+    assert(kLogStoreOK == LogStoreSync(s));
+
+    gettimeofday(&end, NULL);
+    const char *mode = flags & kLogStoreOptionDirect ? "direct" : "buffered";
+    double putsPerSec = count / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u bytes, %s: %u puts / second\n", __FUNCTION__, 
+           (unsigned)valueSize, mode, (unsigned)putsPerSec);
+
+    gettimeofday(&start, NULL);
+    srand(time(NULL));
+
+    for (int i=0; i<kDirectGetCount; ++i) 
+    {
+        LogStoreID randomID = (rand() / (double)RAND_MAX) * (count - 1);
+        size_t size = 0;
+        assert(kLogStoreOK == LogStoreGetInto(s, first + randomID, value, 
+                                              valueSize, &size, NULL));
+        assert(size == valueSize);
+    }
+
+    gettimeofday(&end, NULL);
+    double getsPerSec = kDirectGetCount / TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u bytes, %s: %u gets / second\n", __FUNCTION__, 
+           (unsigned)valueSize, mode, (unsigned)getsPerSec);
+
+    free(value);
+    assert(kLogStoreOK == LogStoreClose(&s));
+    unlink("log-direct");
+    unlink("log-direct-index");
+}
+
+// How fast the index is rebuilt from everything the benchmarks above have
+// appended to the log.
+
+void benchmarkRebuildIndex() 
+{
+    unlink("log-index");
+
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    gettimeofday(&end, NULL);
+
+    double seconds = TIME_DELTA_SECONDS(start, end);
+    printf("%s: %u entries from %u MiB of log in %.2f seconds (%u MiB / "
+           "second)\n", __FUNCTION__, (unsigned)s->indexFileCount, 
+           (unsigned)(s->logFileSize >> 20), seconds, 
+           (unsigned)((s->logFileSize >> 20) / seconds));
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// A store that was closed cleanly opens without reading its log.
+
+void benchmarkOpenClosedStore() 
+{
+    struct timeval start, end; 
+    gettimeofday(&start, NULL);
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    gettimeofday(&end, NULL);
+
+    printf("%s: %u MiB of log opened in %.0f microseconds\n", __FUNCTION__, 
+           (unsigned)(s->logFileSize >> 20), TIME_DELTA_MICRO(start, end));
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
 int main(int argc, char **argv) 
 {
     unlink("log");
     unlink("log-index");
 
     benchmarkPutsNoSyncIntValue();
+    benchmarkPutManyNoSyncIntValue();
+    benchmarkPutsBufferedIntValue();
     // VERY slow on mac os x at least.
     //benchmarkPutsSyncEveryPutIntValue();
     benchmarkPutsSyncOncePerSecondIntValue();
+    benchmarkDurablePutsIntValue(1);
+    benchmarkDurablePutsIntValue(4);
+    benchmarkDurablePutsIntValue(16);
+    benchmarkDurablePutsIntValue(64);
+    benchmarkPutsSyncEveryPutAtLevel(kLogStoreDurabilityFull);
+    benchmarkPutsSyncEveryPutAtLevel(kLogStoreDurabilityData);
+    benchmarkPutsSyncEveryPutAtLevel(kLogStoreDurabilityOrdered);
+    benchmarkPutsSyncEveryPutAtLevel(kLogStoreDurabilityNone);
+    benchmarkPutsSyncEveryPutPreallocated(0);
+    benchmarkPutsSyncEveryPutPreallocated(64 * 1024 * 1024);
+    benchmarkConcurrentMakeIDs(1);
+    benchmarkConcurrentMakeIDs(4);
     benchmarkPutsNoSync1KiBValue();
     benchmarkPutsSyncOncePerSecond1KiBValue();
+    benchmarkConcurrentPuts1KiBValue(1, 1);
+    benchmarkConcurrentPuts1KiBValue(4, 1);
+    benchmarkConcurrentPuts1KiBValue(2, 2);
+    benchmarkConcurrentPuts1KiBValue(4, 4);
+    benchmarkConcurrentPuts1KiBValue(8, 8);
     benchmarkSequentialGetsIntValue();
     benchmarkRandomGetsIntValue();
+    benchmarkRandomGetsInlineIntValue();
     benchmarkSequentialGets1KiBValue();
     benchmarkRandomGets1KiBValue();
+    benchmarkAsyncRandomGets1KiBValue(4096, 0);
+    benchmarkAsyncRandomGets1KiBValue(4096, kLogStoreOptionNoRing);
+    benchmarkRandomGetMany1KiBValue();
+    benchmarkRandomStats1KiBValue();
+    benchmarkIterate();
+    benchmarkPutsWithSnapshotIntValue();
+    benchmarkRandomGetViews1KiBValue();
+    benchmarkCachedRandomGets1KiBValue();
+    benchmarkConcurrentRandomGets1KiBValue(1);
+    benchmarkConcurrentRandomGets1KiBValue(4);
+    benchmarkConcurrentRandomGets1KiBValue(16);
+    benchmarkCompressible1KiBValue();
+    benchmarkDirect(128, 0);
+    benchmarkDirect(128, kLogStoreOptionDirect);
+    benchmarkDirect(4096, 0);
+    benchmarkDirect(4096, kLogStoreOptionDirect);
+    benchmarkDirect(65536, 0);
+    benchmarkDirect(65536, kLogStoreOptionDirect);
+    benchmarkRebuildIndex();
+    benchmarkOpenClosedStore();
     
     return 0;
 }
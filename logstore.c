@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,663 +22,6703 @@
 #define kOtherOpenFlags 0
 #endif
 
-// This index file growth factor is arbitrary.  The idea is that the index file
-// is often going to be memory-mapped for performance reasons, but
-// memory-mapped files cannot grow through a memory-map.  Thus, we treat the
-// index file as a sparse file and grow it by seeking+writing beyond the EOF by
-// a certain amount and remapping the file.
+#ifdef O_DIRECT
+#define kDirectOpenFlag O_DIRECT
+#else
+#define kDirectOpenFlag 0
+#endif
+
+// The index file is memory-mapped for performance reasons.  It starts with
+// room for this many entries and doubles whenever it grows; it is extended
+// (see indexFileExtend) and the extension is mapped right after the mapping
+// of the rest, in address space reserved when the store is opened for the
+// largest index there may be.  The mapping thus never moves.  Should that
+// reservation not be possible, the grown file is mapped anew instead.
+
+#define kIndexFileGrowBy      (4096/8 * 1000)
+#define kIndexFileMaxCapacity ((uint64_t)1 << 34)
 
-#define kIndexFileGrowBy (4096/8 * 1000)
+// IDs are made without the lock, from a block reserved with it.  The header of
+// the index counts every reserved ID as made, so that no ID is made twice
+// should the store not be closed; closing counts only those made.  The index
+// is grown in the background once three quarters of it are in use.
+
+#define kIndexFileReserveBy 4096
 
 #define LogStoreLock   pthread_mutex_lock(&store->mutex)
 #define LogStoreUnlock pthread_mutex_unlock(&store->mutex);
 
-typedef uint32_t IndexFileCount;
+typedef uint64_t IndexFileCount;
 
 typedef uint32_t LogFileEntryHeader[2];            // id, size
 
-// Index file entries are 64-bit numbers with high 16 bits for revision, low 48
-// bits for log offset.  max revisions: ~65K; max log file size: ~260GiB.  an
-// index file is a sparse file wherein the entry for id X is LogStored at byte
-// offset 8+X*8.
+// The high bits of the size in a record descriptor are flags.  A compressed
+// record's payload is the size of the value (32 bits) followed by the value as
+// compressed by logStoreLzCompress.  A checksummed record's descriptor is
+// followed by the CRC32C of its payload (as stored, i.e. compressed).  The
+// descriptor of a record with a revision is followed by (the checksum and) the
+// revision the value was put with, so that the index can be rebuilt.
 
-typedef uint64_t IndexEntry;                       // [rev|offset]
+#define kLogFileEntryCompressed  0x80000000U
+#define kLogFileEntryChecksummed 0x40000000U
+#define kLogFileEntryRevision    0x20000000U
+#define kLogFileEntryFlags       (kLogFileEntryCompressed | \
+                                  kLogFileEntryChecksummed | \
+                                  kLogFileEntryRevision)
 
-// A LogStore is a log file and an index file (<path>-index)
+// A record whose ID or payload size does not fit its descriptor has this in
+// place of the ID, and only flags in place of the size.  The descriptor is
+// then followed by the ID and the payload size, 64 bits each (low word
+// first).  No ID of the original format was ever this large.
 
-int LogStoreOpen(LogStore *sp, const char *path)
-{
-    if (NULL == sp || NULL != *sp || NULL == path)
-    {
-        return kLogStoreInvalidParameter;
-    }
+#define kLogFileEntryWide        0xffffffffU
 
-    LogStore store = calloc(sizeof(struct LogStore), 1);
+// What the descriptor of a record reads as where a direct store padded its
+// log (see appendBufferWriteDirect).  No record has it; one that would is
+// written wide.
 
-    if (!store)
-    {
-        return kLogStoreOutOfMemory;
-    }
+#define kLogFileEntryPadding     0xfefefefeU
 
-    // Open log file.
+// What precedes the payload of a record: the descriptor, the wide ID and
+// size, the checksum, and the revision, if any.  This is the most there may
+// be.
 
-    int flags = O_CREAT | O_APPEND | O_RDWR | kOtherOpenFlags;
+typedef uint32_t LogFileEntryPrefix[8];            // id, size, ..., rev
 
-    if (-1 == (store->logFileNo = open(path, flags, 0777)))
-    {
-        free(store);
+#define kCompressDefaultThreshold 128
 
-        return kLogStoreInputOutputError;
-    }
+static inline int logFileEntryIsWide(const uint32_t *header)
+{
+    return kLogFileEntryWide == header[0];
+}
 
-    // Get size of log file.
+static inline uint64_t logFileEntryWord64(const uint32_t *words)
+{
+    return words[0] | (uint64_t)words[1] << 32;
+}
 
-    struct stat logFileStat;
+// The size of what precedes the payload.  This needs only the descriptor.
 
-    if (fstat(store->logFileNo, &logFileStat) < 0 ||
-        !S_ISREG(logFileStat.st_mode))
-    {
-        close(store->logFileNo);
-        free(store);
+static inline size_t logFileEntryPrefixSize(const uint32_t *header)
+{
+    return sizeof(LogFileEntryHeader) + 
+           (logFileEntryIsWide(header) ? sizeof(uint32_t) * 4 : 0) +
+           (header[1] & kLogFileEntryChecksummed ? sizeof(uint32_t) : 0) +
+           (header[1] & kLogFileEntryRevision ? sizeof(uint32_t) : 0);
+}
 
-        return kLogStoreInputOutputError;
-    }
+// The ID of a record, and the size of the payload that follows its prefix.
 
-    store->logFileSize = logFileStat.st_size;
+static inline LogStoreID logFileEntryID(const uint32_t *prefix)
+{
+    return logFileEntryIsWide(prefix) ? logFileEntryWord64(&prefix[2]) 
+                                      : prefix[0];
+}
 
-    // Open index file.
+static inline uint64_t logFileEntryPayloadSize(const uint32_t *prefix)
+{
+    return logFileEntryIsWide(prefix) ? logFileEntryWord64(&prefix[4]) 
+                                      : prefix[1] & ~kLogFileEntryFlags;
+}
 
-    char *ipath = malloc(strlen(path) + strlen("-index") + 1);
+// The checksum in a prefix that has one.
 
-    if (NULL == ipath)
+static inline uint32_t logFileEntryChecksum(const uint32_t *prefix)
+{
+    return prefix[logFileEntryIsWide(prefix) ? 6 : 2];
+}
+
+// The revision in a prefix, or -1 if it has none.
+
+static inline int64_t logFileEntryRevision(const uint32_t *prefix)
+{
+    if (!(prefix[1] & kLogFileEntryRevision))
     {
-        return kLogStoreOutOfMemory;
+        return -1;
     }
 
-    sprintf(ipath, "%s-index", path);
+    return prefix[(logFileEntryIsWide(prefix) ? 6 : 2) + 
+                  (prefix[1] & kLogFileEntryChecksummed ? 1 : 0)];
+}
 
-    store->indexFileNo = open(ipath, O_CREAT | O_RDWR | kOtherOpenFlags, 0777);
+// The size of a whole record.
+
+static inline uint64_t logFileEntryLength(const uint32_t *prefix)
+{
+    return logFileEntryPrefixSize(prefix) + logFileEntryPayloadSize(prefix);
+}
 
-    free(ipath);
+// Copy the prefix of the record at the start of 'size' bytes read from the
+// log.  Returns the length of the whole record, or 0 if its prefix is cut
+// off.
 
-    if (-1 == store->indexFileNo)
+static inline uint64_t logFileEntryParse(const char *buffer,
+                                         size_t      size,
+                                         uint32_t   *prefix)
+{
+    if (size < sizeof(LogFileEntryHeader))
     {
-        close(store->logFileNo);
-        free(store);
+        return 0;
+    }
 
-        return kLogStoreInputOutputError;
+    memcpy(prefix, buffer, sizeof(LogFileEntryHeader));
+
+    size_t prefixSize = logFileEntryPrefixSize(prefix);
+
+    if (size < prefixSize)
+    {
+        return 0;
     }
 
-    // Deteremoveine the capacity of the index file.
+    memcpy(prefix, buffer, prefixSize);
 
-    struct stat indexFileStat;
+    return logFileEntryLength(prefix);
+}
 
-    if (-1 == fstat(store->indexFileNo, &indexFileStat))
+// Whether a descriptor reads as padding.
+
+static inline int logFileEntryIsPadding(const uint32_t *header)
+{
+    return kLogFileEntryPadding == header[0] && 
+           kLogFileEntryPadding == header[1];
+}
+
+// Write the descriptor of a record, wide if need be, to the start of its
+// prefix.  Returns the number of words written.  A removal of ID 0 is written
+// wide too, so that no descriptor is all zeroes like preallocated space, and
+// so is a record whose descriptor would read as padding.
+
+static inline size_t logFileEntryDescribe(uint32_t  *prefix,
+                                          LogStoreID id,
+                                          uint64_t   payloadSize,
+                                          uint32_t   flags)
+{
+    if (id < kLogFileEntryWide && payloadSize <= ~kLogFileEntryFlags &&
+        (0 != id || 0 != payloadSize || 0 != flags) &&
+        (kLogFileEntryPadding != id || 
+         kLogFileEntryPadding != (payloadSize | flags)))
     {
-        close(store->indexFileNo);
-        close(store->logFileNo);
-        free(store);
+        prefix[0] = id;
+        prefix[1] = payloadSize | flags;
 
-        return kLogStoreInputOutputError;
+        return 2;
     }
 
-    store->indexFileCapacity = indexFileStat.st_size / sizeof(IndexEntry);
+    prefix[0] = kLogFileEntryWide;
+    prefix[1] = flags;
+    prefix[2] = (uint32_t)id;
+    prefix[3] = id >> 32;
+    prefix[4] = (uint32_t)payloadSize;
+    prefix[5] = payloadSize >> 32;
 
-    // If needed, grow the (sparse) index file to hold a decent number of
-    // entries for mmap.
+    return 6;
+}
 
-    store->indexFileGrowthCount = 0;
+// Index file entries locate a record in the log and say what a get needs to
+// know to read it in one go: the flags of the record (its descriptor flags
+// and whether it is wide) in the high bits of its offset, the size of the
+// value, and the size of the payload if that differs (the value is
+// compressed).  An entry of an ID never put is all zeroes; one of a removed
+// ID has an offset of all ones.  Only entries of values have a size.
+//
+// A store may keep small values that are not compressed in their entries as
+// well (see LogStoreOptions.inlineSize), starting where the payload size of a
+// compressed one would be, so that gets of them do not read the log.  Entries
+// are 24 bytes, which leaves room for 4 bytes of value, or larger if need be;
+// the entry for id X is at byte offset 64+X*entrySize.  Only the first
+// entrySize bytes of an IndexEntry are stored.
+
+#define kIndexEntrySize       24
+#define kIndexEntryMaxSize    80
+#define kIndexEntryInlineAt   20
+
+typedef struct IndexEntry
+{
+    uint64_t         location;                     // [flags|offset]
+    uint64_t         size;                         // of the value
+    LogStoreRevision rev;
+    uint32_t         storedSize;                   // if compressed
+    char             more[kIndexEntryMaxSize - kIndexEntrySize];
+} IndexEntry;
+
+#define kIndexEntryOffsetMask (((uint64_t)1 << 59) - 1)
+#define kIndexEntryInline     ((uint64_t)1 << 59)
+#define kIndexEntryWide       ((uint64_t)1 << 60)
+#define kIndexEntryRemoved    UINT64_MAX
+
+// The index file starts with a header.  Its checkpoint is the size of the log
+// as of the last sync: the log up to there is on disk and so are the index
+// entries of its records.  While a store is open, its index is marked dirty;
+// it is marked clean at close once the log and index are on disk.  On open,
+// the records past the checkpoint, if any, are replayed into the index.
+//
+// Version 2 had 8-byte entries of a 16-bit revision and a 48-bit offset and a
+// 32-bit count; such an index is upgraded by rebuilding it from the whole log
+// (see indexFileUpgrade).  So is an index of the original format, which
+// started with just the count.
+
+#define kIndexFileMagic      0x5849534cU           // "LSIX"
+#define kIndexFileVersion    3
+#define kIndexFileHeaderSize 64
+
+enum
+{
+    kIndexFileClean,
+    kIndexFileDirty
+};
 
-    if (store->indexFileCapacity == 0)
-    {
-        char zero = 0;
-        off_t newEOF = kIndexFileGrowBy * sizeof(IndexEntry) - sizeof(char);
+typedef struct IndexFileHeader
+{
+    uint32_t       magic;
+    uint32_t       version;
+    uint32_t       state;                          // kIndexFileClean ...
+    uint32_t       entrySize;                      // bytes per entry
+    IndexFileCount count;                          // IDs made
+    uint64_t       checkpoint;                     // log offset
+    IndexFileCount windowFrom;                     // IDs written since open
+    IndexFileCount windowTo;                       // (see indexFileWiden)
+} IndexFileHeader;
 
-        int bytesWritten = 0;
+// The header of a version 2 index.
 
-        do
-        {
-            bytesWritten = pwrite(store->indexFileNo, &zero,
-                                  sizeof(char), newEOF);
-        }
-        while (bytesWritten == -1 && errno == EINTR);
+#define kIndexFileVersion2 2
 
-        if (bytesWritten < sizeof(char))
-        {
-            close(store->indexFileNo);
-            close(store->logFileNo);
-            free(store);
+typedef struct IndexFileHeader2
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t state;
+    uint64_t checkpoint;
+} IndexFileHeader2;
 
-            return kLogStoreInputOutputError;
+// Replaying the log into the index reads it this much at a time.
+
+#define kRebuildBufferSize (8 * 1024 * 1024)
+
+// Gets do not take the lock.  Instead, a get runs inside an epoch, and
+// whatever it might be using (the index mapping, the log file) is only
+// released after every get that started before it was replaced has finished.
+// Whoever replaces something calls epochSynchronize while holding the lock.
+
+static inline unsigned epochEnter(LogStore store)
+{
+    for (;;)
+    {
+        unsigned epoch = __atomic_load_n(&store->epoch, __ATOMIC_SEQ_CST);
+
+        __atomic_add_fetch(&store->epochReaders[epoch & 1], 1, 
+                           __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&store->epoch, __ATOMIC_SEQ_CST) == epoch)
+        {
+            return epoch;
         }
 
-        store->indexFileCapacity = kIndexFileGrowBy;
-        store->indexFileGrowthCount++;
+        __atomic_sub_fetch(&store->epochReaders[epoch & 1], 1, 
+                           __ATOMIC_SEQ_CST);
     }
+}
+
+static inline void epochExit(LogStore store, unsigned epoch)
+{
+    __atomic_sub_fetch(&store->epochReaders[epoch & 1], 1, __ATOMIC_SEQ_CST);
+}
 
-    // Get number of entries in the LogStore from the beginning
-    // of the index file.
+// Wait for the gets that might still see what was just replaced.
 
-    int bytesRead = 0;
+static void epochSynchronize(LogStore store)
+{
+    unsigned epoch = __atomic_fetch_add(&store->epoch, 1, __ATOMIC_SEQ_CST);
 
-    do
+    while (__atomic_load_n(&store->epochReaders[epoch & 1], __ATOMIC_SEQ_CST))
     {
-        bytesRead = read(store->indexFileNo, &store->indexFileCount,
-                         sizeof(store->indexFileCount));
+        sched_yield();
     }
-    while (bytesRead == -1 && errno == EINTR);
+}
 
-    if (bytesRead < sizeof(store->indexFileCount))
-    {
-        close(store->logFileNo);
-        close(store->indexFileNo);
-        free(store);
+// Since gets read index entries without the lock, writers (who hold the lock)
+// make the sequence number of the entry's stripe odd while changing it.  Gets
+// retry when they see an odd sequence number or when it changed during the
+// read.
 
-        return kLogStoreInputOutputError;
-    }
+static inline void indexSeqWriteBegin(LogStore store, LogStoreID id)
+{
+    __atomic_add_fetch(&store->indexSeq[id % kIndexSeqStripes], 1, 
+                       __ATOMIC_SEQ_CST);
+}
 
-    // Try to mmap the index file; falls back to regular file i/o on failure.
+static inline void indexSeqWriteEnd(LogStore store, LogStoreID id)
+{
+    __atomic_add_fetch(&store->indexSeq[id % kIndexSeqStripes], 1, 
+                       __ATOMIC_RELEASE);
+}
 
-    store->indexFileMappingSize = store->indexFileCapacity * sizeof(IndexEntry);
+// Changes that span the whole index (e.g. swapping in a compacted log file)
+// hold off gets of every entry.
 
-    store->indexFileMapping = mmap(0, store->indexFileMappingSize,
-                                   PROT_READ | PROT_WRITE,
-                                   MAP_SHARED, store->indexFileNo, 0);
+static void indexSeqWriteBeginAll(LogStore store)
+{
+    for (int i = 0; i < kIndexSeqStripes; ++i)
+    {
+        indexSeqWriteBegin(store, i);
+    }
+}
 
-    if (MAP_FAILED == store->indexFileMapping)
+static void indexSeqWriteEndAll(LogStore store)
+{
+    for (int i = 0; i < kIndexSeqStripes; ++i)
     {
-        store->indexFileMapping = NULL;
-        store->indexFileMappingSize = 0;
+        indexSeqWriteEnd(store, i);
     }
+}
 
-    // Create a mutex.
+// Everything logstore allocates comes from the store's allocator (see
+// LogStoreOptions), which defaults to malloc and free.
 
-    pthread_mutex_init(&store->mutex, NULL);
+static void *defaultAllocate(void *context, size_t size)
+{
+    return malloc(size);
+}
 
-    *sp = store;
+static void defaultDeallocate(void *context, void *pointer)
+{
+    free(pointer);
+}
 
-    return kLogStoreOK;
+static inline void *storeAllocate(LogStore store, size_t size)
+{
+    return store->allocator.allocate(store->allocator.context, size);
 }
 
-int LogStoreMakeID(LogStore store, LogStoreID *outID)
+static inline void storeFree(LogStore store, void *pointer)
 {
-    if (NULL == store || NULL == outID)
+    if (NULL != pointer)
     {
-        return kLogStoreInvalidParameter;
+        store->allocator.deallocate(store->allocator.context, pointer);
     }
+}
 
-    LogStoreLock;
+static void *storeReallocate(LogStore store, 
+                             void    *pointer, 
+                             size_t   oldSize, 
+                             size_t   newSize)
+{
+    void *newPointer = storeAllocate(store, newSize);
+
+    if (NULL != newPointer && NULL != pointer)
+    {
+        memcpy(newPointer, pointer, oldSize < newSize ? oldSize : newSize);
 
-    *outID = store->indexFileCount++;
+        storeFree(store, pointer);
+    }
+
+    return newPointer;
+}
 
-    // Save the number of used index entries in the index file (at offset 0).
+// Read exactly 'size' bytes from a file at a given offset.
 
-    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+static int readFully(int fileNo, void *buf, size_t size, off_t offset)
+{
+    while (size > 0)
     {
-        *(IndexFileCount *)store->indexFileMapping = store->indexFileCount;
+        ssize_t bytesRead = pread(fileNo, buf, size, offset);
+
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesRead <= 0)
+        {
+            return kLogStoreInputOutputError;
+        }
+
+        buf     = (char *)buf + bytesRead;
+        size   -= bytesRead;
+        offset += bytesRead;
     }
-    else
+
+    return kLogStoreOK;
+}
+
+// Write exactly 'size' bytes to a file at its current offset.
+
+static int writeFully(int fileNo, const void *buf, size_t size)
+{
+    while (size > 0)
     {
-        int bytesWritten = 0;
+        ssize_t bytesWritten = write(fileNo, buf, size);
 
-        do
+        if (bytesWritten == -1 && errno == EINTR)
         {
-            bytesWritten = pwrite(store->indexFileNo, &store->indexFileCount,
-                                  sizeof(store->indexFileCount), 0);
+            continue;
         }
-        while (bytesWritten == -1 && errno == EINTR);
 
-        if (bytesWritten < sizeof(store->indexFileCount))
+        if (bytesWritten <= 0)
         {
-            LogStoreUnlock;
-
             return kLogStoreInputOutputError;
         }
+
+        buf   = (const char *)buf + bytesWritten;
+        size -= bytesWritten;
     }
 
-    // If the index file is too big and we're using mmap to access its content,
-    // unmap, grow the file, and remap.
+    return kLogStoreOK;
+}
+
+// Allocate blocks for 'size' bytes of a file from 'offset' on, extending it
+// if need be.  Bytes not written before read as zeroes.  Returns 0 or an
+// errno value, EOPNOTSUPP if the file system or the system cannot.
 
-    if (store->indexFileCount == store->indexFileCapacity &&
-        NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+static int fileAllocate(int fileNo, off_t offset, off_t size)
+{
+#ifdef __linux__
+    while (-1 == fallocate(fileNo, 0, offset, size))
     {
-        char zero = 0;
-        off_t newSize;
+        if (EINTR != errno)
+        {
+            return ENOSYS == errno ? EOPNOTSUPP : errno;
+        }
+    }
+
+    return 0;
+#else
+    return EOPNOTSUPP;
+#endif
+}
 
-        munmap(store->indexFileMapping, store->indexFileMappingSize);
+// Write out all of the given iovecs at 'offset' unless an error occurs.
+// Returns the number of bytes written.
 
-        store->indexFileCapacity += kIndexFileGrowBy;
-        newSize = store->indexFileCapacity * sizeof(IndexEntry);
+static size_t writevFully(int           fileNo,
+                          struct iovec *iov,
+                          int           count,
+                          off_t         offset)
+{
+    size_t total = 0;
 
-        int bytesWritten = 0;
+    while (count > 0)
+    {
+        ssize_t bytesWritten = pwritev(fileNo, iov, count, offset + total);
 
-        do
+        if (bytesWritten == -1 && errno == EINTR)
         {
-            bytesWritten = pwrite(store->indexFileNo, &zero, sizeof(char),
-                                  newSize - sizeof(char));
+            continue;
         }
-        while (bytesWritten == -1 && errno == EINTR);
 
-        if (bytesWritten < sizeof(char))
+        if (bytesWritten <= 0)
         {
-            LogStoreUnlock;
-
-            return kLogStoreInputOutputError;
+            break;
         }
 
-        store->indexFileGrowthCount++;
-
-        store->indexFileMapping = mmap(0, newSize, PROT_READ | PROT_WRITE,
-                                       MAP_SHARED, store->indexFileNo, 0);
+        total += bytesWritten;
 
-        if (MAP_FAILED == store->indexFileMapping)
+        while (count > 0 && bytesWritten >= iov->iov_len)
         {
-            store->indexFileMapping = NULL;
-            store->indexFileMappingSize = 0;
+            bytesWritten -= iov->iov_len;
+            iov++;
+            count--;
         }
-        else
+
+        if (count > 0)
         {
-            store->indexFileMappingSize = newSize;
+            iov->iov_base  = (char *)iov->iov_base + bytesWritten;
+            iov->iov_len  -= bytesWritten;
         }
     }
 
-    LogStoreUnlock;
-
-    return kLogStoreOK;
+    return total;
 }
 
-// Get the log-file offset given an index file entry.
+// Read into all of the given iovecs unless an error or EOF occurs.  Returns
+// the number of bytes read.
 
-static inline off_t indexEntryGetOffset(IndexEntry e)
+static size_t readvFully(int fileNo, struct iovec *iov, int count, off_t offset)
 {
-    return e & 0x0000ffffffffffff;
+    size_t total = 0;
+
+    while (count > 0)
+    {
+        ssize_t bytesRead = preadv(fileNo, iov, count, offset + total);
+
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesRead <= 0)
+        {
+            break;
+        }
+
+        total += bytesRead;
+
+        while (count > 0 && bytesRead >= iov->iov_len)
+        {
+            bytesRead -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0)
+        {
+            iov->iov_base  = (char *)iov->iov_base + bytesRead;
+            iov->iov_len  -= bytesRead;
+        }
+    }
+
+    return total;
 }
 
-// Get the revision of a given index file entry.
+// The append buffer (see LogStoreOptions.appendBufferSize) holds what has been
+// appended to the log after the 'logFileSize' bytes written to the file.  It
+// changes under both the lock and the append mutex.  Gets that read it take
+// only the append mutex, since whoever holds the lock may be waiting for them
+// (see epochSynchronize).  A record straddles the file and the buffer only
+// after a failed write.
 
-static inline LogStoreRevision indexEntryGetRevision(IndexEntry e)
+// A direct store (kLogStoreOptionDirect) reads and writes its log this many
+// bytes at a time, from and to memory aligned to as many.
+
+#define kDirectBlockSize         4096
+#define kDirectDefaultBufferSize (1024 * 1024)
+#define kDirectPadding           0xfe            // see kLogFileEntryPadding
+
+static inline size_t directBlocksFor(size_t size)
 {
-    return (e & 0xffff000000000000) >> 48;
+    return (size + kDirectBlockSize - 1) / kDirectBlockSize * kDirectBlockSize;
 }
 
-// Make an index file entry (offset and revision).
+// Allocate block-aligned memory.  '*outMemory' is what to free.
 
-static inline IndexEntry indexEntryMake(off_t ofs, LogStoreRevision rev)
+static char *storeAllocateBlocks(LogStore store, size_t size, char **outMemory)
 {
-    IndexEntry e = rev;
+    char *memory = storeAllocate(store, size + kDirectBlockSize);
 
-    e <<= 48;
-    e |= (ofs & 0x0000ffffffffffff);
+    *outMemory = memory;
 
-    return e;
+    if (NULL == memory)
+    {
+        return NULL;
+    }
+
+    return memory + (kDirectBlockSize - (uintptr_t)memory % kDirectBlockSize) % 
+                    kDirectBlockSize;
 }
 
-// The index file starts with a count then continues with N entries.
+// The offset of the next record appended to the log.  The caller holds the
+// lock.
 
-static inline off_t indexFileOffsetOf(LogStoreID id)
+static inline off_t logFileEnd(LogStore store)
 {
-    return sizeof(IndexFileCount) + (id * sizeof(IndexEntry));
+    return store->logFileSize + store->appendBufferSize;
 }
 
-// Read an entry from the index file using the mmap if available.
+// Get ready to write the log file up to 'end'.  With preallocation (see
+// LogStoreOptions.preallocateSize), the file is extended past it to the next
+// multiple of the preallocation size.  Should that fail, the write extends
+// the file as it would without; a file system that cannot preallocate is not
+// asked again.  The caller holds the append mutex.
 
-static inline int indexFileRead(LogStore    store,
-                                LogStoreID  id,
-                                IndexEntry *outIndexEntry)
+static void logFileReserve(LogStore store, off_t end)
 {
-    if (id > store->indexFileCapacity)
+    size_t chunk = store->logFilePreallocate;
+
+    if (0 == chunk || end <= store->logFileAllocated)
     {
-        return kLogStoreInvalidParameter;
+        return;
     }
 
-    off_t offset = indexFileOffsetOf(id);
+    off_t allocated = (end + chunk - 1) / chunk * chunk;
 
-    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+    int error = fileAllocate(store->logFileNo, store->logFileAllocated, 
+                             allocated - store->logFileAllocated);
+
+    if (0 == error)
     {
-        *outIndexEntry = *(IndexEntry *)((char *)store->indexFileMapping + offset);
+        store->logFileAllocated = allocated;
     }
-    else
+    else if (EOPNOTSUPP == error)
     {
-        int bytesRead = 0;
+        store->logFilePreallocate = 0;
+    }
+}
 
-        do
+// Note that the log file was written up to 'end'.
+
+static inline void logFileWrote(LogStore store, off_t end)
+{
+    if (end > store->logFileAllocated)
+    {
+        store->logFileAllocated = end;
+    }
+}
+
+// A direct store writes its append buffer in whole blocks at their offsets.
+// The buffer starts with a copy of the last, partial block of the log file
+// (see logFileDirectBegin), and the file is padded to the end of the last
+// block written with bytes (kDirectPadding) that no record starts with:
+// replay cuts the padding off after a crash, as it would a torn record.
+// Zeroes would read as removals of ID 0.  Closing truncates the padding.  The
+// caller holds the append mutex.
+
+static int appendBufferWriteDirect(LogStore store)
+{
+    char  *block  = store->appendBufferBlock;
+    size_t head   = store->appendBuffer - block;
+    size_t length = head + store->appendBufferSize;
+    size_t padded = directBlocksFor(length);
+    off_t  offset = store->logFileSize - head;
+
+    memset(block + length, kDirectPadding, padded - length);
+
+    logFileReserve(store, offset + padded);
+
+    for (size_t written = 0; written < padded; )
+    {
+        ssize_t bytesWritten = pwrite(store->logFileNo, block + written, 
+                                      padded - written, offset + written);
+
+        if (bytesWritten == -1 && errno == EINTR)
         {
-            bytesRead = pread(store->indexFileNo, outIndexEntry,
-                              sizeof(IndexEntry), offset);
+            continue;
         }
-        while (bytesRead == -1 && errno == EINTR);
 
-        if (bytesRead < sizeof(IndexEntry))
+        if (bytesWritten <= 0)
         {
             return kLogStoreInputOutputError;
         }
+
+        written += bytesWritten;
     }
 
+    logFileWrote(store, offset + padded);
+
+    __atomic_store_n(&store->logFileSize, 
+                     store->logFileSize + store->appendBufferSize,
+                     __ATOMIC_RELEASE);
+
+    size_t tail = length % kDirectBlockSize;
+
+    memmove(block, block + length - tail, tail);
+
+    store->appendBuffer     = block + tail;
+    store->appendBufferSize = 0;
+
     return kLogStoreOK;
 }
 
-// Write an entry to the index file using the mmap if available.
+// Write out the append buffer.  The caller holds the append mutex.
 
-static inline int indexFileWrite(LogStore         store,
-                                 LogStoreID       id,
-                                 off_t            newEntryOffset,
-                                 LogStoreRevision newEntryRevision)
+static int appendBufferWrite(LogStore store)
 {
-    if (id >= store->indexFileCapacity)
+    if (NULL != store->appendBufferBlock && store->appendBufferSize > 0)
     {
-        return kLogStoreInvalidParameter;
+        return appendBufferWriteDirect(store);
     }
 
-    IndexEntry entry = indexEntryMake(newEntryOffset, newEntryRevision);
+    size_t written = 0;
 
-    off_t offset = indexFileOffsetOf(id);
+    logFileReserve(store, logFileEnd(store));
 
-    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+    while (written < store->appendBufferSize)
     {
-        *(IndexEntry *)((char *)store->indexFileMapping + offset) = entry;
-    }
-    else
-    {
-        int bytesWritten = 0;
+        ssize_t bytesWritten = pwrite(store->logFileNo, 
+                                      store->appendBuffer + written,
+                                      store->appendBufferSize - written,
+                                      store->logFileSize + written);
 
-        do
+        if (bytesWritten == -1 && errno == EINTR)
         {
-            bytesWritten = pwrite(store->indexFileNo, &entry,
-                                  sizeof(IndexEntry), offset);
+            continue;
         }
-        while (bytesWritten == -1 && errno == EINTR);
 
-        if (bytesWritten < sizeof(IndexEntry))
+        if (bytesWritten <= 0)
         {
-            return kLogStoreInputOutputError;
+            break;
+        }
+
+        written += bytesWritten;
+    }
+
+    if (0 == written)
+    {
+        return 0 == store->appendBufferSize ? kLogStoreOK : 
+                                              kLogStoreInputOutputError;
+    }
+
+    // Gets read below the size of the file without the lock, so it grows
+    // only once the bytes are there.  Whatever was not written stays
+    // buffered, at the same offsets.
+
+    logFileWrote(store, store->logFileSize + written);
+
+    __atomic_store_n(&store->logFileSize, store->logFileSize + written, 
+                     __ATOMIC_RELEASE);
+
+    store->appendBufferSize -= written;
+
+    memmove(store->appendBuffer, store->appendBuffer + written, 
+            store->appendBufferSize);
+
+    return 0 == store->appendBufferSize ? kLogStoreOK : 
+                                          kLogStoreInputOutputError;
+}
+
+// Write out the append buffer.  The caller holds the lock.
+
+static int appendBufferFlush(LogStore store)
+{
+    pthread_mutex_lock(&store->appendMutex);
+
+    int result = appendBufferWrite(store);
+
+    pthread_mutex_unlock(&store->appendMutex);
+
+    return result;
+}
+
+// Append to the log: to the append buffer if there is one and the bytes fit
+// in it, or else to the file.  Returns the number of bytes appended, which is
+// less than asked on failure.  The caller holds the append mutex.
+
+static size_t logFileAppendLocked(LogStore store, struct iovec *iov, int count)
+{
+    size_t size = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        size += iov[i].iov_len;
+    }
+
+    // A direct store appends only through its buffer, a buffer's worth at a
+    // time, and does not leave a record larger than that half written.
+
+    size_t capacity = store->appendBufferCapacity;
+
+    if (NULL != store->appendBuffer && 
+        (size <= capacity || NULL != store->appendBufferBlock))
+    {
+        if (NULL == store->appendBufferBlock &&
+            size > capacity - store->appendBufferSize &&
+            kLogStoreOK != appendBufferWrite(store))
+        {
+            return 0;
+        }
+
+        // The grower flushes the buffer when the interval is up.
+
+        if (0 == store->appendBufferSize && store->flushInterval > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &store->appendBufferSince);
+
+            pthread_cond_signal(&store->growCond);
+        }
+
+        size_t appended = 0;
+
+        for (int i = 0; i < count; ++i)
+        {
+            const char *p    = iov[i].iov_base;
+            size_t      left = iov[i].iov_len;
+
+            while (left > 0)
+            {
+                if (capacity == store->appendBufferSize &&
+                    kLogStoreOK != appendBufferWrite(store))
+                {
+                    return appended;
+                }
+
+                size_t piece = capacity - store->appendBufferSize;
+
+                if (piece > left)
+                {
+                    piece = left;
+                }
+
+                memcpy(store->appendBuffer + store->appendBufferSize, p, piece);
+
+                store->appendBufferSize += piece;
+                appended                += piece;
+                p                       += piece;
+                left                    -= piece;
+            }
+        }
+
+        if (size > capacity && kLogStoreOK != appendBufferWrite(store))
+        {
+            return 0;
+        }
+
+        return appended;
+    }
+
+    if (kLogStoreOK != appendBufferWrite(store))
+    {
+        return 0;
+    }
+
+    logFileReserve(store, store->logFileSize + size);
+
+    size_t written = writevFully(store->logFileNo, iov, count, 
+                                 store->logFileSize);
+
+    logFileWrote(store, store->logFileSize + written);
+
+    __atomic_store_n(&store->logFileSize, store->logFileSize + written, 
+                     __ATOMIC_RELEASE);
+
+    return written;
+}
+
+// Append to the log.  The caller holds the lock.
+
+static size_t logFileAppend(LogStore store, struct iovec *iov, int count)
+{
+    pthread_mutex_lock(&store->appendMutex);
+
+    size_t appended = logFileAppendLocked(store, iov, count);
+
+    pthread_mutex_unlock(&store->appendMutex);
+
+    return appended;
+}
+
+// Start appending to a direct store's log with O_DIRECT: keep a copy of its
+// last, partial block at the start of the append buffer, and switch the
+// descriptor over.  The caller holds the lock, or has the store to itself.
+
+static int logFileDirectBegin(LogStore store)
+{
+    size_t head  = store->logFileSize % kDirectBlockSize;
+    int    flags = fcntl(store->logFileNo, F_GETFL);
+
+    if (head > 0 && 
+        kLogStoreOK != readFully(store->logFileNo, store->appendBufferBlock, 
+                                 head, store->logFileSize - head))
+    {
+        return kLogStoreInputOutputError;
+    }
+
+    if (-1 == flags || 
+        -1 == fcntl(store->logFileNo, F_SETFL, 
+                    flags | kDirectOpenFlag))
+    {
+        return kLogStoreInputOutputError;
+    }
+
+    store->appendBuffer     = store->appendBufferBlock + head;
+    store->appendBufferSize = 0;
+
+    return kLogStoreOK;
+}
+
+// Read into iovecs from a direct store's log: the blocks the bytes lie in are
+// read whole into aligned memory and the bytes copied out.  Returns the
+// number of bytes read, as readvFully does.
+
+static size_t logFileReadBlocks(LogStore      store,
+                                int           logFileNo,
+                                struct iovec *iov,
+                                int           count,
+                                off_t         offset)
+{
+    size_t size = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        size += iov[i].iov_len;
+    }
+
+    off_t  start  = offset / kDirectBlockSize * kDirectBlockSize;
+    size_t skip   = offset - start;
+    size_t length = directBlocksFor(skip + size);
+    char  *memory = NULL;
+    char  *blocks = storeAllocateBlocks(store, length, &memory);
+    size_t got    = 0;
+
+    while (NULL != blocks && got < skip + size)
+    {
+        ssize_t bytesRead = pread(logFileNo, blocks + got, length - got, 
+                                  start + got);
+
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesRead <= 0)
+        {
+            break;
+        }
+
+        got += bytesRead;
+    }
+
+    size_t copied = got > skip + size ? size : got > skip ? got - skip : 0;
+    size_t left   = copied;
+
+    for (int i = 0; i < count && left > 0; ++i)
+    {
+        size_t piece = iov[i].iov_len < left ? iov[i].iov_len : left;
+
+        memcpy(iov[i].iov_base, blocks + skip, piece);
+
+        skip += piece;
+        left -= piece;
+    }
+
+    storeFree(store, memory);
+
+    return copied;
+}
+
+// Read into iovecs from a log file, as readvFully does.
+
+static inline size_t logFileReadFile(LogStore      store,
+                                     int           logFileNo,
+                                     struct iovec *iov,
+                                     int           count,
+                                     off_t         offset)
+{
+    return NULL != store->appendBufferBlock ? 
+           logFileReadBlocks(store, logFileNo, iov, count, offset) :
+           readvFully(logFileNo, iov, count, offset);
+}
+
+// Make a handle for a log file descriptor, referred to once.
+
+static struct LogFileHandle *logFileHandleMake(LogStore store, int logFileNo)
+{
+    struct LogFileHandle *handle = storeAllocate(store, 
+                                                 sizeof(struct LogFileHandle));
+
+    if (NULL != handle)
+    {
+        handle->logFileNo = logFileNo;
+        handle->refCount  = 1;
+    }
+
+    return handle;
+}
+
+// Drop a reference to a log file handle, closing the log file with the last.
+
+static void logFileHandleRelease(LogStore store, struct LogFileHandle *handle)
+{
+    if (NULL != handle &&
+        0 == __atomic_sub_fetch(&handle->refCount, 1, __ATOMIC_ACQ_REL))
+    {
+        close(handle->logFileNo);
+        storeFree(store, handle);
+    }
+}
+
+// Take a reference to the handle of the given log file descriptor, keeping it
+// open after the epoch the caller is in.  Returns NULL if that is no longer
+// the store's log.
+
+static struct LogFileHandle *logFileHandleAcquire(LogStore store, 
+                                                  int      logFileNo)
+{
+    struct LogFileHandle *handle = __atomic_load_n(&store->logFileHandle,
+                                                   __ATOMIC_ACQUIRE);
+
+    if (NULL == handle || handle->logFileNo != logFileNo)
+    {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&handle->refCount, 1, __ATOMIC_ACQ_REL);
+
+    return handle;
+}
+
+// Scans read the log through the page cache, a direct store's too, since
+// they read it in pieces that need not be aligned.  Returns the descriptor to
+// read, or -1.
+
+static int logFileScanBegin(LogStore store)
+{
+    if (NULL == store->appendBufferBlock)
+    {
+        return store->logFileNo;
+    }
+
+    return open(store->logFilePath, O_RDONLY | kOtherOpenFlags);
+}
+
+static void logFileScanEnd(LogStore store, int fileNo)
+{
+    if (NULL != store->appendBufferBlock && -1 != fileNo)
+    {
+        close(fileNo);
+    }
+}
+
+// Read into all of the given iovecs from 'offset' in a log (the store's, or
+// one it has since compacted away), like readvFully.  What lies beyond the
+// bytes written to the file is read under the append mutex: from the append
+// buffer, or from the file if it has been flushed meanwhile.  A record
+// straddles the two when a direct store flushed a full buffer in its middle,
+// or after a failed write.
+
+static size_t logFileReadv(LogStore      store, 
+                           int           logFileNo, 
+                           struct iovec *iov, 
+                           int           count, 
+                           off_t         offset)
+{
+    size_t size = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        size += iov[i].iov_len;
+    }
+
+    if (offset + size <= __atomic_load_n(&store->logFileSize, __ATOMIC_ACQUIRE))
+    {
+        return logFileReadFile(store, logFileNo, iov, count, offset);
+    }
+
+    pthread_mutex_lock(&store->appendMutex);
+
+    if (logFileNo != store->logFileNo || offset + size <= store->logFileSize)
+    {
+        size = logFileReadFile(store, logFileNo, iov, count, offset);
+    }
+    else if (offset + size > logFileEnd(store))
+    {
+        size = 0;
+    }
+    else
+    {
+        // The part of the record in the file is read from it.
+
+        size_t       inFile = offset < store->logFileSize ? 
+                              store->logFileSize - offset : 0;
+        size_t       done   = 0;
+        struct iovec head[count];
+        int          n      = 0;
+
+        for ( ; n < count && done < inFile; ++n)
+        {
+            head[n] = iov[n];
+
+            if (head[n].iov_len > inFile - done)
+            {
+                head[n].iov_len = inFile - done;
+            }
+
+            done += head[n].iov_len;
+        }
+
+        if (inFile > 0 && 
+            inFile != logFileReadFile(store, logFileNo, head, n, offset))
+        {
+            size = 0;
+        }
+
+        const char *p    = store->appendBuffer + (offset + inFile - 
+                                                  store->logFileSize);
+        size_t      skip = inFile;
+
+        for (int i = 0; i < count && size > 0; ++i)
+        {
+            size_t len = iov[i].iov_len;
+
+            if (skip >= len)
+            {
+                skip -= len;
+
+                continue;
+            }
+
+            memcpy((char *)iov[i].iov_base + skip, p, len - skip);
+
+            p    += len - skip;
+            skip  = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&store->appendMutex);
+
+    return size;
+}
+
+// Get the log-file offset given an index file entry.
+
+static inline off_t indexEntryGetOffset(IndexEntry e)
+{
+    return e.location & kIndexEntryOffsetMask;
+}
+
+// Get the revision of a given index file entry.
+
+static inline LogStoreRevision indexEntryGetRevision(IndexEntry e)
+{
+    return e.rev;
+}
+
+// Does the entry name a value (rather than no value or a removed one)?
+
+static inline int indexEntryHasValue(IndexEntry e)
+{
+    return 0 != e.size && kIndexEntryRemoved != e.location;
+}
+
+static inline int indexEntryIsRemoved(IndexEntry e)
+{
+    return kIndexEntryRemoved == e.location;
+}
+
+// The descriptor flags of the record an entry refers to.
+
+static inline uint32_t indexEntryGetFlags(IndexEntry e)
+{
+    return (uint32_t)(e.location >> 32) & kLogFileEntryFlags;
+}
+
+// The descriptor of the record an entry refers to, less its ID and size:
+// enough to learn the size of the record's prefix.
+
+static inline void indexEntryGetHeader(IndexEntry e, uint32_t *header)
+{
+    header[0] = e.location & kIndexEntryWide ? kLogFileEntryWide : 0;
+    header[1] = indexEntryGetFlags(e);
+}
+
+static inline size_t indexEntryGetPrefixSize(IndexEntry e)
+{
+    LogFileEntryHeader header;
+
+    indexEntryGetHeader(e, header);
+
+    return logFileEntryPrefixSize(header);
+}
+
+// The size of the payload of the record an entry refers to.
+
+static inline uint64_t indexEntryGetPayloadSize(IndexEntry e)
+{
+    return indexEntryGetFlags(e) & kLogFileEntryCompressed ? e.storedSize 
+                                                           : e.size;
+}
+
+// Make an index file entry for a record (given its prefix) at an offset in
+// the log, of a value of 'size' bytes.
+
+static inline IndexEntry indexEntryMake(off_t            offset,
+                                        const uint32_t  *prefix,
+                                        uint64_t         size,
+                                        LogStoreRevision rev)
+{
+    IndexEntry e;
+
+    e.location   = (offset & kIndexEntryOffsetMask) | 
+                   (uint64_t)(prefix[1] & kLogFileEntryFlags) << 32 |
+                   (logFileEntryIsWide(prefix) ? kIndexEntryWide : 0);
+    e.size       = size;
+    e.rev        = rev;
+    e.storedSize = prefix[1] & kLogFileEntryCompressed ? 
+                   logFileEntryPayloadSize(prefix) : 0;
+
+    return e;
+}
+
+// The entry of a removed ID.
+
+static inline IndexEntry indexEntryRemoved(void)
+{
+    IndexEntry e = { kIndexEntryRemoved, 0, (LogStoreRevision) -1, 0 };
+
+    return e;
+}
+
+// The copy of the value an entry keeps, if it has kIndexEntryInline.
+
+static inline char *indexEntryInlineValue(IndexEntry *e)
+{
+    return (char *)e + kIndexEntryInlineAt;
+}
+
+// Keep a copy of the value in an entry of it if there is room.  The payload of
+// a record that is not compressed is the value.
+
+static inline void indexEntryKeepValue(LogStore    store,
+                                       IndexEntry *e,
+                                       const void *payload)
+{
+    if (!(indexEntryGetFlags(*e) & kLogFileEntryCompressed) &&
+        e->size <= store->inlineSize)
+    {
+        e->location |= kIndexEntryInline;
+
+        memcpy(indexEntryInlineValue(e), payload, e->size);
+    }
+}
+
+// The size of the entries a store keeping values of up to 'inlineSize' bytes
+// inline needs, or 0 for any size.
+
+static inline size_t indexEntrySizeFor(size_t inlineSize)
+{
+    size_t size = (kIndexEntryInlineAt + inlineSize + 7) / 8 * 8;
+
+    return 0 == inlineSize ? 0 : 
+           size < kIndexEntrySize ? kIndexEntrySize : size;
+}
+
+// The size of an index file with room for 'capacity' entries, in whole pages
+// so that the mapping of an extension starts where the last one ended.
+
+static inline off_t indexFileSizeFor(LogStore store, uint64_t capacity)
+{
+    off_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t size     = kIndexFileHeaderSize + 
+                     capacity * store->indexFileEntrySize;
+
+    return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+static inline uint64_t indexFileCapacityOf(LogStore store, off_t size)
+{
+    return (size - kIndexFileHeaderSize) / store->indexFileEntrySize;
+}
+
+// Extend the index file to 'size' bytes.  A store that preallocates its log
+// (see LogStoreOptions.preallocateSize) allocates the blocks of its index
+// from 'from' on as well.  A sparse index gets its blocks as entries are
+// stored through the mapping, scattered over the disk, and a full disk then
+// kills the process with SIGBUS rather than failing the put; but making a
+// great many IDs costs next to nothing.  Where blocks cannot be allocated
+// ahead, the file is extended sparse all the same.
+
+static int indexFileExtend(LogStore store, off_t from, off_t size)
+{
+    int error = EOPNOTSUPP;
+
+    if (store->logFilePreallocate > 0)
+    {
+        error = fileAllocate(store->indexFileNo, from, size - from);
+    }
+
+    if (EOPNOTSUPP == error && -1 != ftruncate(store->indexFileNo, size))
+    {
+        error = 0;
+    }
+
+    return 0 == error ? kLogStoreOK : kLogStoreInputOutputError;
+}
+
+// The grower is woken once the count of IDs made reaches this.
+
+static inline uint64_t indexFileGrowAtFor(uint64_t capacity)
+{
+    return capacity - capacity / 4;
+}
+
+// The index file starts with a header then continues with N entries.
+
+static inline off_t indexFileOffsetOf(LogStore store, LogStoreID id)
+{
+    return kIndexFileHeaderSize + ((off_t)id * store->indexFileEntrySize);
+}
+
+// Read an entry from the index file using the mmap if available.
+
+static inline int indexFileRead(LogStore    store,
+                                LogStoreID  id,
+                                IndexEntry *outIndexEntry)
+{
+    if (id > store->indexFileCapacity)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    off_t  offset    = indexFileOffsetOf(store, id);
+    size_t entrySize = store->indexFileEntrySize;
+
+    if (NULL != store->indexFileMapping && 
+        offset + entrySize <= store->indexFileMappingSize)
+    {
+        memcpy(outIndexEntry, (char *)store->indexFileMapping + offset, 
+               entrySize);
+    }
+    else
+    {
+        int bytesRead = 0;
+
+        do
+        {
+            bytesRead = pread(store->indexFileNo, outIndexEntry,
+                              entrySize, offset);
+        }
+        while (bytesRead == -1 && errno == EINTR);
+
+        if (bytesRead < (int)entrySize)
+        {
+            return kLogStoreInputOutputError;
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+// Note that 'size' bytes of entries at 'offset' of the index were written,
+// for the next sync to write back.  The header is noted apart, so that the
+// range stays that of the entries.  The caller holds the lock.
+
+static inline void indexFileDirty(LogStore store, off_t offset, size_t size)
+{
+    if (0 == store->indexFileDirtyTo || offset < store->indexFileDirtyFrom)
+    {
+        store->indexFileDirtyFrom = offset;
+    }
+
+    if (offset + size > store->indexFileDirtyTo)
+    {
+        store->indexFileDirtyTo = offset + size;
+    }
+}
+
+// Store an entry to the index file using the mmap if available.  The caller
+// holds the lock and has begun a write of the entry's sequence number.
+
+static inline int indexFileStore(LogStore   store, 
+                                 LogStoreID id, 
+                                 IndexEntry entry)
+{
+    off_t  offset    = indexFileOffsetOf(store, id);
+    size_t entrySize = store->indexFileEntrySize;
+
+    indexFileDirty(store, offset, entrySize);
+
+    if (NULL != store->indexFileMapping && 
+        offset + entrySize <= store->indexFileMappingSize)
+    {
+        memcpy((char *)store->indexFileMapping + offset, &entry, entrySize);
+    }
+    else
+    {
+        int bytesWritten = 0;
+
+        do
+        {
+            bytesWritten = pwrite(store->indexFileNo, &entry,
+                                  entrySize, offset);
+        }
+        while (bytesWritten == -1 && errno == EINTR);
+
+        if (bytesWritten < (int)entrySize)
+        {
+            return kLogStoreInputOutputError;
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+// Wait for an in-flight flush (see LogStoreSync) to finish.  The flush is done
+// without holding the lock, so the log file and index mapping it uses must not
+// be replaced under it.  The caller holds the lock.
+
+static void syncWait(LogStore store)
+{
+    while (store->syncInProgress)
+    {
+        pthread_cond_wait(&store->syncCond, &store->mutex);
+    }
+}
+
+// Write the index file header, with the store's count of IDs, checkpoint
+// and window.  Uses the mmap if available.
+
+static int indexFileHeaderWrite(LogStore store, uint32_t state)
+{
+    IndexFileHeader header = 
+    { 
+        kIndexFileMagic, kIndexFileVersion, state, store->indexFileEntrySize,
+        store->indexFileReserved, store->indexFileCheckpoint, 
+        store->indexFileWindowFrom, store->indexFileWindowTo
+    };
+
+    store->indexFileHeaderDirty = 1;
+
+    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+    {
+        memcpy(store->indexFileMapping, &header, sizeof(header));
+
+        return kLogStoreOK;
+    }
+
+    int bytesWritten = 0;
+
+    do
+    {
+        bytesWritten = pwrite(store->indexFileNo, &header, sizeof(header), 0);
+    }
+    while (bytesWritten == -1 && errno == EINTR);
+
+    if (bytesWritten < sizeof(header))
+    {
+        return kLogStoreInputOutputError;
+    }
+
+    return kLogStoreOK;
+}
+
+// Flush the first 'size' bytes of the index file to disk.
+
+static int indexFileFlush(LogStore store, size_t size)
+{
+    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+    {
+        if (size > store->indexFileMappingSize)
+        {
+            size = store->indexFileMappingSize;
+        }
+
+        if (-1 == msync(store->indexFileMapping, size, MS_SYNC))
+        {
+            return kLogStoreInputOutputError;
+        }
+    }
+    else if (-1 == fdatasync(store->indexFileNo))
+    {
+        return kLogStoreInputOutputError;
+    }
+
+    return kLogStoreOK;
+}
+
+// Write back what a sync found written to the index since the last one (see
+// indexFileDirty): entries [from, to) and the header, if dirty, at the given
+// durability.  What lies beyond the mapping was written to the file, which
+// is then synced whole.  The caller has a sync in progress, so 'mapping'
+// stays mapped.
+
+static int indexFileSyncRange(LogStore store, 
+                              char    *mapping, 
+                              size_t   mappingSize,
+                              size_t   from,
+                              size_t   to,
+                              int      headerDirty,
+                              int      durability)
+{
+    if (0 == to && !headerDirty)
+    {
+        return kLogStoreOK;
+    }
+
+    if (NULL == mapping || to > mappingSize)
+    {
+        int failed = kLogStoreDurabilityFull == durability ? 
+                     fsync(store->indexFileNo) : 
+                     fdatasync(store->indexFileNo);
+
+        return -1 == failed ? kLogStoreInputOutputError : kLogStoreOK;
+    }
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+
+    from = from / pageSize * pageSize;
+
+    if ((headerDirty && -1 == msync(mapping, kIndexFileHeaderSize, MS_SYNC)) ||
+        (to > 0 && -1 == msync(mapping + from, to - from, MS_SYNC)))
+    {
+        return kLogStoreInputOutputError;
+    }
+
+    return kLogStoreOK;
+}
+
+// Start writing back the log past the checkpoint and then what was written
+// to the index since the last sync, without waiting for either (see
+// kLogStoreDurabilityOrdered).  The caller holds the lock.
+
+static int storeStartWriteBack(LogStore store)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+    size_t from = store->indexFileDirtyFrom;
+    size_t to   = store->indexFileDirtyTo;
+
+    if (-1 == sync_file_range(store->logFileNo, store->indexFileCheckpoint, 0,
+                              SYNC_FILE_RANGE_WRITE) ||
+        (store->indexFileHeaderDirty &&
+         -1 == sync_file_range(store->indexFileNo, 0, kIndexFileHeaderSize,
+                               SYNC_FILE_RANGE_WRITE)) ||
+        (to > 0 && 
+         -1 == sync_file_range(store->indexFileNo, from, to - from, 
+                               SYNC_FILE_RANGE_WRITE)))
+    {
+        return kLogStoreInputOutputError;
+    }
+#endif
+
+    return kLogStoreOK;
+}
+
+// Unmap the index file, and the address space reserved for it.
+
+static void indexFileUnmap(LogStore store)
+{
+    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+    {
+        munmap(store->indexFileMapping, 
+               store->indexFileAddressSpace > 0 ? 
+               store->indexFileAddressSpace : store->indexFileMappingSize);
+    }
+}
+
+// Map the index file, into address space reserved for the largest index
+// there may be if possible.  Falls back to regular file i/o on failure.
+
+static void indexFileMap(LogStore store)
+{
+    size_t size  = indexFileSizeFor(store, store->indexFileCapacity);
+    size_t space = indexFileSizeFor(store, kIndexFileMaxCapacity);
+    void  *base  = MAP_FAILED;
+
+    if (sizeof(void *) >= sizeof(uint64_t))
+    {
+        base = mmap(0, space, PROT_NONE, 
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+
+    void *mapping = MAP_FAILED;
+
+    if (MAP_FAILED != base)
+    {
+        mapping = mmap(base, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_FIXED, store->indexFileNo, 0);
+
+        if (MAP_FAILED == mapping)
+        {
+            munmap(base, space);
+        }
+        else
+        {
+            store->indexFileAddressSpace = space;
+        }
+    }
+
+    if (MAP_FAILED == mapping)
+    {
+        mapping = mmap(0, size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, store->indexFileNo, 0);
+    }
+
+    if (MAP_FAILED == mapping)
+    {
+        store->indexFileMapping     = NULL;
+        store->indexFileMappingSize = 0;
+    }
+    else
+    {
+        store->indexFileMapping     = mapping;
+        store->indexFileMappingSize = size;
+    }
+}
+
+// Grow the index file to hold at least 'capacity' entries, doubling it.  If
+// we're using mmap to access its content, map the extension right after the
+// current mapping.  Failing that, map the grown file anew and only then
+// unmap the old mapping once no get is using it anymore.  Should the new
+// mapping fail, entries beyond the old mapping are accessed with file i/o.
+// The caller holds the lock.
+
+static int indexFileGrow(LogStore store, uint64_t capacity)
+{
+    uint64_t newCapacity = store->indexFileCapacity;
+
+    while (newCapacity < capacity)
+    {
+        newCapacity = newCapacity < kIndexFileGrowBy ? 
+                      kIndexFileGrowBy : newCapacity * 2;
+    }
+
+    if (newCapacity > kIndexFileMaxCapacity)
+    {
+        newCapacity = kIndexFileMaxCapacity;
+    }
+
+    if (newCapacity < capacity)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    off_t oldSize = 0 == store->indexFileCapacity ? 0 : 
+                    indexFileSizeFor(store, store->indexFileCapacity);
+    off_t newSize = indexFileSizeFor(store, newCapacity);
+    int   result  = indexFileExtend(store, oldSize, newSize);
+
+    if (kLogStoreOK != result)
+    {
+        return result;
+    }
+
+    store->indexFileCapacity = indexFileCapacityOf(store, newSize);
+    store->indexFileGrowthCount++;
+
+    __atomic_store_n(&store->indexFileGrowAt, 
+                     indexFileGrowAtFor(store->indexFileCapacity), 
+                     __ATOMIC_RELAXED);
+
+    char  *oldMapping     = store->indexFileMapping;
+    size_t oldMappingSize = store->indexFileMappingSize;
+
+    if (NULL == oldMapping || 0 == oldMappingSize)
+    {
+        return kLogStoreOK;
+    }
+
+    if (store->indexFileAddressSpace >= newSize &&
+        MAP_FAILED != mmap(oldMapping + oldMappingSize, 
+                           newSize - oldMappingSize, PROT_READ | PROT_WRITE, 
+                           MAP_SHARED | MAP_FIXED, store->indexFileNo, 
+                           oldMappingSize))
+    {
+        __atomic_store_n(&store->indexFileMappingSize, newSize, 
+                         __ATOMIC_RELEASE);
+
+        return kLogStoreOK;
+    }
+
+    void *mapping = mmap(0, newSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, store->indexFileNo, 0);
+
+    if (MAP_FAILED != mapping)
+    {
+        size_t oldSpace = store->indexFileAddressSpace;
+
+        syncWait(store);
+
+        __atomic_store_n(&store->indexFileMapping, mapping, 
+                         __ATOMIC_RELEASE);
+        __atomic_store_n(&store->indexFileMappingSize, newSize, 
+                         __ATOMIC_RELEASE);
+
+        store->indexFileAddressSpace = 0;
+
+        epochSynchronize(store);
+
+        munmap(oldMapping, oldSpace > 0 ? oldSpace : oldMappingSize);
+    }
+
+    return kLogStoreOK;
+}
+
+// Index a record found while replaying the log.  Returns kLogStoreTampered
+// if the record is not intact, as far as can be told: its checksum does not
+// match or, lacking one, its ID was never made.  A record without a revision
+// (of the original format) gets the revision after that of the record before
+// it, as LogStorePut would have given it.
+
+static int indexFileRebuildRecord(LogStore        store,
+                                  const uint32_t *prefix,
+                                  const char     *payload,
+                                  off_t           offset,
+                                  IndexFileCount  limit,
+                                  IndexFileCount *ioCount)
+{
+    LogStoreID id          = logFileEntryID(prefix);
+    uint64_t   payloadSize = logFileEntryPayloadSize(prefix);
+    int64_t    rev         = logFileEntryRevision(prefix);
+
+    if (prefix[1] & kLogFileEntryChecksummed)
+    {
+        if (logStoreCrc32c(0, payload, payloadSize) != 
+            logFileEntryChecksum(prefix))
+        {
+            return kLogStoreTampered;
+        }
+    }
+    else if (id >= limit)
+    {
+        return kLogStoreTampered;
+    }
+
+    if (id >= kIndexFileMaxCapacity || 
+        (0 == payloadSize && 0 != (prefix[1] & kLogFileEntryFlags)) ||
+        (prefix[1] & kLogFileEntryCompressed && payloadSize < sizeof(uint32_t)))
+    {
+        return kLogStoreTampered;
+    }
+
+    if (id >= store->indexFileCapacity)
+    {
+        int result = indexFileGrow(store, id + 1);
+
+        if (kLogStoreOK != result)
+        {
+            return result;
+        }
+    }
+
+    IndexEntry e = indexEntryRemoved();
+
+    if (payloadSize > 0)
+    {
+        uint64_t size = payloadSize;
+
+        if (prefix[1] & kLogFileEntryCompressed)
+        {
+            uint32_t rawSize = 0;
+
+            memcpy(&rawSize, payload, sizeof(rawSize));
+
+            size = rawSize;
+        }
+
+        if (rev < 0)
+        {
+            IndexEntry previous;
+
+            if (indexFileRead(store, id, &previous))
+            {
+                return kLogStoreInputOutputError;
+            }
+
+            rev = (LogStoreRevision)(indexEntryGetRevision(previous) + 1);
+        }
+
+        e = indexEntryMake(offset, prefix, size, rev);
+
+        indexEntryKeepValue(store, &e, payload);
+    }
+
+    int result = indexFileStore(store, id, e);
+
+    if (kLogStoreOK == result && id >= *ioCount)
+    {
+        *ioCount = id + 1;
+    }
+
+    return result;
+}
+
+// Rebuild the index entry for a record being replayed, noting in '*ioTorn'
+// where records that are not intact begin, unless an intact one follows.
+
+static int indexFileReplayRecord(LogStore        store,
+                                 const uint32_t *prefix,
+                                 const char     *payload,
+                                 off_t           offset,
+                                 IndexFileCount  limit,
+                                 IndexFileCount *ioCount,
+                                 off_t          *ioTorn)
+{
+    int result = indexFileRebuildRecord(store, prefix, payload, offset, limit, 
+                                        ioCount);
+
+    if (kLogStoreOK == result)
+    {
+        *ioTorn = -1;
+    }
+    else if (kLogStoreTampered == result)
+    {
+        *ioTorn = -1 == *ioTorn ? offset : *ioTorn;
+        result  = kLogStoreOK;
+    }
+
+    return result;
+}
+
+// Replay the log from offset 'from' to its end into the index, reading it in
+// large pieces.  The last intact record of an ID wins.  Records that are not
+// intact and run up to the end of the log were torn by a crash and are cut
+// off; any others are skipped.  So are zeroes up to the end of the log, which
+// is preallocated space (see logFileReserve).  'count' is the number of IDs
+// made, if known, or -1.
+//
+// Where a record should begin at or past 'checkpoint', zeroes are where the
+// log ends: the log is written at offsets, so a crash may leave a hole with
+// records that got to disk past it.  The log is cut off at the hole, and
+// likewise where the padding of a direct store begins.  Below
+// 'checkpoint', the descriptor of a removal of ID 0 may be all zeroes, as it
+// was before it was written wide (see logFileEntryDescribe), so zeroes
+// followed by records are replayed as one such removal.
+
+static int indexFileReplay(LogStore       store, 
+                           off_t          from, 
+                           off_t          checkpoint, 
+                           IndexFileCount count)
+{
+    size_t capacity = kRebuildBufferSize;
+    char  *buffer   = storeAllocate(store, capacity);
+
+    if (NULL == buffer)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    posix_fadvise(store->logFileNo, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    IndexFileCount made = (IndexFileCount) -1 == count ? 0 : count;
+
+    off_t logFileSize = store->logFileSize;
+    off_t pos         = from;
+    off_t torn        = -1;             // where damaged records begin, if any
+    off_t zeroes      = -1;             // where zeroes begin, if any
+    off_t hole        = -1;             // where a hole or padding begins
+    int   result      = kLogStoreOK;
+
+    while (kLogStoreOK == result && -1 == hole && pos < logFileSize)
+    {
+        size_t want = capacity;
+
+        if (logFileSize - pos < want)
+        {
+            want = logFileSize - pos;
+        }
+
+        result = readFully(store->logFileNo, buffer, want, pos);
+
+        size_t used = 0;
+
+        while (kLogStoreOK == result && used < want)
+        {
+            LogFileEntryPrefix prefix;
+
+            uint64_t length = logFileEntryParse(buffer + used, want - used, 
+                                                prefix);
+
+            if (0 == length || length > want - used)
+            {
+                break;
+            }
+
+            int isZero = 0 == prefix[0] && 0 == prefix[1];
+
+            if (isZero && pos + used < checkpoint)
+            {
+                zeroes  = -1 == zeroes ? pos + used : zeroes;
+                used   += length;
+
+                continue;
+            }
+
+            if (-1 != zeroes)
+            {
+                LogFileEntryPrefix removal = { 0, 0 };
+
+                result = indexFileReplayRecord(store, removal, buffer, zeroes, 
+                                               count, &made, &torn);
+                zeroes = -1;
+
+                if (kLogStoreOK != result)
+                {
+                    break;
+                }
+            }
+
+            if (isZero || logFileEntryIsPadding(prefix))
+            {
+                hole = pos + used;
+
+                break;
+            }
+
+            size_t prefixSize = logFileEntryPrefixSize(prefix);
+
+            result = indexFileReplayRecord(store, prefix, 
+                                           buffer + used + prefixSize, 
+                                           pos + used, count, &made, &torn);
+
+            used += length;
+        }
+
+        if (kLogStoreOK != result || -1 != hole || used > 0)
+        {
+            pos += used;
+
+            continue;
+        }
+
+        // The next record does not fit in the buffer.  Either it runs past the
+        // end of the file or it is larger than the buffer.  Only then is the
+        // buffer grown for it.
+
+        LogFileEntryPrefix prefix;
+
+        uint64_t length = logFileEntryParse(buffer, want, prefix);
+
+        if (0 == length || length > store->logFileAllocated - pos ||
+            logFileEntryIsPadding(prefix))
+        {
+            torn = -1 == torn ? pos : torn;
+
+            break;
+        }
+
+        char *larger = storeReallocate(store, buffer, capacity, length);
+
+        if (NULL == larger)
+        {
+            result = kLogStoreOutOfMemory;
+
+            break;
+        }
+
+        buffer   = larger;
+        capacity = length;
+    }
+
+    storeFree(store, buffer);
+
+    if (kLogStoreOK != result)
+    {
+        return result;
+    }
+
+    if (-1 != zeroes && (-1 == torn || zeroes < torn))
+    {
+        torn = zeroes;
+    }
+
+    if (-1 != hole && (-1 == torn || hole < torn))
+    {
+        torn = hole;
+    }
+
+    if (-1 != torn)
+    {
+        if (-1 == ftruncate(store->logFileNo, torn))
+        {
+            return kLogStoreInputOutputError;
+        }
+
+        store->logFileSize      = torn;
+        store->logFileAllocated = torn;
+    }
+
+    store->indexFileCount    = made;
+    store->indexFileReserved = made;
+
+    return kLogStoreOK;
+}
+
+// Empty the index, keeping its capacity (and any mapping of it).
+
+static int indexFileClear(LogStore store)
+{
+    off_t size = indexFileSizeFor(store, store->indexFileCapacity);
+
+    if (-1 == ftruncate(store->indexFileNo, 0) || 
+        kLogStoreOK != indexFileExtend(store, 0, size))
+    {
+        return kLogStoreInputOutputError;
+    }
+
+    store->indexFileCount      = 0;
+    store->indexFileReserved   = 0;
+    store->indexFileCheckpoint = 0;
+
+    return kLogStoreOK;
+}
+
+// After a replay, check the entries of IDs [from, to) that point past the
+// checkpoint.  Each must point at a record of its ID and size, or else the
+// index got to disk ahead of the log (the system lost power) and is returned
+// as kLogStoreTampered.  Only entries written since the store was last opened
+// can be ahead of the log, and their IDs are in the window the header gives
+// (see indexFileWiden), so just those are checked.
+
+static int indexFileCheckReplay(LogStore       store, 
+                                off_t          checkpoint,
+                                IndexFileCount from,
+                                IndexFileCount to)
+{
+    if (to > store->indexFileCount)
+    {
+        to = store->indexFileCount;
+    }
+
+    for (LogStoreID id = from; id < to; ++id)
+    {
+        IndexEntry e;
+
+        if (indexFileRead(store, id, &e))
+        {
+            return kLogStoreInputOutputError;
+        }
+
+        off_t offset = indexEntryGetOffset(e);
+
+        if (!indexEntryHasValue(e) || offset < checkpoint)
+        {
+            continue;
+        }
+
+        LogFileEntryPrefix prefix;
+        size_t             prefixSize = indexEntryGetPrefixSize(e);
+
+        indexEntryGetHeader(e, prefix);
+
+        if (offset + prefixSize > store->logFileSize ||
+            readFully(store->logFileNo, prefix, prefixSize, offset) ||
+            logFileEntryID(prefix) != id ||
+            logFileEntryPayloadSize(prefix) != indexEntryGetPayloadSize(e))
+        {
+            return kLogStoreTampered;
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+// Flush the log and the index and move the checkpoint to the end of the log.
+// The caller holds the lock, or has yet to publish the store.
+
+static int indexFileCheckpoint(LogStore store, uint32_t state)
+{
+    if (-1 == fdatasync(store->logFileNo))
+    {
+        return kLogStoreInputOutputError;
+    }
+
+    int result = indexFileFlush(store, store->indexFileMappingSize);
+
+    if (kLogStoreOK != result)
+    {
+        return result;
+    }
+
+    store->indexFileDirtyTo    = 0;
+    store->indexFileCheckpoint = store->logFileSize;
+
+    result = indexFileHeaderWrite(store, state);
+
+    if (kLogStoreOK != result)
+    {
+        return result;
+    }
+
+    return indexFileFlush(store, kIndexFileHeaderSize);
+}
+
+// Upgrade a version 2 index of 'count' entries, which the caller has mapped
+// with room for them.  Each old entry is moved to its new place, last ID
+// first since every new entry is further on than the old one, and filled in
+// from the prefix of the record it refers to; the log has no revisions for
+// records of the original format, so those are kept from the old entries.
+// The header is marked dirty with no checkpoint first, so should the upgrade
+// not finish the index is rebuilt on the next open.  Returns
+// kLogStoreTampered if an entry does not refer to a record of its ID.
+
+static int indexFileUpgrade(LogStore store, IndexFileCount count)
+{
+    store->indexFileCheckpoint = 0;
+
+    int result = indexFileHeaderWrite(store, kIndexFileDirty);
+
+    if (kLogStoreOK == result)
+    {
+        result = indexFileFlush(store, kIndexFileHeaderSize);
+    }
+
+    for (IndexFileCount id = count; kLogStoreOK == result && id-- > 0; )
+    {
+        uint64_t old    = 0;
+        off_t    offset = kIndexFileHeaderSize + id * sizeof(old);
+
+        if (NULL != store->indexFileMapping && 
+            offset + sizeof(old) <= store->indexFileMappingSize)
+        {
+            memcpy(&old, (char *)store->indexFileMapping + offset, 
+                   sizeof(old));
+        }
+        else if (kLogStoreOK != (result = readFully(store->indexFileNo, &old,
+                                                    sizeof(old), offset)))
+        {
+            break;
+        }
+
+        IndexEntry e = { 0, 0, 0, 0 };
+
+        if ((uint64_t) -1 == old)
+        {
+            e = indexEntryRemoved();
+        }
+        else if (0 != old)
+        {
+            // The prefix of the record and what follows it: the size of the
+            // value if it is compressed, or a value that might be kept inline.
+
+            uint32_t words[(sizeof(LogFileEntryPrefix) + kIndexEntryMaxSize) / 
+                           sizeof(uint32_t)];
+            off_t    recordOffset = old & 0x0000ffffffffffff;
+            ssize_t  bytesRead    = 0;
+
+            do
+            {
+                bytesRead = pread(store->logFileNo, words, sizeof(words), 
+                                  recordOffset);
+            }
+            while (bytesRead == -1 && errno == EINTR);
+
+            if (bytesRead < (ssize_t)sizeof(LogFileEntryHeader) ||
+                bytesRead < logFileEntryPrefixSize(words) ||
+                logFileEntryID(words) != id ||
+                0 == logFileEntryPayloadSize(words) ||
+                logFileEntryLength(words) > store->logFileSize - recordOffset)
+            {
+                result = kLogStoreTampered;
+
+                break;
+            }
+
+            size_t   prefixSize = logFileEntryPrefixSize(words);
+            uint64_t size       = logFileEntryPayloadSize(words);
+
+            if (words[1] & kLogFileEntryCompressed)
+            {
+                if (bytesRead < prefixSize + sizeof(uint32_t))
+                {
+                    result = kLogStoreTampered;
+
+                    break;
+                }
+
+                size = words[prefixSize / sizeof(uint32_t)];
+            }
+
+            e = indexEntryMake(recordOffset, words, size, old >> 48);
+
+            if (bytesRead >= prefixSize + size)
+            {
+                indexEntryKeepValue(store, &e, (char *)words + prefixSize);
+            }
+        }
+
+        result = indexFileStore(store, id, e);
+    }
+
+    if (kLogStoreOK == result)
+    {
+        store->indexFileCount    = count;
+        store->indexFileReserved = count;
+    }
+
+    return result;
+}
+
+// Grow the index ahead of the IDs made, so that making an ID does not have to,
+// and flush the append buffer when it is due.  Runs until the store is closed.
+
+static void *indexFileGrower(void *arg)
+{
+    LogStore store = arg;
+
+    LogStoreLock;
+
+    while (!store->growStop)
+    {
+        if (__atomic_load_n(&store->indexFileCount, __ATOMIC_RELAXED) >= 
+            store->indexFileGrowAt)
+        {
+            // On failure, making IDs grows the index itself (or reports why
+            // it cannot be grown).
+
+            if (kLogStoreOK != indexFileGrow(store, 
+                                             store->indexFileCapacity + 1))
+            {
+                store->indexFileGrowAt = UINT64_MAX;
+            }
+
+            continue;
+        }
+
+        if (0 == store->appendBufferSize || 0 == store->flushInterval)
+        {
+            pthread_cond_wait(&store->growCond, &store->mutex);
+
+            continue;
+        }
+
+        // The append buffer is flushed once the interval has passed since it
+        // was first appended to.  A failed flush is retried an interval later.
+
+        struct timespec now, due = store->appendBufferSince;
+
+        due.tv_sec  += store->flushInterval / 1000;
+        due.tv_nsec += store->flushInterval % 1000 * 1000000L;
+
+        if (due.tv_nsec >= 1000000000L)
+        {
+            due.tv_sec  += 1;
+            due.tv_nsec -= 1000000000L;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        if (now.tv_sec > due.tv_sec || 
+            (now.tv_sec == due.tv_sec && now.tv_nsec >= due.tv_nsec))
+        {
+            if (kLogStoreOK != appendBufferFlush(store))
+            {
+                store->appendBufferSince = now;
+            }
+
+            continue;
+        }
+
+        pthread_cond_timedwait(&store->growCond, &store->mutex, &due);
+    }
+
+    LogStoreUnlock;
+
+    return NULL;
+}
+
+// Make sure the header counts enough IDs as made for 'count' more, reserving
+// them in blocks, and that the index has room for them.  The caller does not
+// hold the lock.
+
+static int indexFileReserve(LogStore store, size_t count)
+{
+    LogStoreLock;
+
+    int      result = kLogStoreOK;
+    uint64_t need   = store->indexFileCount + count;
+
+    if (need > store->indexFileReserved)
+    {
+        uint64_t reserved = (need + kIndexFileReserveBy - 1) / 
+                          kIndexFileReserveBy * kIndexFileReserveBy;
+
+        if (reserved > kIndexFileMaxCapacity)
+        {
+            result = kLogStoreInvalidParameter;
+        }
+        else if (reserved > store->indexFileCapacity)
+        {
+            result = indexFileGrow(store, reserved);
+        }
+
+        if (kLogStoreOK == result)
+        {
+            __atomic_store_n(&store->indexFileReserved, reserved, 
+                             __ATOMIC_RELEASE);
+
+            result = indexFileHeaderWrite(store, kIndexFileDirty);
+
+            store->writeSequence++;
+        }
+    }
+
+    LogStoreUnlock;
+
+    return result;
+}
+
+// A LogStore is a log file and an index file (<path>-index)
+
+int LogStoreOpen(LogStore *sp, const char *path)
+{
+    return LogStoreOpenWithOptions(sp, path, NULL);
+}
+
+// Release what an open store has acquired so far and return 'code'.
+
+static int openFailed(LogStore store, int code)
+{
+    if (NULL != store->logFileHandle)
+    {
+        logFileHandleRelease(store, store->logFileHandle);
+    }
+    else if (-1 != store->logFileNo)
+    {
+        close(store->logFileNo);
+    }
+
+    if (-1 != store->indexFileNo)
+    {
+        close(store->indexFileNo);
+    }
+
+    logStoreAsyncDestroy(store->async);
+
+    indexFileUnmap(store);
+
+    pthread_mutex_destroy(&store->mutex);
+    pthread_mutex_destroy(&store->compactMutex);
+    pthread_mutex_destroy(&store->appendMutex);
+    pthread_cond_destroy(&store->syncCond);
+    pthread_cond_destroy(&store->growCond);
+
+    logStoreCacheDestroy(store->cache);
+
+    storeFree(store, store->appendBufferMemory);
+    storeFree(store, store->logFilePath);
+    storeFree(store, store);
+
+    return code;
+}
+
+int LogStoreOpenWithOptions(LogStore              *sp, 
+                            const char            *path,
+                            const LogStoreOptions *options)
+{
+    if (NULL == sp || NULL != *sp || NULL == path)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    LogStoreAllocator allocator = { defaultAllocate, defaultDeallocate, NULL };
+
+    if (NULL != options && 
+        NULL != options->allocator.allocate && 
+        NULL != options->allocator.deallocate)
+    {
+        allocator = options->allocator;
+    }
+
+    LogStore store = allocator.allocate(allocator.context, 
+                                        sizeof(struct LogStore));
+
+    if (!store)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    memset(store, 0, sizeof(struct LogStore));
+
+    store->allocator   = allocator;
+    store->logFileNo   = -1;
+    store->indexFileNo = -1;
+
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_mutex_init(&store->compactMutex, NULL);
+    pthread_mutex_init(&store->appendMutex, NULL);
+    pthread_cond_init(&store->syncCond, NULL);
+    pthread_cond_init(&store->growCond, NULL);
+
+    size_t entrySize = 0;                           // as the index has
+
+    if (NULL != options)
+    {
+        store->options           = options->flags;
+        store->compressThreshold = options->compressThreshold;
+        store->verify            = options->verify;
+        store->durability        = options->durability;
+
+        store->logFilePreallocate = options->preallocateSize;
+
+        store->inlineSize        = options->inlineSize;
+
+        entrySize = indexEntrySizeFor(options->inlineSize);
+    }
+
+    if (NULL != options && 
+        (options->inlineSize > kIndexEntryMaxSize - kIndexEntryInlineAt ||
+         options->durability < kLogStoreDurabilityFull ||
+         options->durability > kLogStoreDurabilityNone))
+    {
+        return openFailed(store, kLogStoreInvalidParameter);
+    }
+
+    if (0 == store->compressThreshold)
+    {
+        store->compressThreshold = kCompressDefaultThreshold;
+    }
+
+    if (NULL != options && (options->flags & kLogStoreOptionDirect))
+    {
+        if (0 == kDirectOpenFlag)
+        {
+            return openFailed(store, kLogStoreInvalidParameter);
+        }
+
+        // The buffer keeps room for a partial block before its capacity and
+        // for padding after it (see appendBufferWriteDirect).
+
+        size_t capacity = options->appendBufferSize > 0 ? 
+                          directBlocksFor(options->appendBufferSize) : 
+                          kDirectDefaultBufferSize;
+
+        store->appendBufferCapacity = capacity;
+        store->flushInterval        = options->flushInterval;
+        store->appendBufferBlock    = 
+            storeAllocateBlocks(store, capacity + 2 * kDirectBlockSize,
+                                &store->appendBufferMemory);
+        store->appendBuffer         = store->appendBufferBlock;
+
+        if (NULL == store->appendBufferBlock)
+        {
+            return openFailed(store, kLogStoreOutOfMemory);
+        }
+    }
+    else if (NULL != options && options->appendBufferSize > 0)
+    {
+        store->appendBufferCapacity = options->appendBufferSize;
+        store->flushInterval        = options->flushInterval;
+
+        if (NULL == (store->appendBufferMemory = 
+                     storeAllocate(store, options->appendBufferSize)))
+        {
+            return openFailed(store, kLogStoreOutOfMemory);
+        }
+
+        store->appendBuffer = store->appendBufferMemory;
+    }
+
+    if (NULL != options && options->asyncThreads > 0)
+    {
+        int useRing = !(options->flags & kLogStoreOptionNoRing);
+
+        if (NULL == (store->async = logStoreAsyncCreate(&allocator, 
+                                                        options->asyncThreads,
+                                                        useRing)))
+        {
+            return openFailed(store, kLogStoreOutOfMemory);
+        }
+    }
+
+    if (NULL != options && options->cacheSize > 0 &&
+        NULL == (store->cache = logStoreCacheCreate(&allocator, 
+                                                    options->cacheSize,
+                                                    options->cacheShards)))
+    {
+        return openFailed(store, kLogStoreOutOfMemory);
+    }
+
+    // Open log file.
+
+    // The log is written at the offsets of its records rather than appended
+    // to, as it may be preallocated or padded past them.
+
+    int flags = O_CREAT | O_RDWR | kOtherOpenFlags;
+
+    if (-1 == (store->logFileNo = open(path, flags, 0777)))
+    {
+        return openFailed(store, kLogStoreInputOutputError);
+    }
+
+    if (NULL == (store->logFileHandle = logFileHandleMake(store, 
+                                                          store->logFileNo)))
+    {
+        return openFailed(store, kLogStoreOutOfMemory);
+    }
+
+    // Get size of log file.
+
+    struct stat logFileStat;
+
+    if (fstat(store->logFileNo, &logFileStat) < 0 ||
+        !S_ISREG(logFileStat.st_mode))
+    {
+        return openFailed(store, kLogStoreInputOutputError);
+    }
+
+    // Replaying the log (below) finds where its records end.
+
+    store->logFileSize      = logFileStat.st_size;
+    store->logFileAllocated = logFileStat.st_size;
+
+    // Remember the path of the log file; compaction replaces the file.
+
+    store->logFilePath = storeAllocate(store, strlen(path) + 1);
+
+    if (NULL == store->logFilePath)
+    {
+        return openFailed(store, kLogStoreOutOfMemory);
+    }
+
+    strcpy(store->logFilePath, path);
+
+    // Open index file.
+
+    char *ipath = storeAllocate(store, strlen(path) + strlen("-index") + 1);
+
+    if (NULL == ipath)
+    {
+        return openFailed(store, kLogStoreOutOfMemory);
+    }
+
+    sprintf(ipath, "%s-index", path);
+
+    store->indexFileNo = open(ipath, O_CREAT | O_RDWR | kOtherOpenFlags, 0777);
+
+    storeFree(store, ipath);
+
+    if (-1 == store->indexFileNo)
+    {
+        return openFailed(store, kLogStoreInputOutputError);
+    }
+
+    // Read the header of the index file.  The log past its checkpoint is
+    // replayed into the index; there is nothing to replay if the store was
+    // closed cleanly.  An index of version 2 is upgraded.  One of the original
+    // format, one with entries of another size than asked for, or one missing
+    // while there is a log, is rebuilt from the whole log.
+
+    struct stat indexFileStat;
+
+    if (-1 == fstat(store->indexFileNo, &indexFileStat))
+    {
+        return openFailed(store, kLogStoreInputOutputError);
+    }
+
+    IndexFileHeader header     = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    IndexFileCount  count      = (IndexFileCount) -1;   // not known
+    off_t           replayFrom = -1;                    // nothing to replay
+    int             rebuild    = 0;
+    int             upgrade    = 0;
+    int             result     = kLogStoreOK;
+
+    if (indexFileStat.st_size >= sizeof(header) &&
+        kLogStoreOK != (result = readFully(store->indexFileNo, &header, 
+                                           sizeof(header), 0)))
+    {
+        return openFailed(store, result);
+    }
+
+    if (kIndexFileMagic == header.magic && 
+        kIndexFileVersion == header.version &&
+        header.entrySize >= kIndexEntrySize &&
+        header.entrySize <= kIndexEntryMaxSize &&
+        0 == header.entrySize % 8 &&
+        (0 == entrySize || header.entrySize == entrySize) &&
+        indexFileStat.st_size >= kIndexFileHeaderSize)
+    {
+        store->indexFileEntrySize  = header.entrySize;
+        store->indexFileCount      = header.count;
+        store->indexFileReserved   = header.count;
+        store->indexFileCheckpoint = header.checkpoint;
+        store->indexFileWindowFrom = header.windowFrom;
+        store->indexFileWindowTo   = header.windowTo;
+        store->indexFileCapacity   = indexFileCapacityOf(store, 
+                                                         indexFileStat.st_size);
+
+        count = header.count;
+
+        if (header.checkpoint > store->logFileSize)
+        {
+            rebuild = 1;
+        }
+        else if (kIndexFileClean != header.state || 
+                 header.checkpoint < store->logFileSize)
+        {
+            replayFrom = header.checkpoint;
+        }
+    }
+    else if (kIndexFileMagic == header.magic && 
+             kIndexFileVersion2 == header.version &&
+             indexFileStat.st_size >= kIndexFileHeaderSize)
+    {
+        IndexFileHeader2 header2;
+
+        memcpy(&header2, &header, sizeof(header2));
+
+        count = header2.count;
+
+        // Any entry of an older index may be ahead of the log.
+
+        store->indexFileWindowTo = count;
+
+        if (count > (indexFileStat.st_size - kIndexFileHeaderSize) / 
+                    sizeof(uint64_t) ||
+            header2.checkpoint > store->logFileSize)
+        {
+            rebuild = 1;
+        }
+        else
+        {
+            upgrade = 1;
+
+            if (kIndexFileClean != header2.state || 
+                header2.checkpoint < store->logFileSize)
+            {
+                replayFrom = header2.checkpoint;
+            }
+        }
+    }
+    else if (kIndexFileMagic == header.magic && 
+             kIndexFileVersion == header.version)
+    {
+        count   = header.count;
+        rebuild = 1;
+    }
+    else if (indexFileStat.st_size > 0 || store->logFileSize > 0)
+    {
+        // The original format started with the count.
+
+        if (indexFileStat.st_size >= sizeof(header))
+        {
+            count = header.magic;
+        }
+
+        rebuild = 1;
+    }
+
+    if (0 == store->indexFileEntrySize)
+    {
+        store->indexFileEntrySize = 0 == entrySize ? kIndexEntrySize 
+                                                   : entrySize;
+    }
+
+    // If needed, grow the index file to hold a decent number of
+    // entries for mmap, or the entries of an index being upgraded.
+
+    if (store->indexFileCapacity == 0 &&
+        kLogStoreOK != (result = indexFileGrow(store, 
+                                               upgrade && count > 
+                                               kIndexFileGrowBy ? 
+                                               count : kIndexFileGrowBy)))
+    {
+        return openFailed(store, result);
+    }
+
+    // An index file written before it was kept in whole pages is rounded up.
+    // One written sparse gets its blocks if the store preallocates.
+
+    off_t indexFileSize = indexFileSizeFor(store, store->indexFileCapacity);
+
+    if ((indexFileSize > indexFileStat.st_size ||
+         (store->logFilePreallocate > 0 && 
+          indexFileStat.st_blocks * 512 < indexFileSize)) &&
+        kLogStoreOK != (result = indexFileExtend(store, 0, indexFileSize)))
+    {
+        return openFailed(store, result);
+    }
+
+    store->indexFileCapacity = indexFileCapacityOf(store, indexFileSize);
+
+    indexFileMap(store);
+
+    if (rebuild)
+    {
+        result     = indexFileClear(store);
+        replayFrom = 0;
+    }
+    else if (upgrade)
+    {
+        result = indexFileUpgrade(store, count);
+    }
+
+    // Zeroes past the checkpoint are a hole a crash left (see
+    // indexFileReplay).  A log rebuilt from scratch or upgraded may have been
+    // written before a removal of ID 0 was written wide, and is read as such
+    // throughout.
+
+    off_t checkpoint = rebuild || upgrade ? store->logFileSize : replayFrom;
+
+    if (kLogStoreOK == result && -1 != replayFrom)
+    {
+        result = indexFileReplay(store, replayFrom, checkpoint, count);
+
+        if (kLogStoreOK == result && !rebuild)
+        {
+            result = indexFileCheckReplay(store, replayFrom, 
+                                          store->indexFileWindowFrom,
+                                          store->indexFileWindowTo);
+        }
+    }
+
+    if (kLogStoreTampered == result && 
+        kLogStoreOK == (result = indexFileClear(store)))
+    {
+        result     = indexFileReplay(store, 0, checkpoint, count);
+        replayFrom = 0;
+    }
+
+    // The index now agrees with the log, so the window starts over empty.
+    // Until it is written, the old one stands.
+
+    store->indexFileWindowFrom = 0;
+    store->indexFileWindowTo   = 0;
+
+    if (kLogStoreOK == result && (upgrade || -1 != replayFrom))
+    {
+        result = indexFileCheckpoint(store, kIndexFileDirty);
+    }
+    else if (kLogStoreOK == result)
+    {
+        // Mark the index dirty until it is closed.
+
+        result = indexFileHeaderWrite(store, kIndexFileDirty);
+
+        if (kLogStoreOK == result)
+        {
+            result = indexFileFlush(store, kIndexFileHeaderSize);
+        }
+    }
+
+    if (kLogStoreOK != result)
+    {
+        return openFailed(store, result);
+    }
+
+    store->indexFileGrowAt = indexFileGrowAtFor(store->indexFileCapacity);
+
+    if (NULL != store->appendBufferBlock && 
+        kLogStoreOK != (result = logFileDirectBegin(store)))
+    {
+        return openFailed(store, result);
+    }
+
+    if (0 != pthread_create(&store->growThread, NULL, indexFileGrower, store))
+    {
+        return openFailed(store, kLogStoreOutOfMemory);
+    }
+
+    *sp = store;
+
+    return kLogStoreOK;
+}
+
+// A sharded store is a store with no files of its own; each operation goes
+// to one of its shards, each of which is a store with its own lock, log, and
+// index.  The shard of an ID is encoded in its low part: ID = local ID *
+// shardCount + shard.
+
+int LogStoreOpenSharded(LogStore              *sp,
+                        const char *const     *paths,
+                        int                    shardCount,
+                        const LogStoreOptions *options)
+{
+    if (NULL == sp || NULL != *sp || NULL == paths || shardCount < 1)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    LogStoreOptions shardOptions;
+
+    memset(&shardOptions, 0, sizeof(shardOptions));
+
+    if (NULL != options)
+    {
+        shardOptions = *options;
+    }
+
+    if (NULL == shardOptions.allocator.allocate || 
+        NULL == shardOptions.allocator.deallocate)
+    {
+        LogStoreAllocator allocator = 
+        { 
+            defaultAllocate, defaultDeallocate, NULL 
+        };
+
+        shardOptions.allocator = allocator;
+    }
+
+    // The cache and append buffer budgets are for the whole store.
+
+    shardOptions.cacheSize        /= shardCount;
+    shardOptions.appendBufferSize /= shardCount;
+
+    // The shards share one async engine.
+
+    shardOptions.asyncThreads = 0;
+
+    LogStoreAllocator *allocator = &shardOptions.allocator;
+
+    LogStore store = allocator->allocate(allocator->context, 
+                                         sizeof(struct LogStore));
+
+    if (!store)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    memset(store, 0, sizeof(struct LogStore));
+
+    store->allocator   = *allocator;
+    store->logFileNo   = -1;
+    store->indexFileNo = -1;
+    store->durability  = shardOptions.durability;
+    store->shards      = storeAllocate(store, shardCount * sizeof(LogStore));
+
+    if (NULL == store->shards)
+    {
+        storeFree(store, store);
+
+        return kLogStoreOutOfMemory;
+    }
+
+    memset(store->shards, 0, shardCount * sizeof(LogStore));
+
+    int result = kLogStoreOK;
+
+    for (int i = 0; i < shardCount && kLogStoreOK == result; ++i)
+    {
+        result = LogStoreOpenWithOptions(&store->shards[i], paths[i], 
+                                         &shardOptions);
+
+        store->shardCount = i + (kLogStoreOK == result);
+    }
+
+    if (kLogStoreOK == result && NULL != options && options->asyncThreads > 0)
+    {
+        int useRing = !(options->flags & kLogStoreOptionNoRing);
+
+        if (NULL == (store->async = logStoreAsyncCreate(allocator, 
+                                                        options->asyncThreads,
+                                                        useRing)))
+        {
+            result = kLogStoreOutOfMemory;
+        }
+
+        for (int i = 0; i < shardCount; ++i)
+        {
+            store->shards[i]->async = store->async;
+        }
+    }
+
+    if (kLogStoreOK != result)
+    {
+        LogStoreClose(&store);
+
+        return result;
+    }
+
+    *sp = store;
+
+    return kLogStoreOK;
+}
+
+// The shard that holds an ID, whose ID there replaces it.  A store that is
+// not sharded holds its IDs itself.
+
+static inline LogStore storeShard(LogStore store, LogStoreID *ioID)
+{
+    if (NULL == store->shards)
+    {
+        return store;
+    }
+
+    LogStoreID id = *ioID;
+
+    *ioID = id / store->shardCount;
+
+    return store->shards[id % store->shardCount];
+}
+
+// LogStorePutMany and LogStoreGetMany on a sharded store make one call per
+// shard with the entries of that shard.  'positions' is where the entries of
+// a shard are in the caller's arrays; it has room for all of them.
+
+static size_t shardedCollect(LogStore          store,
+                             int               shard,
+                             const LogStoreID *ids,
+                             size_t            stride,
+                             size_t            count,
+                             size_t           *positions)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        LogStoreID id = *(const LogStoreID *)((const char *)ids + i * stride);
+
+        if (id % store->shardCount == shard)
+        {
+            positions[n++] = i;
+        }
+    }
+
+    return n;
+}
+
+static int shardedFirstFailure(const int *results, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (kLogStoreOK != results[i])
+        {
+            return results[i];
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+static int shardedPutMany(LogStore                store,
+                          const LogStorePutEntry *entries,
+                          size_t                  count,
+                          int                    *results)
+{
+    size_t            *positions = storeAllocate(store, 
+                                                 count * sizeof(size_t));
+    LogStorePutEntry  *local     = storeAllocate(store, 
+                                                 count * sizeof(*local));
+    int               *codes     = storeAllocate(store, count * sizeof(int));
+
+    if (NULL == positions || NULL == local || NULL == codes)
+    {
+        storeFree(store, positions);
+        storeFree(store, local);
+        storeFree(store, codes);
+
+        return kLogStoreOutOfMemory;
+    }
+
+    for (int shard = 0; shard < store->shardCount; ++shard)
+    {
+        size_t n = shardedCollect(store, shard, &entries[0].id, 
+                                  sizeof(LogStorePutEntry), count, positions);
+
+        if (0 == n)
+        {
+            continue;
+        }
+
+        for (size_t k = 0; k < n; ++k)
+        {
+            local[k]     = entries[positions[k]];
+            local[k].id /= store->shardCount;
+        }
+
+        LogStorePutMany(store->shards[shard], local, n, codes);
+
+        for (size_t k = 0; k < n; ++k)
+        {
+            results[positions[k]] = codes[k];
+        }
+    }
+
+    storeFree(store, positions);
+    storeFree(store, local);
+    storeFree(store, codes);
+
+    return shardedFirstFailure(results, count);
+}
+
+static int shardedGetMany(LogStore          store,
+                          const LogStoreID *ids,
+                          size_t            count,
+                          void            **outData,
+                          size_t           *outSizes,
+                          LogStoreRevision *outRevs,
+                          int              *results)
+{
+    size_t           *positions = storeAllocate(store, 
+                                                count * sizeof(size_t));
+    void            **data      = storeAllocate(store, count * sizeof(void *));
+    size_t           *sizes     = storeAllocate(store, count * sizeof(size_t));
+    LogStoreRevision *revs      = storeAllocate(store, 
+                                                count * sizeof(*revs));
+    LogStoreID       *local     = storeAllocate(store, 
+                                                count * sizeof(LogStoreID));
+    int              *codes     = storeAllocate(store, count * sizeof(int));
+
+    int result = kLogStoreOutOfMemory;
+
+    if (NULL != positions && NULL != data && NULL != sizes && 
+        NULL != revs && NULL != local && NULL != codes)
+    {
+        for (int shard = 0; shard < store->shardCount; ++shard)
+        {
+            size_t n = shardedCollect(store, shard, ids, sizeof(LogStoreID), 
+                                      count, positions);
+
+            if (0 == n)
+            {
+                continue;
+            }
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                local[k] = ids[positions[k]] / store->shardCount;
+                data[k]  = NULL;
+            }
+
+            LogStoreGetMany(store->shards[shard], local, n, data, sizes, 
+                            revs, codes);
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                size_t i = positions[k];
+
+                outData[i] = data[k];
+                results[i] = codes[k];
+
+                if (NULL != outSizes)
+                {
+                    outSizes[i] = sizes[k];
+                }
+
+                if (NULL != outRevs)
+                {
+                    outRevs[i] = revs[k];
+                }
+            }
+        }
+
+        result = shardedFirstFailure(results, count);
+    }
+
+    storeFree(store, positions);
+    storeFree(store, data);
+    storeFree(store, sizes);
+    storeFree(store, revs);
+    storeFree(store, local);
+    storeFree(store, codes);
+
+    return result;
+}
+
+int LogStoreMakeID(LogStore store, LogStoreID *outID)
+{
+    return LogStoreMakeIDs(store, 1, outID);
+}
+
+int LogStoreMakeIDs(LogStore store, size_t count, LogStoreID *outFirstID)
+{
+    if (NULL == store || NULL == outFirstID || 0 == count || 
+        count > kIndexFileMaxCapacity)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    // IDs are made in each shard in turn so that puts spread over them.
+
+    if (NULL != store->shards)
+    {
+        unsigned shard = __atomic_fetch_add(&store->nextShard, 1, 
+                                            __ATOMIC_RELAXED) % 
+                         store->shardCount;
+
+        int result = LogStoreMakeIDs(store->shards[shard], count, outFirstID);
+
+        if (kLogStoreOK == result)
+        {
+            *outFirstID = *outFirstID * store->shardCount + shard;
+        }
+
+        return result;
+    }
+
+    // Take IDs from those reserved, reserving more as needed.
+
+    uint64_t first = __atomic_load_n(&store->indexFileCount, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        uint64_t reserved = __atomic_load_n(&store->indexFileReserved, 
+                                            __ATOMIC_ACQUIRE);
+
+        if (count > reserved - first)
+        {
+            int result = indexFileReserve(store, count);
+
+            if (kLogStoreOK != result)
+            {
+                return result;
+            }
+
+            first = __atomic_load_n(&store->indexFileCount, __ATOMIC_RELAXED);
+
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&store->indexFileCount, &first, 
+                                        first + count, 1, __ATOMIC_RELEASE, 
+                                        __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    *outFirstID = first;
+
+    // Whoever makes the ID that crosses the mark wakes the grower.
+
+    uint64_t growAt = __atomic_load_n(&store->indexFileGrowAt, 
+                                      __ATOMIC_RELAXED);
+
+    if (first < growAt && first + count >= growAt)
+    {
+        LogStoreLock;
+
+        pthread_cond_signal(&store->growCond);
+
+        LogStoreUnlock;
+    }
+
+    return kLogStoreOK;
+}
+
+// Snapshots save index entries in pages of this many.  A page saved for
+// several snapshots at once is shared by them.
+
+#define kSnapshotPageEntries 128
+
+struct LogStoreSnapshotPage
+{
+    unsigned refCount;                          // snapshots that have it
+    char     entries[];
+};
+
+// Find the slot of a page in the table of pages a snapshot has saved: the
+// slot that holds it, or else the free slot it would go in.
+
+static size_t snapshotSlot(LogStoreSnapshot snapshot, uint64_t page)
+{
+    size_t mask = snapshot->pageCapacity - 1;
+    size_t slot = (size_t)((page * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+
+    while (0 != snapshot->pageKeys[slot] && 
+           page + 1 != snapshot->pageKeys[slot])
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static LogStoreSnapshotPage *snapshotFind(LogStoreSnapshot snapshot, 
+                                          uint64_t         page)
+{
+    if (0 == snapshot->pageCount)
+    {
+        return NULL;
+    }
+
+    return snapshot->pages[snapshotSlot(snapshot, page)];
+}
+
+// Add a saved page to a snapshot, growing its table to keep it at most half
+// full.
+
+static int snapshotAdd(LogStore              store,
+                       LogStoreSnapshot      snapshot,
+                       uint64_t              page,
+                       LogStoreSnapshotPage *saved)
+{
+    if (2 * (snapshot->pageCount + 1) > snapshot->pageCapacity)
+    {
+        struct LogStoreSnapshot grown = *snapshot;
+
+        grown.pageCapacity = snapshot->pageCapacity > 0 ? 
+                             snapshot->pageCapacity * 2 : 64;
+        grown.pageKeys     = storeAllocate(store, grown.pageCapacity * 
+                                                  sizeof(uint64_t));
+        grown.pages        = storeAllocate(store, grown.pageCapacity * 
+                                                  sizeof(saved));
+
+        if (NULL == grown.pageKeys || NULL == grown.pages)
+        {
+            storeFree(store, grown.pageKeys);
+            storeFree(store, grown.pages);
+
+            return kLogStoreOutOfMemory;
+        }
+
+        memset(grown.pageKeys, 0, grown.pageCapacity * sizeof(uint64_t));
+        memset(grown.pages, 0, grown.pageCapacity * sizeof(saved));
+
+        for (size_t i = 0; i < snapshot->pageCapacity; ++i)
+        {
+            if (0 != snapshot->pageKeys[i])
+            {
+                size_t slot = snapshotSlot(&grown, 
+                                           snapshot->pageKeys[i] - 1);
+
+                grown.pageKeys[slot] = snapshot->pageKeys[i];
+                grown.pages[slot]    = snapshot->pages[i];
+            }
+        }
+
+        storeFree(store, snapshot->pageKeys);
+        storeFree(store, snapshot->pages);
+
+        snapshot->pageKeys     = grown.pageKeys;
+        snapshot->pages        = grown.pages;
+        snapshot->pageCapacity = grown.pageCapacity;
+    }
+
+    size_t slot = snapshotSlot(snapshot, page);
+
+    snapshot->pageKeys[slot] = page + 1;
+    snapshot->pages[slot]    = saved;
+    snapshot->pageCount++;
+
+    saved->refCount++;
+
+    return kLogStoreOK;
+}
+
+// Before the entry of an ID is changed, save the page of entries it is on
+// into every snapshot that might look at the entry and has yet to save the
+// page.  Should this fail, the entry must not be changed.  The caller holds
+// the lock.
+
+static int snapshotSave(LogStore store, LogStoreID id)
+{
+    uint64_t              page      = id / kSnapshotPageEntries;
+    LogStoreID            first     = page * kSnapshotPageEntries;
+    size_t                entrySize = store->indexFileEntrySize;
+    LogStoreSnapshotPage *saved     = NULL;
+    int                   result    = kLogStoreOK;
+
+    for (LogStoreSnapshot snapshot = store->snapshots; 
+         NULL != snapshot && kLogStoreOK == result; 
+         snapshot = snapshot->older)
+    {
+        if (id >= snapshot->indexFileCount || 
+            NULL != snapshotFind(snapshot, page))
+        {
+            continue;
+        }
+
+        if (NULL == saved)
+        {
+            size_t size = kSnapshotPageEntries * entrySize;
+
+            saved = storeAllocate(store, sizeof(*saved) + size);
+
+            if (NULL == saved)
+            {
+                return kLogStoreOutOfMemory;
+            }
+
+            saved->refCount = 0;
+
+            memset(saved->entries, 0, size);
+
+            for (LogStoreID k = 0; 
+                 k < kSnapshotPageEntries && first + k < store->indexFileCount;
+                 ++k)
+            {
+                IndexEntry e;
+
+                if (indexFileRead(store, first + k, &e))
+                {
+                    storeFree(store, saved);
+
+                    return kLogStoreInputOutputError;
+                }
+
+                memcpy(saved->entries + k * entrySize, &e, entrySize);
+            }
+        }
+
+        result = snapshotAdd(store, snapshot, page, saved);
+    }
+
+    if (NULL != saved && 0 == saved->refCount)
+    {
+        storeFree(store, saved);
+    }
+
+    return result;
+}
+
+// Load the entry of an ID as of a snapshot.  The caller holds the lock.
+
+static int snapshotLoad(LogStoreSnapshot snapshot, 
+                        LogStoreID       id, 
+                        IndexEntry      *outEntry)
+{
+    LogStore store = snapshot->store;
+
+    if (id >= snapshot->indexFileCount)
+    {
+        return kLogStoreNotFound;
+    }
+
+    LogStoreSnapshotPage *saved = snapshotFind(snapshot, 
+                                               id / kSnapshotPageEntries);
+
+    if (NULL == saved)
+    {
+        return indexFileRead(store, id, outEntry) ? kLogStoreInputOutputError
+                                                  : kLogStoreOK;
+    }
+
+    memcpy(outEntry, 
+           saved->entries + id % kSnapshotPageEntries * 
+                            store->indexFileEntrySize,
+           store->indexFileEntrySize);
+
+    return kLogStoreOK;
+}
+
+// Make sure the window of the index header on disk takes in 'id' before an
+// entry of it is written.  The entry may get to disk ahead of the record it
+// refers to, and an unclean open checks only the entries in the window (see
+// indexFileCheckReplay).  The window grows a kIndexFileGrowBy of IDs at a
+// time, so it is seldom flushed.  The caller holds the lock.
+
+static int indexFileWiden(LogStore store, LogStoreID id)
+{
+    if (id >= store->indexFileWindowFrom && id < store->indexFileWindowTo)
+    {
+        return kLogStoreOK;
+    }
+
+    IndexFileCount from = id - id % kIndexFileGrowBy;
+    IndexFileCount to   = from + kIndexFileGrowBy;
+
+    if (store->indexFileWindowTo > store->indexFileWindowFrom)
+    {
+        from = from < store->indexFileWindowFrom ? from 
+                                                 : store->indexFileWindowFrom;
+        to   = to > store->indexFileWindowTo ? to : store->indexFileWindowTo;
+    }
+
+    store->indexFileWindowFrom = from;
+    store->indexFileWindowTo   = to;
+
+    int result = indexFileHeaderWrite(store, kIndexFileDirty);
+
+    if (kLogStoreOK == result)
+    {
+        result = indexFileFlush(store, kIndexFileHeaderSize);
+    }
+
+    return result;
+}
+
+// Write an entry to the index file.  The caller holds the lock.  Any cached
+// value of the ID is dropped, and any snapshot keeps the entry as it was.
+
+static inline int indexFileWrite(LogStore   store,
+                                 LogStoreID id,
+                                 IndexEntry entry)
+{
+    if (id >= store->indexFileCapacity)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    int result = indexFileWiden(store, id);
+
+    if (kLogStoreOK != result)
+    {
+        return result;
+    }
+
+    if (NULL != store->snapshots && 
+        kLogStoreOK != (result = snapshotSave(store, id)))
+    {
+        return result;
+    }
+
+    indexSeqWriteBegin(store, id);
+
+    result = indexFileStore(store, id, entry);
+
+    indexSeqWriteEnd(store, id);
+
+    if (NULL != store->cache)
+    {
+        logStoreCacheInvalidate(store->cache, id);
+    }
+
+    return result;
+}
+
+// Load an entry from the index file without holding the lock, along with the
+// log file the entry refers to.  The caller is inside an epoch.
+
+static int indexFileLoad(LogStore    store,
+                         LogStoreID  id,
+                         IndexEntry *outIndexEntry,
+                         int        *outLogFileNo)
+{
+    if (id >= __atomic_load_n(&store->indexFileCount, __ATOMIC_ACQUIRE))
+    {
+        return kLogStoreNotFound;
+    }
+
+    off_t     offset    = indexFileOffsetOf(store, id);
+    size_t    entrySize = store->indexFileEntrySize;
+    unsigned *seq       = &store->indexSeq[id % kIndexSeqStripes];
+
+    for (;;)
+    {
+        unsigned before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+        if (before & 1)
+        {
+            sched_yield();
+
+            continue;
+        }
+
+        // The size is loaded before the mapping: a mapping is never smaller
+        // than the size published before it.
+
+        size_t mappingSize = __atomic_load_n(&store->indexFileMappingSize, 
+                                             __ATOMIC_ACQUIRE);
+        char  *mapping     = __atomic_load_n(&store->indexFileMapping,
+                                             __ATOMIC_ACQUIRE);
+
+        if (NULL != mapping && offset + entrySize <= mappingSize)
+        {
+            memcpy(outIndexEntry, mapping + offset, entrySize);
+        }
+        else
+        {
+            int bytesRead = 0;
+
+            do
+            {
+                bytesRead = pread(store->indexFileNo, outIndexEntry,
+                                  entrySize, offset);
+            }
+            while (bytesRead == -1 && errno == EINTR);
+
+            if (bytesRead < (int)entrySize)
+            {
+                return kLogStoreInputOutputError;
+            }
+        }
+
+        *outLogFileNo = __atomic_load_n(&store->logFileNo, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+        {
+            return kLogStoreOK;
+        }
+    }
+}
+
+// A value as it is appended to the log: a record descriptor and a payload.
+// The payload is either the value itself or, if it compressed well, a buffer
+// holding the compressed value.
+
+typedef struct LogFileRecord
+{
+    LogFileEntryPrefix prefix;
+    size_t             prefixSize;
+    void              *payload;
+    size_t             payloadSize;
+    size_t             size;            // of the value
+    void              *buffer;          // allocated payload, if any
+} LogFileRecord;
+
+// Replace the payload of a record with its compressed form if that saves
+// something.  The size of the value must fit in 32 bits.
+
+static void logFileRecordCompress(LogStore store, LogFileRecord *record)
+{
+    uint32_t rawSize  = record->payloadSize;
+    size_t   capacity = record->payloadSize - 1;
+    char    *buffer   = storeAllocate(store, capacity);
+
+    if (NULL == buffer || capacity <= sizeof(rawSize))
+    {
+        storeFree(store, buffer);
+
+        return;
+    }
+
+    size_t compressedSize = logStoreLzCompress(record->payload, rawSize, 
+                                               buffer + sizeof(rawSize),
+                                               capacity - sizeof(rawSize));
+
+    if (0 == compressedSize)
+    {
+        storeFree(store, buffer);
+
+        return;
+    }
+
+    memcpy(buffer, &rawSize, sizeof(rawSize));
+
+    record->payload     = buffer;
+    record->payloadSize = sizeof(rawSize) + compressedSize;
+    record->buffer      = buffer;
+}
+
+// Make the record for a value put with revision 'rev' (the one it will have).
+// This does not need the lock.
+
+static void logFileRecordMake(LogStore         store,
+                              LogStoreID       id,
+                              void            *data,
+                              size_t           size,
+                              LogStoreRevision rev,
+                              LogFileRecord   *record)
+{
+    record->payload     = data;
+    record->payloadSize = size;
+    record->size        = size;
+    record->buffer      = NULL;
+
+    if (store->options & kLogStoreOptionCompress && 
+        size >= store->compressThreshold && size <= UINT32_MAX)
+    {
+        logFileRecordCompress(store, record);
+    }
+
+    uint32_t flags = kLogFileEntryRevision;
+
+    if (NULL != record->buffer)
+    {
+        flags |= kLogFileEntryCompressed;
+    }
+
+    if (!(store->options & kLogStoreOptionNoChecksums))
+    {
+        flags |= kLogFileEntryChecksummed;
+    }
+
+    uint32_t *word = record->prefix + 
+                     logFileEntryDescribe(record->prefix, id, 
+                                          record->payloadSize, flags);
+
+    if (flags & kLogFileEntryChecksummed)
+    {
+        *word++ = logStoreCrc32c(0, record->payload, record->payloadSize);
+    }
+
+    *word++ = rev;
+
+    record->prefixSize = (char *)word - (char *)record->prefix;
+}
+
+static inline void logFileRecordFree(LogStore store, LogFileRecord *record)
+{
+    storeFree(store, record->buffer);
+}
+
+int LogStorePut(LogStore          store,
+                LogStoreID        id,
+                void             *data,
+                size_t            size,
+                LogStoreRevision  rev)
+{
+    if (NULL == store || NULL == data || 0 == size)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    store = storeShard(store, &id);
+
+    LogFileRecord record;
+
+    logFileRecordMake(store, id, data, size, rev + 1, &record);
+
+    LogStoreLock;
+
+    // Get index file entry for id.
+
+    IndexEntry e;
+
+    if (indexFileRead(store, id, &e))
+    {
+        LogStoreUnlock;
+
+        logFileRecordFree(store, &record);
+
+        return kLogStoreInputOutputError;
+    }
+
+    // Check for a version conflict.
+
+    if (indexEntryGetRevision(e) != rev)
+    {
+        LogStoreUnlock;
+
+        logFileRecordFree(store, &record);
+
+        return kLogStoreRevisionConflict;
+    }
+
+    // Append record descriptor and record to log file.
+
+    struct iovec iov[2] =
+    {
+        { record.prefix, record.prefixSize },
+        { record.payload, record.payloadSize }
+    };
+
+    off_t  offset       = logFileEnd(store);
+    size_t bytesWritten = logFileAppend(store, iov, 2);
+
+    logFileRecordFree(store, &record);
+
+    if (bytesWritten < record.prefixSize + record.payloadSize)
+    {
+        LogStoreUnlock;
+
+        return kLogStoreInputOutputError;
+    }
+
+    // Update index file entry.  The new offset is the size of the log prior to
+    // the record descriptor being written.  The new revision is 1 greater than
+    // the current revision.
+
+    e = indexEntryMake(offset, record.prefix, record.size, rev + 1);
+
+    indexEntryKeepValue(store, &e, data);
+
+    int result = indexFileWrite(store, id, e);
+
+    if (kLogStoreOK != result)
+    {
+        LogStoreUnlock;
+
+        return result;
+    }
+
+    store->writeSequence++;
+
+    LogStoreUnlock;
+
+    return kLogStoreOK;
+}
+
+// LogStorePutMany appends records in batches as large as a single writev
+// allows (a record takes an iovec for its descriptor and one for its data).
+
+#ifdef IOV_MAX
+#define kPutManyBatchSize (IOV_MAX / 2)
+#else
+#define kPutManyBatchSize 512
+#endif
+
+typedef struct PutBatch
+{
+    struct iovec       iov[kPutManyBatchSize * 2];
+    size_t             entries[kPutManyBatchSize];   // index into the entries
+    int                count;
+    size_t             size;                         // bytes to append
+    uint64_t           idFilter[16];                 // IDs in the batch
+} PutBatch;
+
+static inline int putBatchMayContain(PutBatch *b, LogStoreID id)
+{
+    return (b->idFilter[(id / 64) % 16] >> (id % 64)) & 1;
+}
+
+// Append the batched records to the log in one go and update their index
+// entries.  The caller holds the lock.
+
+static void putBatchFlush(LogStore                store,
+                          PutBatch               *b,
+                          const LogStorePutEntry *entries,
+                          const LogFileRecord    *records,
+                          int                    *results)
+{
+    if (0 == b->count)
+    {
+        return;
+    }
+
+    off_t  start   = logFileEnd(store);
+    size_t written = logFileAppend(store, b->iov, b->count * 2);
+
+    // A record is put if it was written in full.
+
+    off_t offset = start;
+
+    for (int k = 0; k < b->count; ++k)
+    {
+        const LogStorePutEntry *entry = &entries[b->entries[k]];
+
+        off_t end = offset + records[b->entries[k]].prefixSize + 
+                    records[b->entries[k]].payloadSize;
+
+        if (end > start + written)
+        {
+            results[b->entries[k]] = kLogStoreInputOutputError;
+        }
+        else
+        {
+            const LogFileRecord *record = &records[b->entries[k]];
+
+            IndexEntry e = indexEntryMake(offset, record->prefix, 
+                                          record->size, entry->rev + 1);
+
+            indexEntryKeepValue(store, &e, entry->data);
+
+            results[b->entries[k]] = indexFileWrite(store, entry->id, e);
+        }
+
+        offset = end;
+    }
+
+    store->writeSequence++;
+
+    b->count = 0;
+    b->size  = 0;
+
+    memset(b->idFilter, 0, sizeof(b->idFilter));
+}
+
+int LogStorePutMany(LogStore                store,
+                    const LogStorePutEntry *entries,
+                    size_t                  count,
+                    int                    *results)
+{
+    if (NULL == store || (count > 0 && (NULL == entries || NULL == results)))
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    if (NULL != store->shards)
+    {
+        return shardedPutMany(store, entries, count, results);
+    }
+
+    PutBatch      *b       = storeAllocate(store, sizeof(PutBatch));
+    LogFileRecord *records = storeAllocate(store, 
+                                           count * sizeof(LogFileRecord) + 1);
+
+    if (NULL == b || NULL == records)
+    {
+        storeFree(store, b);
+        storeFree(store, records);
+
+        return kLogStoreOutOfMemory;
+    }
+
+    memset(b, 0, sizeof(PutBatch));
+    memset(records, 0, count * sizeof(LogFileRecord));
+
+    // Compress (if need be) before taking the lock.
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const LogStorePutEntry *entry = &entries[i];
+
+        results[i] = kLogStoreOK;
+
+        if (NULL == entry->data || 0 == entry->size)
+        {
+            results[i] = kLogStoreInvalidParameter;
+
+            continue;
+        }
+
+        logFileRecordMake(store, entry->id, entry->data, entry->size, 
+                          entry->rev + 1, &records[i]);
+    }
+
+    LogStoreLock;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const LogStorePutEntry *entry = &entries[i];
+
+        if (kLogStoreOK != results[i])
+        {
+            continue;
+        }
+
+        // A later entry for an ID in the batch must see the revision made by
+        // the earlier one, so the batch is written out first.
+
+        if (putBatchMayContain(b, entry->id))
+        {
+            putBatchFlush(store, b, entries, records, results);
+        }
+
+        IndexEntry e;
+
+        if (indexFileRead(store, entry->id, &e))
+        {
+            results[i] = kLogStoreInputOutputError;
+
+            continue;
+        }
+
+        if (indexEntryGetRevision(e) != entry->rev)
+        {
+            results[i] = kLogStoreRevisionConflict;
+
+            continue;
+        }
+
+        int k = b->count++;
+
+        b->iov[k * 2].iov_base     = records[i].prefix;
+        b->iov[k * 2].iov_len      = records[i].prefixSize;
+        b->iov[k * 2 + 1].iov_base = records[i].payload;
+        b->iov[k * 2 + 1].iov_len  = records[i].payloadSize;
+
+        b->entries[k] = i;
+        b->idFilter[(entry->id / 64) % 16] |= (uint64_t)1 << (entry->id % 64);
+
+        if (kPutManyBatchSize == b->count)
+        {
+            putBatchFlush(store, b, entries, records, results);
+        }
+    }
+
+    putBatchFlush(store, b, entries, records, results);
+
+    LogStoreUnlock;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        logFileRecordFree(store, &records[i]);
+    }
+
+    storeFree(store, records);
+    storeFree(store, b);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (kLogStoreOK != results[i])
+        {
+            return results[i];
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+// Check a payload against the checksum in its prefix, if it has one and the
+// store is to check it this time.
+
+static int logFileVerify(LogStore        store,
+                         const uint32_t *prefix,
+                         const void     *payload,
+                         size_t          payloadSize)
+{
+    static __thread unsigned sample;
+
+    if (!(prefix[1] & kLogFileEntryChecksummed) || 
+        kLogStoreVerifyNever == store->verify ||
+        (kLogStoreVerifySampled == store->verify && 0 != (sample++ & 15)))
+    {
+        return kLogStoreOK;
+    }
+
+    if (logStoreCrc32c(0, payload, payloadSize) != 
+        logFileEntryChecksum(prefix))
+    {
+        return kLogStoreTampered;
+    }
+
+    return kLogStoreOK;
+}
+
+// Decompress the payload of a compressed record into user data, allocated as
+// by logFileReadEntry.
+
+static int logFileDecompress(LogStore     store,
+                             const char  *payload,
+                             size_t       payloadSize,
+                             void       **ioData,
+                             size_t       capacity,
+                             size_t      *outSize)
+{
+    uint32_t size = 0;
+
+    if (payloadSize < sizeof(size))
+    {
+        return kLogStoreTampered;
+    }
+
+    memcpy(&size, payload, sizeof(size));
+
+    if (outSize)
+    {
+        *outSize = size;
+    }
+
+    void *data = *ioData;
+
+    if (NULL == data)
+    {
+        data = storeAllocate(store, size);
+
+        if (NULL == data)
+        {
+            return kLogStoreOutOfMemory;
+        }
+    }
+    else if (size > capacity)
+    {
+        return kLogStoreBufferTooSmall;
+    }
+
+    int result = logStoreLzDecompress(payload + sizeof(size), 
+                                      payloadSize - sizeof(size), data, size);
+
+    if (kLogStoreOK != result)
+    {
+        if (data != *ioData)
+        {
+            storeFree(store, data);
+        }
+
+        return result;
+    }
+
+    *ioData = data;
+
+    return kLogStoreOK;
+}
+
+// Make the value of a record read for an index entry into 'data': check the
+// record, decompress a compressed payload (and free it) and cache the value.
+// 'result' is that of reading the record.
+
+static int logFileReadDone(LogStore            store,
+                           LogStoreCache      *cache,
+                           LogStoreID          id,
+                           IndexEntry          entry,
+                           LogFileEntryPrefix  prefix,
+                           char               *payload,
+                           void               *data,
+                           int                 result)
+{
+    size_t prefixSize  = indexEntryGetPrefixSize(entry);
+    size_t payloadSize = indexEntryGetPayloadSize(entry);
+    size_t size        = entry.size;
+
+    if (kLogStoreOK == result &&
+        (logFileEntryID(prefix) != id ||
+         logFileEntryPrefixSize(prefix) != prefixSize ||
+         logFileEntryPayloadSize(prefix) != payloadSize))
+    {
+        // Sanity check that the record is the one expected.
+
+        result = kLogStoreTampered;
+    }
+    else if (kLogStoreOK == result)
+    {
+        result = logFileVerify(store, prefix, payload, payloadSize);
+    }
+
+    if (indexEntryGetFlags(entry) & kLogFileEntryCompressed)
+    {
+        size_t rawSize = 0;
+
+        if (kLogStoreOK == result)
+        {
+            result = logFileDecompress(store, payload, payloadSize, 
+                                       &data, size, &rawSize);
+        }
+
+        if (kLogStoreOK == result && rawSize != size)
+        {
+            result = kLogStoreTampered;
+        }
+
+        storeFree(store, payload);
+    }
+
+    if (kLogStoreOK == result && NULL != cache)
+    {
+        logStoreCachePut(cache, id, indexEntryGetRevision(entry), data, size);
+    }
+
+    return result;
+}
+
+// Read the record an index entry refers to from the log into user data.  If
+// *ioData is NULL, a buffer for the value is allocated; otherwise the value is
+// read into *ioData if it fits in 'capacity' bytes.  The value is looked up
+// in and added to 'cache', unless that is NULL.
+
+static int logFileReadEntry(LogStore          store,
+                            LogStoreCache    *cache,
+                            int               logFileNo,
+                            LogStoreID        id,
+                            IndexEntry        entry,
+                            void            **ioData,
+                            size_t            capacity,
+                            size_t           *outSize,
+                            LogStoreRevision *outRev)
+{
+    // Deleted or never put?
+
+    if (!indexEntryHasValue(entry))
+    {
+        return kLogStoreNotFound;
+    }
+
+    off_t            entryOffset   = indexEntryGetOffset(entry);
+    LogStoreRevision entryRevision = indexEntryGetRevision(entry);
+
+    if (outRev)
+    {
+        *outRev = entryRevision;
+    }
+
+    // A value kept in the index is not read from the log, nor cached.
+
+    if (entry.location & kIndexEntryInline)
+    {
+        if (outSize)
+        {
+            *outSize = entry.size;
+        }
+
+        void *data = *ioData;
+
+        if (NULL == data)
+        {
+            data = storeAllocate(store, entry.size);
+
+            if (NULL == data)
+            {
+                return kLogStoreOutOfMemory;
+            }
+        }
+        else if (entry.size > capacity)
+        {
+            return kLogStoreBufferTooSmall;
+        }
+
+        memcpy(data, indexEntryInlineValue(&entry), entry.size);
+
+        *ioData = data;
+
+        return kLogStoreOK;
+    }
+
+    // A cached value is only used if it is of the revision the index names.
+
+    if (NULL != cache)
+    {
+        int result = logStoreCacheGet(cache, id, entryRevision, 
+                                      ioData, capacity, outSize);
+
+        if (kLogStoreNotFound != result)
+        {
+            return result;
+        }
+    }
+
+    // The index knows the size of the record, so the record is read whole
+    // with a single preadv: its prefix, and its payload straight into user
+    // data unless it is compressed.
+
+    size_t prefixSize  = indexEntryGetPrefixSize(entry);
+    size_t payloadSize = indexEntryGetPayloadSize(entry);
+    size_t size        = entry.size;
+    int    compressed  = 0 != (indexEntryGetFlags(entry) & 
+                               kLogFileEntryCompressed);
+
+    if (outSize)
+    {
+        *outSize = size;
+    }
+
+    void *data = *ioData;
+
+    if (NULL == data)
+    {
+        data = storeAllocate(store, size);
+
+        if (NULL == data)
+        {
+            return kLogStoreOutOfMemory;
+        }
+    }
+    else if (size > capacity)
+    {
+        return kLogStoreBufferTooSmall;
+    }
+
+    char *payload = compressed ? storeAllocate(store, payloadSize) : data;
+    int   result  = kLogStoreOK;
+
+    LogFileEntryPrefix prefix;
+
+    struct iovec iov[2] =
+    {
+        { prefix, prefixSize },
+        { payload, payloadSize }
+    };
+
+    if (NULL == payload)
+    {
+        result = kLogStoreOutOfMemory;
+    }
+    else if (logFileReadv(store, logFileNo, iov, 2, entryOffset) < 
+             prefixSize + payloadSize)
+    {
+        result = kLogStoreInputOutputError;
+    }
+
+    if (NULL != payload)
+    {
+        result = logFileReadDone(store, cache, id, entry, prefix, payload, 
+                                 data, result);
+    }
+
+    if (kLogStoreOK != result)
+    {
+        if (data != *ioData)
+        {
+            storeFree(store, data);
+        }
+
+        return result;
+    }
+
+    *ioData = data;
+
+    return kLogStoreOK;
+}
+
+int LogStoreGet(LogStore          store,
+                LogStoreID        id,
+                void            **outData,
+                size_t           *outSize,
+                LogStoreRevision *outRev)
+{
+    if (NULL == store || NULL == outData || NULL != *outData)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    store = storeShard(store, &id);
+
+    // Gets run concurrently with each other and with writers.
+
+    unsigned epoch = epochEnter(store);
+
+    IndexEntry entry;
+    int        logFileNo;
+
+    int result = indexFileLoad(store, id, &entry, &logFileNo);
+
+    if (kLogStoreOK == result)
+    {
+        result = logFileReadEntry(store, store->cache, logFileNo, id, entry, 
+                                  outData, 0, outSize, outRev);
+    }
+
+    epochExit(store, epoch);
+
+    return result;
+}
+
+int LogStoreGetInto(LogStore          store,
+                    LogStoreID        id,
+                    void             *buffer,
+                    size_t            capacity,
+                    size_t           *outSize,
+                    LogStoreRevision *outRev)
+{
+    if (NULL == store || NULL == buffer)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    store = storeShard(store, &id);
+
+    unsigned epoch = epochEnter(store);
+
+    IndexEntry entry;
+    int        logFileNo;
+
+    int result = indexFileLoad(store, id, &entry, &logFileNo);
+
+    if (kLogStoreOK == result)
+    {
+        result = logFileReadEntry(store, store->cache, logFileNo, id, entry, 
+                                  &buffer, capacity, outSize, outRev);
+    }
+
+    epochExit(store, epoch);
+
+    return result;
+}
+
+// LogStoreGetMany reads records in log offset order and reads records that
+// are no more than this many bytes apart with a single preadv.
+
+#define kGetManyMaxGap (16 * 1024)
+
+#ifdef IOV_MAX
+#define kGetManyMaxIov IOV_MAX
+#else
+#define kGetManyMaxIov 1024
+#endif
+
+typedef struct GetRequest
+{
+    size_t           index;         // into the caller's arrays
+    int              logFileNo;
+    off_t            offset;
+    size_t           prefixSize;    // see LogFileEntryPrefix
+    size_t           size;          // of the payload
+    size_t           rawSize;       // of the value, per the index
+    LogStoreRevision rev;
+    int              compressed;
+} GetRequest;
+
+static int getRequestCompare(const void *a, const void *b)
+{
+    const GetRequest *ra = a;
+    const GetRequest *rb = b;
+
+    if (ra->logFileNo != rb->logFileNo)
+    {
+        return ra->logFileNo < rb->logFileNo ? -1 : 1;
+    }
+
+    if (ra->offset != rb->offset)
+    {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+
+    return 0;
+}
+
+// Read a run of records that lie close together in the log with one preadv,
+// reading the gaps between them into a scratch buffer.
+
+static void getRequestReadRun(LogStore          store,
+                              GetRequest       *run,
+                              int               runLength,
+                              struct iovec     *iov,
+                              char             *gap,
+                              const LogStoreID *ids,
+                              void            **outData,
+                              int              *results)
+{
+    LogFileEntryPrefix prefixes[runLength];
+
+    int   iovCount = 0;
+    off_t end      = run[0].offset;
+
+    for (int k = 0; k < runLength; ++k)
+    {
+        if (run[k].offset > end)
+        {
+            iov[iovCount].iov_base = gap;
+            iov[iovCount].iov_len  = run[k].offset - end;
+            iovCount++;
+        }
+
+        iov[iovCount].iov_base = prefixes[k];
+        iov[iovCount].iov_len  = run[k].prefixSize;
+        iovCount++;
+
+        iov[iovCount].iov_base = outData[run[k].index];
+        iov[iovCount].iov_len  = run[k].size;
+        iovCount++;
+
+        end = run[k].offset + run[k].prefixSize + run[k].size;
+    }
+
+    size_t expected  = end - run[0].offset;
+    size_t bytesRead = logFileReadv(store, run[0].logFileNo, iov, iovCount, 
+                                    run[0].offset);
+
+    for (int k = 0; k < runLength; ++k)
+    {
+        size_t i = run[k].index;
+
+        if (bytesRead < expected)
+        {
+            results[i] = kLogStoreInputOutputError;
+        }
+        else if (logFileEntryID(prefixes[k]) != ids[i] || 
+                 logFileEntryPrefixSize(prefixes[k]) != run[k].prefixSize ||
+                 logFileEntryPayloadSize(prefixes[k]) != run[k].size)
+        {
+            results[i] = kLogStoreTampered;
+        }
+        else if (kLogStoreOK == (results[i] = logFileVerify(store, prefixes[k],
+                                                            outData[i], 
+                                                            run[k].size)))
+        {
+            continue;
+        }
+
+        storeFree(store, outData[i]);
+        outData[i] = NULL;
+    }
+}
+
+int LogStoreGetMany(LogStore          store,
+                    const LogStoreID *ids,
+                    size_t            count,
+                    void            **outData,
+                    size_t           *outSizes,
+                    LogStoreRevision *outRevs,
+                    int              *results)
+{
+    if (NULL == store || 
+        (count > 0 && (NULL == ids || NULL == outData || NULL == results)))
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    if (NULL != store->shards)
+    {
+        return shardedGetMany(store, ids, count, outData, outSizes, outRevs, 
+                              results);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (NULL != outData[i])
+        {
+            return kLogStoreInvalidParameter;
+        }
+    }
+
+    GetRequest   *requests = storeAllocate(store, 
+                                           count * sizeof(GetRequest) + 1);
+    struct iovec *iov      = storeAllocate(store, 
+                                           kGetManyMaxIov * sizeof(struct iovec));
+    char         *gap      = storeAllocate(store, kGetManyMaxGap);
+
+    if (NULL == requests || NULL == iov || NULL == gap)
+    {
+        storeFree(store, requests);
+        storeFree(store, iov);
+        storeFree(store, gap);
+
+        return kLogStoreOutOfMemory;
+    }
+
+    unsigned epoch = epochEnter(store);
+
+    // Resolve all of the index entries first.
+
+    size_t requestCount = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        IndexEntry entry;
+        int        logFileNo;
+
+        results[i] = indexFileLoad(store, ids[i], &entry, &logFileNo);
+
+        if (kLogStoreOK == results[i] && !indexEntryHasValue(entry))
+        {
+            results[i] = kLogStoreNotFound;
+        }
+
+        if (kLogStoreOK != results[i])
+        {
+            continue;
+        }
+
+        if (entry.location & kIndexEntryInline)
+        {
+            if (NULL == (outData[i] = storeAllocate(store, entry.size)))
+            {
+                results[i] = kLogStoreOutOfMemory;
+
+                continue;
+            }
+
+            memcpy(outData[i], indexEntryInlineValue(&entry), entry.size);
+
+            if (outSizes)
+            {
+                outSizes[i] = entry.size;
+            }
+
+            if (outRevs)
+            {
+                outRevs[i] = indexEntryGetRevision(entry);
+            }
+
+            continue;
+        }
+
+        if (NULL != store->cache)
+        {
+            size_t           size = 0;
+            LogStoreRevision rev  = indexEntryGetRevision(entry);
+
+            results[i] = logStoreCacheGet(store->cache, ids[i], rev, 
+                                          &outData[i], 0, &size);
+
+            if (kLogStoreNotFound != results[i])
+            {
+                if (outSizes)
+                {
+                    outSizes[i] = size;
+                }
+
+                if (outRevs)
+                {
+                    outRevs[i] = rev;
+                }
+
+                continue;
+            }
+
+            results[i] = kLogStoreOK;
+        }
+
+        // A compressed payload is read into a buffer of its own for now.
+
+        size_t payloadSize = indexEntryGetPayloadSize(entry);
+
+        if (NULL == (outData[i] = storeAllocate(store, payloadSize)))
+        {
+            results[i] = kLogStoreOutOfMemory;
+
+            continue;
+        }
+
+        GetRequest *r = &requests[requestCount++];
+
+        r->index      = i;
+        r->logFileNo  = logFileNo;
+        r->offset     = indexEntryGetOffset(entry);
+        r->prefixSize = indexEntryGetPrefixSize(entry);
+        r->size       = payloadSize;
+        r->rawSize    = entry.size;
+        r->rev        = indexEntryGetRevision(entry);
+        r->compressed = 0 != (indexEntryGetFlags(entry) & 
+                              kLogFileEntryCompressed);
+    }
+
+    // Read the records in the order they appear in the log.
+
+    qsort(requests, requestCount, sizeof(GetRequest), getRequestCompare);
+
+    for (size_t k = 0; k < requestCount; )
+    {
+        size_t runLength = 1;
+        int    iovCount  = 3;
+        off_t  end       = requests[k].offset + requests[k].prefixSize + 
+                           requests[k].size;
+
+        while (k + runLength < requestCount)
+        {
+            GetRequest *next = &requests[k + runLength];
+
+            if (next->logFileNo != requests[k].logFileNo || 
+                next->offset < end || 
+                next->offset - end > kGetManyMaxGap ||
+                iovCount + 3 > kGetManyMaxIov)
+            {
+                break;
+            }
+
+            end = next->offset + next->prefixSize + next->size;
+
+            iovCount += 3;
+            runLength++;
+        }
+
+        getRequestReadRun(store, &requests[k], runLength, iov, gap, 
+                          ids, outData, results);
+
+        k += runLength;
+    }
+
+    epochExit(store, epoch);
+
+    for (size_t k = 0; k < requestCount; ++k)
+    {
+        GetRequest *r = &requests[k];
+
+        if (kLogStoreOK == results[r->index] && r->compressed)
+        {
+            char *payload = outData[r->index];
+
+            outData[r->index] = NULL;
+
+            results[r->index] = logFileDecompress(store, payload, r->size,
+                                                  &outData[r->index], 0,
+                                                  &r->size);
+
+            storeFree(store, payload);
+
+            // As in logFileReadDone, the value must decode to the size the
+            // index gives it.
+
+            if (kLogStoreOK == results[r->index] && r->size != r->rawSize)
+            {
+                storeFree(store, outData[r->index]);
+                outData[r->index] = NULL;
+
+                results[r->index] = kLogStoreTampered;
+            }
+        }
+
+        if (kLogStoreOK != results[r->index])
+        {
+            continue;
+        }
+
+        if (outSizes)
+        {
+            outSizes[r->index] = r->size;
+        }
+
+        if (outRevs)
+        {
+            outRevs[r->index] = r->rev;
+        }
+
+        if (NULL != store->cache)
+        {
+            logStoreCachePut(store->cache, ids[r->index], r->rev, 
+                             outData[r->index], r->size);
+        }
+    }
+
+    storeFree(store, requests);
+    storeFree(store, iov);
+    storeFree(store, gap);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (kLogStoreOK != results[i])
+        {
+            return results[i];
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+// Learn what the index says of an ID.  An ID that was never made has no
+// value, as one never put.  The caller is inside an epoch.
+
+static int indexFileStat(LogStore          store,
+                         LogStoreID        id,
+                         int              *outExists,
+                         size_t           *outSize,
+                         LogStoreRevision *outRev)
+{
+    IndexEntry entry = { 0, 0, 0, 0 };
+    int        logFileNo;
+
+    int result = indexFileLoad(store, id, &entry, &logFileNo);
+
+    if (kLogStoreOK != result && kLogStoreNotFound != result)
+    {
+        return result;
+    }
+
+    int exists = indexEntryHasValue(entry);
+
+    if (outExists)
+    {
+        *outExists = exists;
+    }
+
+    if (outSize)
+    {
+        *outSize = exists ? entry.size : 0;
+    }
+
+    if (outRev)
+    {
+        *outRev = indexEntryGetRevision(entry);
+    }
+
+    return kLogStoreOK;
+}
+
+int LogStoreStat(LogStore          store,
+                 LogStoreID        id,
+                 int              *outExists,
+                 size_t           *outSize,
+                 LogStoreRevision *outRev)
+{
+    if (NULL == store)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    store = storeShard(store, &id);
+
+    unsigned epoch = epochEnter(store);
+
+    int result = indexFileStat(store, id, outExists, outSize, outRev);
+
+    epochExit(store, epoch);
+
+    return result;
+}
+
+int LogStoreStatMany(LogStore          store,
+                     const LogStoreID *ids,
+                     size_t            count,
+                     int              *outExists,
+                     size_t           *outSizes,
+                     LogStoreRevision *outRevs)
+{
+    if (NULL == store || (count > 0 && NULL == ids))
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    int result = kLogStoreOK;
+
+    // A sharded store has an epoch per shard; each ID is looked up in its own.
+
+    if (NULL != store->shards)
+    {
+        for (size_t i = 0; i < count && kLogStoreOK == result; ++i)
+        {
+            result = LogStoreStat(store, ids[i], 
+                                  outExists ? &outExists[i] : NULL,
+                                  outSizes ? &outSizes[i] : NULL,
+                                  outRevs ? &outRevs[i] : NULL);
+        }
+
+        return result;
+    }
+
+    unsigned epoch = epochEnter(store);
+
+    for (size_t i = 0; i < count && kLogStoreOK == result; ++i)
+    {
+        result = indexFileStat(store, ids[i], 
+                               outExists ? &outExists[i] : NULL,
+                               outSizes ? &outSizes[i] : NULL,
+                               outRevs ? &outRevs[i] : NULL);
+    }
+
+    epochExit(store, epoch);
+
+    return result;
+}
+
+// LogStoreIterate reads the log this much at a time, and looks up the index
+// entries of the records read this many at a time.
+
+#define kIterateBufferSize     (8 * 1024 * 1024)
+#define kIterateEntriesPerLock 128
+
+// A record read by LogStoreIterate, and its index entry.
+
+typedef struct IterateRecord
+{
+    LogFileEntryPrefix prefix;
+    size_t             start;                      // in the buffer
+    IndexEntry         entry;
+    int                live;
+} IterateRecord;
+
+// Note for each record of a batch whether it is the one the index refers to
+// (as of a snapshot, unless that is NULL), and if so, its entry.  The entries
+// of a snapshot are loaded under the lock, taken once for the batch rather
+// than once per record, so that a scan holds up writers less.  The caller does
+// not hold the lock.
+
+static void iterateResolve(LogStore         store,
+                           LogStoreSnapshot snapshot,
+                           off_t            offset,
+                           IterateRecord   *records,
+                           size_t           count)
+{
+    if (NULL != snapshot)
+    {
+        LogStoreLock;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        IterateRecord *record = &records[i];
+        LogStoreID     id     = logFileEntryID(record->prefix);
+        int            result;
+
+        if (NULL != snapshot)
+        {
+            result = snapshotLoad(snapshot, id, &record->entry);
+        }
+        else
+        {
+            unsigned epoch = epochEnter(store);
+            int      logFileNo;
+
+            result = indexFileLoad(store, id, &record->entry, &logFileNo);
+
+            epochExit(store, epoch);
+        }
+
+        record->live = kLogStoreOK == result && 
+                       indexEntryHasValue(record->entry) && 
+                       indexEntryGetOffset(record->entry) == 
+                       offset + record->start;
+    }
+
+    if (NULL != snapshot)
+    {
+        LogStoreUnlock;
+    }
+}
+
+// Pass the value of a live record to the callback, decompressed if need be.
+
+static int iterateRecord(LogStore                store,
+                         const uint32_t         *prefix,
+                         const char             *payload,
+                         IndexEntry              entry,
+                         LogStoreID              id,
+                         LogStoreIterateCallback callback,
+                         void                   *context)
+{
+    size_t payloadSize = logFileEntryPayloadSize(prefix);
+
+    int result = logFileVerify(store, prefix, payload, payloadSize);
+
+    if (kLogStoreOK != result)
+    {
+        return result;
+    }
+
+    if (!(prefix[1] & kLogFileEntryCompressed))
+    {
+        return callback(context, id, payload, payloadSize, entry.rev);
+    }
+
+    void  *data = NULL;
+    size_t size = 0;
+
+    result = logFileDecompress(store, payload, payloadSize, &data, 0, &size);
+
+    if (kLogStoreOK == result)
+    {
+        result = callback(context, id, data, size, entry.rev);
+
+        storeFree(store, data);
+    }
+
+    return result;
+}
+
+// Visit the values in the log of a store (a shard: its IDs are reported as
+// local*idScale+idOffset) up to where the log ends now, or as of a snapshot
+// unless that is NULL.  The next piece of the log is read ahead while the
+// values of one are visited.  The log file is not replaced meanwhile since
+// compaction is held off.
+
+static int logFileIterate(LogStore                store,
+                          LogStoreSnapshot        snapshot,
+                          LogStoreID              idScale,
+                          LogStoreID              idOffset,
+                          LogStoreIterateCallback callback,
+                          void                   *context,
+                          int                     flags)
+{
+    size_t         capacity = kIterateBufferSize;
+    char          *buffer   = storeAllocate(store, capacity);
+    IterateRecord *records  = storeAllocate(store, kIterateEntriesPerLock * 
+                                                   sizeof(IterateRecord));
+
+    if (NULL == buffer || NULL == records)
+    {
+        storeFree(store, buffer);
+        storeFree(store, records);
+
+        return kLogStoreOutOfMemory;
+    }
+
+    pthread_mutex_lock(&store->compactMutex);
+
+    // What is still buffered is written first, so that it is iterated too.
+
+    LogStoreLock;
+
+    int   result      = NULL == snapshot ? appendBufferFlush(store) : 
+                                           kLogStoreOK;
+    int   logFileNo   = logFileScanBegin(store);
+    off_t logFileSize = NULL == snapshot ? store->logFileSize : 
+                                           snapshot->logFileSize;
+    off_t pos         = 0;
+
+    LogStoreUnlock;
+
+    if (-1 == logFileNo)
+    {
+        result = kLogStoreInputOutputError;
+    }
+
+    posix_fadvise(logFileNo, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (kLogStoreOK == result && pos < logFileSize)
+    {
+        size_t want = capacity;
+
+        if (logFileSize - pos < want)
+        {
+            want = logFileSize - pos;
+        }
+
+        if (kLogStoreOK != (result = readFully(logFileNo, buffer, want, pos)))
+        {
+            break;
+        }
+
+        posix_fadvise(logFileNo, pos + want, capacity, POSIX_FADV_WILLNEED);
+
+        size_t used = 0;
+
+        while (kLogStoreOK == result && used < want)
+        {
+            // Gather a batch of the records with values in the buffer.
+
+            size_t count = 0;
+            size_t end   = used;
+
+            while (count < kIterateEntriesPerLock && end < want)
+            {
+                IterateRecord *record = &records[count];
+
+                uint64_t length = logFileEntryParse(buffer + end, want - end, 
+                                                    record->prefix);
+
+                if (0 == length || length > want - end)
+                {
+                    break;
+                }
+
+                if (0 != logFileEntryPayloadSize(record->prefix))
+                {
+                    record->start = end;
+                    ++count;
+                }
+
+                end += length;
+            }
+
+            if (end == used)
+            {
+                break;
+            }
+
+            iterateResolve(store, snapshot, pos, records, count);
+
+            for (size_t i = 0; kLogStoreOK == result && i < count; ++i)
+            {
+                IterateRecord *record = &records[i];
+
+                if (record->live)
+                {
+                    result = iterateRecord(store, record->prefix, 
+                                           buffer + record->start + 
+                                           logFileEntryPrefixSize(
+                                               record->prefix),
+                                           record->entry, 
+                                           logFileEntryID(record->prefix) * 
+                                           idScale + idOffset, 
+                                           callback, context);
+                }
+            }
+
+            used = end;
+        }
+
+        if (flags & kLogStoreIterateNoCache && used > 0)
+        {
+            posix_fadvise(logFileNo, pos, used, POSIX_FADV_DONTNEED);
+        }
+
+        if (kLogStoreOK == result && 0 == used)
+        {
+            // The next record does not fit in the buffer.
+
+            LogFileEntryPrefix prefix;
+
+            uint64_t length = logFileEntryParse(buffer, want, prefix);
+
+            if (0 == length || length > logFileSize - pos)
+            {
+                result = kLogStoreTampered;
+
+                break;
+            }
+
+            char *larger = storeReallocate(store, buffer, capacity, length);
+
+            if (NULL == larger)
+            {
+                result = kLogStoreOutOfMemory;
+
+                break;
+            }
+
+            buffer   = larger;
+            capacity = length;
+        }
+
+        pos += used;
+    }
+
+    logFileScanEnd(store, logFileNo);
+
+    pthread_mutex_unlock(&store->compactMutex);
+
+    storeFree(store, buffer);
+    storeFree(store, records);
+
+    return result;
+}
+
+int LogStoreIterate(LogStore                store,
+                    LogStoreIterateCallback callback,
+                    void                   *context,
+                    int                     flags)
+{
+    if (NULL == store || NULL == callback)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    if (NULL == store->shards)
+    {
+        return logFileIterate(store, NULL, 1, 0, callback, context, flags);
+    }
+
+    for (int i = 0; i < store->shardCount; ++i)
+    {
+        int result = logFileIterate(store->shards[i], NULL, 
+                                    store->shardCount, i, 
+                                    callback, context, flags);
+
+        if (kLogStoreOK != result)
+        {
+            return result;
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+// Take a snapshot of a store.  The caller holds the lock.
+
+static int snapshotCreate(LogStore store, LogStoreSnapshot *outSnapshot)
+{
+    LogStoreSnapshot snapshot = storeAllocate(store, 
+                                              sizeof(struct LogStoreSnapshot));
+
+    if (NULL == snapshot)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    // A snapshot iterates the log file, so what is still buffered is written
+    // first.
+
+    if (kLogStoreOK != appendBufferFlush(store))
+    {
+        storeFree(store, snapshot);
+
+        return kLogStoreInputOutputError;
+    }
+
+    memset(snapshot, 0, sizeof(struct LogStoreSnapshot));
+
+    snapshot->store          = store;
+    snapshot->indexFileCount = __atomic_load_n(&store->indexFileCount, 
+                                               __ATOMIC_ACQUIRE);
+    snapshot->logFileSize    = store->logFileSize;
+    snapshot->older          = store->snapshots;
+
+    if (NULL != store->snapshots)
+    {
+        store->snapshots->newer = snapshot;
+    }
+
+    store->snapshots = snapshot;
+    *outSnapshot     = snapshot;
+
+    return kLogStoreOK;
+}
+
+// Drop a snapshot of a store, along with the pages only it had.  The caller
+// holds the lock.
+
+static void snapshotDestroy(LogStoreSnapshot snapshot)
+{
+    LogStore store = snapshot->store;
+
+    if (NULL != snapshot->newer)
+    {
+        snapshot->newer->older = snapshot->older;
+    }
+    else
+    {
+        store->snapshots = snapshot->older;
+    }
+
+    if (NULL != snapshot->older)
+    {
+        snapshot->older->newer = snapshot->newer;
+    }
+
+    for (size_t i = 0; i < snapshot->pageCapacity; ++i)
+    {
+        if (NULL != snapshot->pages[i] && 0 == --snapshot->pages[i]->refCount)
+        {
+            storeFree(store, snapshot->pages[i]);
+        }
+    }
+
+    storeFree(store, snapshot->pageKeys);
+    storeFree(store, snapshot->pages);
+    storeFree(store, snapshot);
+}
+
+int LogStoreSnapshotOpen(LogStore store, LogStoreSnapshot *outSnapshot)
+{
+    if (NULL == store || NULL == outSnapshot || NULL != *outSnapshot)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    if (NULL == store->shards)
+    {
+        LogStoreLock;
+
+        int result = snapshotCreate(store, outSnapshot);
+
+        LogStoreUnlock;
+
+        return result;
+    }
+
+    // The shards are all locked so that their snapshots are of one instant.
+
+    LogStoreSnapshot snapshot = storeAllocate(store, 
+                                              sizeof(struct LogStoreSnapshot));
+    LogStoreSnapshot *shards  = storeAllocate(store, store->shardCount * 
+                                                     sizeof(LogStoreSnapshot));
+
+    if (NULL == snapshot || NULL == shards)
+    {
+        storeFree(store, snapshot);
+        storeFree(store, shards);
+
+        return kLogStoreOutOfMemory;
+    }
+
+    memset(snapshot, 0, sizeof(struct LogStoreSnapshot));
+    memset(shards, 0, store->shardCount * sizeof(LogStoreSnapshot));
+
+    snapshot->store      = store;
+    snapshot->shards     = shards;
+    snapshot->shardCount = store->shardCount;
+
+    int result = kLogStoreOK;
+
+    for (int i = 0; i < store->shardCount; ++i)
+    {
+        pthread_mutex_lock(&store->shards[i]->mutex);
+    }
+
+    for (int i = 0; i < store->shardCount && kLogStoreOK == result; ++i)
+    {
+        result = snapshotCreate(store->shards[i], &shards[i]);
+    }
+
+    for (int i = 0; i < store->shardCount; ++i)
+    {
+        pthread_mutex_unlock(&store->shards[i]->mutex);
+    }
+
+    if (kLogStoreOK != result)
+    {
+        LogStoreSnapshotClose(&snapshot);
+
+        return result;
+    }
+
+    *outSnapshot = snapshot;
+
+    return kLogStoreOK;
+}
+
+int LogStoreSnapshotClose(LogStoreSnapshot *ioSnapshot)
+{
+    if (NULL == ioSnapshot || NULL == *ioSnapshot)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    LogStoreSnapshot snapshot = *ioSnapshot;
+    LogStore         store    = snapshot->store;
+
+    if (NULL != snapshot->shards)
+    {
+        for (int i = 0; i < snapshot->shardCount; ++i)
+        {
+            if (NULL != snapshot->shards[i])
+            {
+                LogStoreSnapshotClose(&snapshot->shards[i]);
+            }
+        }
+
+        storeFree(store, snapshot->shards);
+        storeFree(store, snapshot);
+    }
+    else
+    {
+        LogStoreLock;
+
+        snapshotDestroy(snapshot);
+
+        LogStoreUnlock;
+    }
+
+    *ioSnapshot = NULL;
+
+    return kLogStoreOK;
+}
+
+int LogStoreSnapshotGet(LogStoreSnapshot  snapshot,
+                        LogStoreID        id,
+                        void            **outData,
+                        size_t           *outSize,
+                        LogStoreRevision *outRev)
+{
+    if (NULL == snapshot || NULL == outData || NULL != *outData)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    if (NULL != snapshot->shards)
+    {
+        LogStoreID shardCount = snapshot->shardCount;
+
+        snapshot = snapshot->shards[id % shardCount];
+        id       = id / shardCount;
+    }
+
+    // The log file is not replaced while there is a snapshot, and what the
+    // snapshot refers to in it is never overwritten.
+
+    LogStore   store = snapshot->store;
+    IndexEntry entry;
+
+    LogStoreLock;
+
+    int result    = snapshotLoad(snapshot, id, &entry);
+    int logFileNo = store->logFileNo;
+
+    LogStoreUnlock;
+
+    if (kLogStoreOK == result)
+    {
+        result = logFileReadEntry(store, NULL, logFileNo, id, entry, 
+                                  outData, 0, outSize, outRev);
+    }
+
+    return result;
+}
+
+int LogStoreSnapshotIterate(LogStoreSnapshot        snapshot,
+                            LogStoreIterateCallback callback,
+                            void                   *context,
+                            int                     flags)
+{
+    if (NULL == snapshot || NULL == callback)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    if (NULL == snapshot->shards)
+    {
+        return logFileIterate(snapshot->store, snapshot, 1, 0, 
+                              callback, context, flags);
+    }
+
+    for (int i = 0; i < snapshot->shardCount; ++i)
+    {
+        int result = logFileIterate(snapshot->shards[i]->store, 
+                                    snapshot->shards[i], 
+                                    snapshot->shardCount, i, 
+                                    callback, context, flags);
+
+        if (kLogStoreOK != result)
+        {
+            return result;
+        }
+    }
+
+    return kLogStoreOK;
+}
+
+// Views (see LogStoreGetView) point into a read-only mapping of the log file.
+// The mapping is made larger than the log so that it need not be replaced
+// each time the log grows; mapping beyond the end of a file is fine as long
+// as nothing past the end is touched.
+
+#define kLogFileMappingMinSize ((size_t)64 * 1024 * 1024)
+
+static void logFileMappingRelease(LogStore               store,
+                                  struct LogFileMapping *mapping)
+{
+    if (NULL != mapping &&
+        0 == __atomic_sub_fetch(&mapping->refCount, 1, __ATOMIC_ACQ_REL))
+    {
+        munmap(mapping->base, mapping->size);
+        storeFree(store, mapping);
+    }
+}
+
+// Make sure the current log file is mapped through at least 'size' bytes.
+// The caller holds the lock and is not inside an epoch.
+
+static int logFileMappingExtend(LogStore store, off_t size)
+{
+    struct LogFileMapping *old = store->logFileMapping;
+
+    if (NULL != old && old->size >= size)
+    {
+        return kLogStoreOK;
+    }
+
+    size_t pageSize    = sysconf(_SC_PAGESIZE);
+    size_t mappingSize = store->logFileSize * 2;
+
+    if (mappingSize < size)
+    {
+        mappingSize = size;
+    }
+
+    if (mappingSize < kLogFileMappingMinSize)
+    {
+        mappingSize = kLogFileMappingMinSize;
+    }
+
+    mappingSize = (mappingSize + pageSize - 1) / pageSize * pageSize;
+
+    struct LogFileMapping *mapping = storeAllocate(store, 
+                                                   sizeof(struct LogFileMapping));
+
+    if (NULL == mapping)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    mapping->base = mmap(0, mappingSize, PROT_READ, MAP_SHARED, 
+                         store->logFileNo, 0);
+
+    if (MAP_FAILED == mapping->base)
+    {
+        storeFree(store, mapping);
+
+        return kLogStoreInputOutputError;
+    }
+
+    mapping->size      = mappingSize;
+    mapping->logFileNo = store->logFileNo;
+    mapping->refCount  = 1;
+
+    __atomic_store_n(&store->logFileMapping, mapping, __ATOMIC_RELEASE);
+
+    // Views of the old mapping keep it alive; gets that might be about to take
+    // a reference to it are waited for.
+
+    if (NULL != old)
+    {
+        epochSynchronize(store);
+
+        logFileMappingRelease(store, old);
+    }
+
+    return kLogStoreOK;
+}
+
+// Take a reference to the mapping of the log file that covers the record at
+// the given offset.  Returns NULL if there is no such mapping (yet).  The
+// caller is inside an epoch.
+
+static struct LogFileMapping *logFileMappingAcquire(LogStore store,
+                                                    int      logFileNo,
+                                                    off_t    offset,
+                                                    off_t    logFileSize)
+{
+    struct LogFileMapping *mapping = __atomic_load_n(&store->logFileMapping,
+                                                     __ATOMIC_ACQUIRE);
+
+    if (NULL == mapping || 
+        mapping->logFileNo != logFileNo || 
+        mapping->size < logFileSize ||
+        offset + sizeof(LogFileEntryHeader) > logFileSize)
+    {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&mapping->refCount, 1, __ATOMIC_ACQ_REL);
+
+    return mapping;
+}
+
+int LogStoreGetView(LogStore      store,
+                    LogStoreID    id,
+                    const void  **outData,
+                    size_t       *outSize,
+                    LogStoreView *outView)
+{
+    if (NULL == store || NULL == outData || NULL == outView)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    store = storeShard(store, &id);
+
+    outView->mapping = NULL;
+    outView->buffer  = NULL;
+
+    if (!(store->options & kLogStoreOptionMapLog))
+    {
+        size_t size = 0;
+
+        int result = LogStoreGet(store, id, &outView->buffer, &size, NULL);
+
+        if (kLogStoreOK == result)
+        {
+            *outData = outView->buffer;
+
+            if (outSize)
+            {
+                *outSize = size;
+            }
+        }
+
+        return result;
+    }
+
+    for (;;)
+    {
+        unsigned epoch = epochEnter(store);
+
+        IndexEntry entry;
+        int        logFileNo;
+
+        int result = indexFileLoad(store, id, &entry, &logFileNo);
+
+        if (kLogStoreOK == result && !indexEntryHasValue(entry))
+        {
+            result = kLogStoreNotFound;
+        }
+
+        if (kLogStoreOK != result)
+        {
+            epochExit(store, epoch);
+
+            return result;
+        }
+
+        // Only what has been appended in full is safe to touch.
+
+        off_t offset      = indexEntryGetOffset(entry);
+        off_t logFileSize = __atomic_load_n(&store->logFileSize, 
+                                            __ATOMIC_ACQUIRE);
+
+        struct LogFileMapping *mapping = 
+            logFileMappingAcquire(store, logFileNo, offset, logFileSize);
+
+        epochExit(store, epoch);
+
+        if (NULL == mapping)
+        {
+            // Map (more of) the log and try again.  A view of a record still
+            // in the append buffer has to wait for it to be written.
+
+            LogStoreLock;
+
+            result = appendBufferFlush(store);
+
+            if (kLogStoreOK == result)
+            {
+                result = logFileMappingExtend(store, store->logFileSize);
+            }
+
+            LogStoreUnlock;
+
+            if (kLogStoreOK != result)
+            {
+                return result;
+            }
+
+            continue;
+        }
+
+        LogFileEntryPrefix prefix;
+
+        size_t prefixSize  = indexEntryGetPrefixSize(entry);
+        size_t payloadSize = indexEntryGetPayloadSize(entry);
+
+        if (offset + prefixSize + payloadSize > logFileSize)
+        {
+            logFileMappingRelease(store, mapping);
+
+            return kLogStoreTampered;
+        }
+
+        memcpy(prefix, mapping->base + offset, prefixSize);
+
+        if (logFileEntryID(prefix) != id || 
+            logFileEntryPrefixSize(prefix) != prefixSize ||
+            logFileEntryPayloadSize(prefix) != payloadSize)
+        {
+            logFileMappingRelease(store, mapping);
+
+            return kLogStoreTampered;
+        }
+
+        const char *payload = mapping->base + offset + prefixSize;
+
+        if (kLogStoreOK != logFileVerify(store, prefix, payload, payloadSize))
+        {
+            logFileMappingRelease(store, mapping);
+
+            return kLogStoreTampered;
+        }
+
+        if (prefix[1] & kLogFileEntryCompressed)
+        {
+            // There is nothing to point into; the view owns the value.
+
+            size_t size = 0;
+
+            result = logFileDecompress(store, payload, payloadSize, 
+                                       &outView->buffer, 0, &size);
+
+            logFileMappingRelease(store, mapping);
+
+            if (kLogStoreOK == result)
+            {
+                *outData = outView->buffer;
+
+                if (outSize)
+                {
+                    *outSize = size;
+                }
+            }
+
+            return result;
+        }
+
+        *outData = payload;
+
+        if (outSize)
+        {
+            *outSize = payloadSize;
+        }
+
+        outView->mapping = mapping;
+
+        return kLogStoreOK;
+    }
+}
+
+int LogStoreReleaseView(LogStore store, LogStoreView *view)
+{
+    if (NULL == store || NULL == view)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    logFileMappingRelease(store, view->mapping);
+    storeFree(store, view->buffer);
+
+    view->mapping = NULL;
+    view->buffer  = NULL;
+
+    return kLogStoreOK;
+}
+
+// An asynchronous call in progress.  Its work item comes first, so that the
+// engine's callbacks can find it.  A get is in an epoch only while it loads
+// its entry, never while it is queued: the engine's threads may be held up by
+// puts and syncs waiting for the lock, and whoever holds that may be waiting
+// for the epoch to end.  A read of the log in flight holds a reference to the
+// log file's handle instead.
+
+typedef struct AsyncCall
+{
+    LogStoreAsyncWork    work;
+    LogStore             store;
+    LogStoreID           id;
+    void                *data;          // to put, or the value got
+    size_t               size;
+    LogStoreRevision     rev;
+    int                  result;
+    LogStoreGetCallback  getCallback;
+    LogStoreDoneCallback doneCallback;
+    void                *context;
+
+    IndexEntry           entry;
+    int                  logFileNo;
+    struct LogFileHandle *logFileHandle;
+    LogFileEntryPrefix   prefix;
+    char                *payload;
+    struct iovec         iov[2];
+    char                *blocks;        // see kLogStoreOptionDirect
+    char                *blocksMemory;
+} AsyncCall;
+
+static AsyncCall *asyncCallMake(LogStore store, void *context)
+{
+    AsyncCall *call = storeAllocate(store, sizeof(AsyncCall));
+
+    if (NULL != call)
+    {
+        memset(call, 0, sizeof(AsyncCall));
+
+        call->store       = store;
+        call->context     = context;
+        call->work.fileNo = -1;
+    }
+
+    return call;
+}
+
+static void asyncGetFinish(LogStoreAsyncWork *work, size_t bytesRead)
+{
+    AsyncCall *call  = (AsyncCall *)work;
+    LogStore   store = call->store;
+
+    logFileHandleRelease(store, call->logFileHandle);
+
+    if (kLogStoreOK != call->result)
+    {
+        storeFree(store, call->data);
+
+        call->data = NULL;
+        call->size = 0;
+    }
+
+    call->getCallback(call->context, call->result, call->data, call->size, 
+                      call->rev);
+
+    storeFree(store, call);
+}
+
+static void asyncGetRead(LogStoreAsyncWork *work, size_t bytesRead)
+{
+    AsyncCall *call  = (AsyncCall *)work;
+    IndexEntry entry = call->entry;
+
+    size_t prefixSize  = indexEntryGetPrefixSize(entry);
+    size_t payloadSize = indexEntryGetPayloadSize(entry);
+    int    result      = kLogStoreOK;
+
+    // A direct store's record is copied out of the blocks read.
+
+    if (NULL != call->blocks)
+    {
+        size_t skip = indexEntryGetOffset(entry) % kDirectBlockSize;
+
+        bytesRead = bytesRead > skip ? bytesRead - skip : 0;
+
+        if (bytesRead >= prefixSize + payloadSize)
+        {
+            memcpy(call->prefix, call->blocks + skip, prefixSize);
+            memcpy(call->payload, call->blocks + skip + prefixSize, 
+                   payloadSize);
+        }
+
+        storeFree(call->store, call->blocksMemory);
+    }
+
+    if (bytesRead < prefixSize + payloadSize)
+    {
+        result = kLogStoreInputOutputError;
+    }
+
+    call->result = logFileReadDone(call->store, call->store->cache, call->id, 
+                                   entry, call->prefix, call->payload, 
+                                   call->data, result);
+
+    asyncGetFinish(work, bytesRead);
+}
+
+// Get a value on one of the engine's threads, in an epoch of its own, as
+// LogStoreGet does.
+
+static void asyncGetRun(LogStoreAsyncWork *work, size_t bytesRead)
+{
+    AsyncCall *call = (AsyncCall *)work;
+
+    if (kLogStoreOK == call->result)
+    {
+        call->result = LogStoreGet(call->store, call->id, &call->data, 
+                                   &call->size, &call->rev);
+    }
+
+    asyncGetFinish(work, bytesRead);
+}
+
+int LogStoreGetAsync(LogStore            store,
+                     LogStoreID          id,
+                     LogStoreGetCallback callback,
+                     void               *context)
+{
+    if (NULL == store || NULL == callback)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    store = storeShard(store, &id);
+
+    if (NULL == store->async)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    AsyncCall *call = asyncCallMake(store, context);
+
+    if (NULL == call)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    call->id          = id;
+    call->getCallback = callback;
+    call->work.done   = asyncGetRun;
+
+    unsigned epoch = epochEnter(store);
+
+    call->result = indexFileLoad(store, id, &call->entry, &call->logFileNo);
+
+    // Only a record in the log file is read through the engine, unless its
+    // value is cached.  The rest (values removed, kept in the index or still
+    // in the append buffer) is got on one of the engine's threads as
+    // LogStoreGet would.  So is a record of a log swapped out meanwhile.
+
+    IndexEntry entry       = call->entry;
+    off_t      offset      = indexEntryGetOffset(entry);
+    size_t     prefixSize  = indexEntryGetPrefixSize(entry);
+    size_t     payloadSize = indexEntryGetPayloadSize(entry);
+    int        compressed  = 0 != (indexEntryGetFlags(entry) & 
+                                   kLogFileEntryCompressed);
+
+    if (kLogStoreOK != call->result || 
+        !indexEntryHasValue(entry) ||
+        (entry.location & kIndexEntryInline) ||
+        offset + prefixSize + payloadSize > 
+        __atomic_load_n(&store->logFileSize, __ATOMIC_ACQUIRE) ||
+        NULL == (call->logFileHandle = logFileHandleAcquire(store, 
+                                                            call->logFileNo)))
+    {
+        epochExit(store, epoch);
+
+        logStoreAsyncSubmit(store->async, &call->work);
+
+        return kLogStoreOK;
+    }
+
+    epochExit(store, epoch);
+
+    call->rev       = indexEntryGetRevision(entry);
+    call->work.done = asyncGetFinish;
+
+    if (NULL != store->cache &&
+        kLogStoreNotFound != (call->result = 
+                              logStoreCacheGet(store->cache, id, call->rev, 
+                                               &call->data, 0, &call->size)))
+    {
+        logStoreAsyncSubmit(store->async, &call->work);
+
+        return kLogStoreOK;
+    }
+
+    // A direct store's record is read in the whole blocks it lies in.
+
+    off_t  start  = offset / kDirectBlockSize * kDirectBlockSize;
+    size_t length = directBlocksFor(offset - start + prefixSize + payloadSize);
+
+    call->size    = entry.size;
+    call->data    = storeAllocate(store, entry.size);
+    call->payload = compressed ? storeAllocate(store, payloadSize) : 
+                                 call->data;
+    call->blocks  = NULL == store->appendBufferBlock ? NULL : 
+                    storeAllocateBlocks(store, length, &call->blocksMemory);
+    call->result  = kLogStoreOK;
+
+    if (NULL == call->data || NULL == call->payload ||
+        (NULL != store->appendBufferBlock && NULL == call->blocks))
+    {
+        if (compressed)
+        {
+            storeFree(store, call->payload);
+        }
+
+        storeFree(store, call->blocksMemory);
+
+        call->result = kLogStoreOutOfMemory;
+
+        logStoreAsyncSubmit(store->async, &call->work);
+
+        return kLogStoreOK;
+    }
+
+    call->iov[0].iov_base = call->prefix;
+    call->iov[0].iov_len  = prefixSize;
+    call->iov[1].iov_base = call->payload;
+    call->iov[1].iov_len  = payloadSize;
+
+    call->work.done     = asyncGetRead;
+    call->work.fileNo   = call->logFileNo;
+    call->work.iov      = call->iov;
+    call->work.iovCount = 2;
+    call->work.offset   = offset;
+
+    if (NULL != call->blocks)
+    {
+        call->iov[0].iov_base = call->blocks;
+        call->iov[0].iov_len  = length;
+        call->work.iovCount   = 1;
+        call->work.offset     = start;
+    }
+
+    logStoreAsyncSubmit(store->async, &call->work);
+
+    return kLogStoreOK;
+}
+
+static void asyncPutRun(LogStoreAsyncWork *work, size_t bytesRead)
+{
+    AsyncCall *call = (AsyncCall *)work;
+
+    int result = LogStorePut(call->store, call->id, call->data, call->size, 
+                             call->rev);
+
+    call->doneCallback(call->context, result);
+
+    storeFree(call->store, call);
+}
+
+int LogStorePutAsync(LogStore             store,
+                     LogStoreID           id,
+                     void                *data,
+                     size_t               size,
+                     LogStoreRevision     rev,
+                     LogStoreDoneCallback callback,
+                     void                *context)
+{
+    if (NULL == store || NULL == callback || NULL == store->async)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    AsyncCall *call = asyncCallMake(store, context);
+
+    if (NULL == call)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    call->id           = id;
+    call->data         = data;
+    call->size         = size;
+    call->rev          = rev;
+    call->doneCallback = callback;
+    call->work.done    = asyncPutRun;
+
+    logStoreAsyncSubmit(store->async, &call->work);
+
+    return kLogStoreOK;
+}
+
+static void asyncSyncRun(LogStoreAsyncWork *work, size_t bytesRead)
+{
+    AsyncCall *call = (AsyncCall *)work;
+
+    int result = LogStoreSync(call->store);
+
+    call->doneCallback(call->context, result);
+
+    storeFree(call->store, call);
+}
+
+int LogStoreSyncAsync(LogStore             store, 
+                      LogStoreDoneCallback callback,
+                      void                *context)
+{
+    if (NULL == store || NULL == callback || NULL == store->async)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    AsyncCall *call = asyncCallMake(store, context);
+
+    if (NULL == call)
+    {
+        return kLogStoreOutOfMemory;
+    }
+
+    call->doneCallback = callback;
+    call->work.done    = asyncSyncRun;
+
+    logStoreAsyncSubmit(store->async, &call->work);
+
+    return kLogStoreOK;
+}
+
+int LogStoreRemove(LogStore store, LogStoreID id)
+{
+    if (!store)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    store = storeShard(store, &id);
+
+    LogStoreLock;
+
+    if (id >= store->indexFileCapacity)
+    {
+        LogStoreUnlock;
+
+        return kLogStoreInvalidParameter;
+    }
+
+    // Append a "delete record" to the log file, so that the removal survives
+    // a rebuild of the index.
+
+    LogFileEntryPrefix prefix;
+
+    size_t size = logFileEntryDescribe(prefix, id, 0, 0) * sizeof(uint32_t);
+
+    struct iovec iov = { prefix, size };
+
+    if (logFileAppend(store, &iov, 1) < size)
+    {
+        LogStoreUnlock;
+
+        return kLogStoreInputOutputError;
+    }
+
+    store->writeSequence++;
+
+    // Clear the index file entry for the ID.
+    // Note: we do _not_ free up the ID for reuse.
+
+    int result = indexFileWrite(store, id, indexEntryRemoved());
+
+    LogStoreUnlock;
+
+    return result;
+}
+
+int LogStoreSync(LogStore store)
+{
+    if (!store)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    return LogStoreSyncWith(store, store->durability);
+}
+
+int LogStoreSyncWith(LogStore store, int durability)
+{
+    if (!store || 
+        durability < kLogStoreDurabilityFull || 
+        durability > kLogStoreDurabilityNone)
+    {
+        return kLogStoreInvalidParameter;
+    }
+
+    if (NULL != store->shards)
+    {
+        int result = kLogStoreOK;
+
+        for (int i = 0; i < store->shardCount; ++i)
+        {
+            int shardResult = LogStoreSyncWith(store->shards[i], durability);
+
+            if (kLogStoreOK == result)
+            {
+                result = shardResult;
+            }
+        }
+
+        return result;
+    }
+
+    LogStoreLock;
+
+    // Short of data durability, nothing is waited for, so there is no flush
+    // to share and no checkpoint to move.
+
+    if (durability >= kLogStoreDurabilityOrdered)
+    {
+        int result = appendBufferFlush(store);
+
+        if (kLogStoreOK == result && kLogStoreDurabilityOrdered == durability)
+        {
+            result = storeStartWriteBack(store);
+        }
+
+        LogStoreUnlock;
+
+        return result;
+    }
+
+    // Group commit: the first syncer flushes everything written so far
+    // without holding the lock; syncers arriving meanwhile wait for that
+    // flush if it covers their writes at their level, or else lead the next
+    // one.
+
+    uint64_t  target = store->writeSequence;
+    uint64_t *synced = kLogStoreDurabilityFull == durability ? 
+                       &store->syncedFullSequence : &store->syncedSequence;
+
+    int result = kLogStoreOK;
+
+    while (*synced < target)
+    {
+        if (store->syncInProgress)
+        {
+            pthread_cond_wait(&store->syncCond, &store->mutex);
+
+            continue;
+        }
+
+        // What is still buffered is written before the flush.
+
+        if (kLogStoreOK != (result = appendBufferFlush(store)))
+        {
+            break;
+        }
+
+        store->syncInProgress = 1;
+
+        uint64_t flushing    = store->writeSequence;
+        off_t    checkpoint  = store->logFileSize;
+        int      logFileNo   = store->logFileNo;
+        void    *mapping     = store->indexFileMapping;
+        size_t   mappingSize = store->indexFileMappingSize;
+        size_t   dirtyFrom   = store->indexFileDirtyFrom;
+        size_t   dirtyTo     = store->indexFileDirtyTo;
+        int      headerDirty = store->indexFileHeaderDirty;
+
+        store->indexFileDirtyTo     = 0;
+        store->indexFileHeaderDirty = 0;
+
+        LogStoreUnlock;
+
+        result = kLogStoreOK;
+
+        if (-1 == (kLogStoreDurabilityFull == durability ? fsync(logFileNo) : 
+                                                         fdatasync(logFileNo)))
+        {
+            result = kLogStoreInputOutputError;
+        }
+
+        if (kLogStoreOK != indexFileSyncRange(store, mapping, mappingSize, 
+                                              dirtyFrom, dirtyTo, headerDirty,
+                                              durability))
+        {
+            result = kLogStoreInputOutputError;
+        }
+
+        LogStoreLock;
+
+        store->syncInProgress = 0;
+
+        // What was not written back is left for the next sync.
+
+        if (kLogStoreOK != result)
+        {
+            if (dirtyTo > 0)
+            {
+                indexFileDirty(store, dirtyFrom, dirtyTo - dirtyFrom);
+            }
+
+            store->indexFileHeaderDirty |= headerDirty;
+        }
+
+        // Everything in the log as of the flush is indexed and on disk.  The
+        // header gets to disk with some later flush; until then, the older
+        // checkpoint stands.
+
+        if (kLogStoreOK == result)
+        {
+            store->syncedSequence      = flushing;
+            store->indexFileCheckpoint = checkpoint;
+
+            if (kLogStoreDurabilityFull == durability)
+            {
+                store->syncedFullSequence = flushing;
+            }
+
+            result = indexFileHeaderWrite(store, kIndexFileDirty);
+        }
+
+        pthread_cond_broadcast(&store->syncCond);
+
+        if (kLogStoreOK != result)
+        {
+            break;
+        }
+    }
+
+    LogStoreUnlock;
+
+    return result;
+}
+
+// Compaction copies the live records of the log into <path>-compact and then
+// renames that over the log.  The location of every record copied is noted so
+// that the index can be pointed at the copies once the new log is swapped in.
+
+#define kCompactBufferSize     (1024 * 1024)
+#define kCompactRecordsPerLock 1024
+
+typedef struct Relocation
+{
+    LogStoreID id;
+    off_t      oldOffset;
+    off_t      newOffset;
+} Relocation;
+
+typedef struct Compaction
+{
+    LogStore    store;
+
+    int         logFileNo;          // the old log, as logFileScanBegin gives
+    int         newFileNo;
+    off_t       newFileSize;
+    struct LogFileHandle *newFileHandle;
+
+    char       *in;                 // records read from the old log
+    size_t      inCapacity;
+
+    char       *out;                // live records to write to the new log
+    size_t      outCapacity;
+    size_t      outSize;
+
+    size_t      recordsPerLock;
+
+    Relocation *relocations;
+    size_t      relocationCount;
+    size_t      relocationCapacity;
+} Compaction;
+
+// Is the record at the given offset of the log what the index refers to?  A
+// delete record is kept as long as the ID remains deleted.  'count' is the
+// number of IDs made, as read under the lock the caller holds: IDs are made
+// without it (see LogStoreMakeIDs), but none is put before it is made.
+
+static int compactionIsLive(LogStore       store,
+                            IndexFileCount count,
+                            LogStoreID     id,
+                            off_t          offset,
+                            int            isDeleteRecord)
+{
+    IndexEntry e;
+
+    if (id >= count || indexFileRead(store, id, &e))
+    {
+        return 0;
+    }
+
+    if (isDeleteRecord)
+    {
+        return indexEntryIsRemoved(e);
+    }
+
+    return indexEntryHasValue(e) && indexEntryGetOffset(e) == offset;
+}
+
+static int compactionFlush(Compaction *c)
+{
+    int result = writeFully(c->newFileNo, c->out, c->outSize);
+
+    c->outSize = 0;
+
+    return result;
+}
+
+// Append a record to the new log, remembering where it came from.
+
+static int compactionAppend(Compaction *c,
+                            const char *record,
+                            size_t      length,
+                            LogStoreID  id,
+                            off_t       oldOffset)
+{
+    if (c->relocationCount == c->relocationCapacity)
+    {
+        size_t capacity = c->relocationCapacity ? c->relocationCapacity * 2 
+                                                : 1024;
+
+        Relocation *relocations = 
+            storeReallocate(c->store, c->relocations,
+                            c->relocationCapacity * sizeof(Relocation),
+                            capacity * sizeof(Relocation));
+
+        if (NULL == relocations)
+        {
+            return kLogStoreOutOfMemory;
+        }
+
+        c->relocations        = relocations;
+        c->relocationCapacity = capacity;
+    }
+
+    Relocation *r = &c->relocations[c->relocationCount++];
+
+    r->id        = id;
+    r->oldOffset = oldOffset;
+    r->newOffset = c->newFileSize;
+
+    c->newFileSize += length;
+
+    if (c->outSize + length > c->outCapacity)
+    {
+        int result = compactionFlush(c);
+
+        if (kLogStoreOK != result)
+        {
+            return result;
+        }
+
+        if (length > c->outCapacity)
+        {
+            return writeFully(c->newFileNo, record, length);
         }
     }
 
+    memcpy(c->out + c->outSize, record, length);
+    c->outSize += length;
+
     return kLogStoreOK;
 }
 
-int LogStorePut(LogStore          store,
-                LogStoreID        id,
-                void             *data,
-                size_t            size,
-                LogStoreRevision  rev)
+// Copy the live records in [from, to) of the log to the new log.  Unless the
+// caller already holds the lock, the lock is only held while checking a batch
+// of records against the index.
+
+static int compactionCopy(Compaction *c, off_t from, off_t to, int haveLock)
 {
-    if (NULL == store || NULL == data || 0 == size)
+    LogStore store = c->store;
+
+    off_t pos = from;
+
+    while (pos < to)
     {
-        return kLogStoreInvalidParameter;
-    }
+        size_t want = c->inCapacity;
 
-    LogStoreLock;
+        if (to - pos < want)
+        {
+            want = to - pos;
+        }
 
-    // Get index file entry for id.
+        int result = readFully(c->logFileNo, c->in, want, pos);
 
-    IndexEntry e = 0;
+        if (kLogStoreOK != result)
+        {
+            return result;
+        }
 
-    if (indexFileRead(store, id, &e))
-    {
-        LogStoreUnlock;
+        size_t used    = 0;
+        size_t checked = 0;
 
-        return kLogStoreInputOutputError;
-    }
+        if (!haveLock)
+        {
+            LogStoreLock;
+        }
 
-    // Check for a version conflict.
+        IndexFileCount count = __atomic_load_n(&store->indexFileCount, 
+                                               __ATOMIC_ACQUIRE);
 
-    if (indexEntryGetRevision(e) != rev)
-    {
-        LogStoreUnlock;
+        while (kLogStoreOK == result && used < want)
+        {
+            LogFileEntryPrefix prefix;
+
+            uint64_t length = logFileEntryParse(c->in + used, want - used, 
+                                                prefix);
+
+            if (0 == length || length > want - used)
+            {
+                break;
+            }
+
+            LogStoreID  id     = logFileEntryID(prefix);
+            const char *record = c->in + used;
+            size_t      copied = length;
+            uint32_t    wide[6];
+
+            // A removal of ID 0 from before it was written wide is all 
+            // zeroes.  The new log is replayed from its start until the next
+            // sync, where zeroes are a hole, so it is copied wide.
+
+            if (0 == prefix[0] && 0 == prefix[1])
+            {
+                record = (const char *)wide;
+                copied = logFileEntryDescribe(wide, 0, 0, 0) * 
+                         sizeof(uint32_t);
+            }
+
+            if (compactionIsLive(store, count, id, pos + used, 
+                                 0 == logFileEntryPayloadSize(prefix)))
+            {
+                result = compactionAppend(c, record, copied, id, pos + used);
+            }
+
+            used += length;
+
+            if (!haveLock && 0 == ++checked % c->recordsPerLock)
+            {
+                LogStoreUnlock;
+                LogStoreLock;
+
+                count = __atomic_load_n(&store->indexFileCount, 
+                                        __ATOMIC_ACQUIRE);
+            }
+        }
 
-        return kLogStoreRevisionConflict;
+        if (!haveLock)
+        {
+            LogStoreUnlock;
+        }
+
+        if (kLogStoreOK != result)
+        {
+            return result;
+        }
+
+        if (0 == used)
+        {
+            // The next record does not fit in the buffer.  Either the log is
+            // truncated or the record is larger than the buffer.
+
+            LogFileEntryPrefix prefix;
+
+            uint64_t length = logFileEntryParse(c->in, want, prefix);
+
+            if (0 == length || length > to - pos)
+            {
+                return kLogStoreTampered;
+            }
+
+            char *in = storeReallocate(store, c->in, c->inCapacity, length);
+
+            if (NULL == in)
+            {
+                return kLogStoreOutOfMemory;
+            }
+
+            c->in         = in;
+            c->inCapacity = length;
+        }
+
+        pos += used;
     }
 
-    // Append record descriptor and record to log file.
+    return kLogStoreOK;
+}
 
-    LogFileEntryHeader header = { id, size };
+// Swap the new log in place of the old.  The caller holds the lock.
 
-    struct iovec iov[2] =
-    {
-        { header, sizeof(header) },
-        { data, size }
-    };
+static int compactionSwap(Compaction *c, const char *newPath)
+{
+    LogStore store = c->store;
 
-    int bytesWritten = 0;
+    // Offsets into the old log mean nothing in the new one, so the checkpoint
+    // is dropped (until the next sync) before the new log takes its place.
+    // A flush in progress would otherwise set it for the old log.
 
-    do
+    syncWait(store);
+
+    store->indexFileCheckpoint = 0;
+
+    int result = indexFileHeaderWrite(store, kIndexFileDirty);
+
+    if (kLogStoreOK == result)
     {
-        bytesWritten = writev(store->logFileNo, iov, 2);
+        result = indexFileFlush(store, kIndexFileHeaderSize);
     }
-    while (bytesWritten == -1 && errno == EINTR);
 
-    if (bytesWritten < sizeof(header) + size)
+    if (kLogStoreOK != result)
     {
-        LogStoreUnlock;
+        return result;
+    }
 
+    if (-1 == fsync(c->newFileNo) || -1 == rename(newPath, store->logFilePath))
+    {
         return kLogStoreInputOutputError;
     }
 
-    // Update index file entry.  The new offset is the size of the log prior to
-    // the record descriptor being written.  The new revision is 1 greater than
-    // the current revision.
+    // Point the index at the copies of records that are still current.  Gets
+    // are held off meanwhile so they never pair an entry with the wrong log.
 
-    int result = indexFileWrite(store, id, store->logFileSize, rev + 1);
+    struct LogFileHandle *oldFileHandle = store->logFileHandle;
 
-    if (kLogStoreOK != result)
+    indexSeqWriteBeginAll(store);
+
+    for (size_t i = 0; i < c->relocationCount; ++i)
     {
-        LogStoreUnlock;
+        Relocation *r = &c->relocations[i];
 
-        return result;
+        IndexEntry e;
+
+        if (indexFileRead(store, r->id, &e) || 
+            !indexEntryHasValue(e) || 
+            indexEntryGetOffset(e) != r->oldOffset)
+        {
+            continue;
+        }
+
+        e.location = (e.location & ~kIndexEntryOffsetMask) | r->newOffset;
+
+        int storeResult = indexFileStore(store, r->id, e);
+
+        if (kLogStoreOK == result)
+        {
+            result = storeResult;
+        }
     }
 
-    store->logFileSize += sizeof(header) + size;
+    // Gets reading beyond the end of the old log see either log whole.
 
-    LogStoreUnlock;
+    pthread_mutex_lock(&store->appendMutex);
 
-    return kLogStoreOK;
+    __atomic_store_n(&store->logFileNo, c->newFileNo, __ATOMIC_RELAXED);
+    __atomic_store_n(&store->logFileHandle, c->newFileHandle, 
+                     __ATOMIC_RELEASE);
+
+    indexSeqWriteEndAll(store);
+
+    __atomic_store_n(&store->logFileSize, c->newFileSize, __ATOMIC_RELEASE);
+
+    store->logFileAllocated = c->newFileSize;
+
+    c->newFileNo     = -1;
+    c->newFileHandle = NULL;
+
+    // A direct store appends to the new log as it did to the old.
+
+    if (NULL != store->appendBufferBlock && kLogStoreOK == result)
+    {
+        result = logFileDirectBegin(store);
+    }
+
+    pthread_mutex_unlock(&store->appendMutex);
+
+    // The new log is mapped on demand.  Views keep the old mapping alive.
+
+    struct LogFileMapping *oldMapping = store->logFileMapping;
+
+    __atomic_store_n(&store->logFileMapping, NULL, __ATOMIC_RELEASE);
+
+    // Gets that loaded an entry before the swap may still read the old log,
+    // and asynchronous gets may have reads of it in flight.
+
+    epochSynchronize(store);
+
+    logFileHandleRelease(store, oldFileHandle);
+
+    logFileMappingRelease(store, oldMapping);
+
+    return result;
 }
 
-int LogStoreGet(LogStore          store,
-                LogStoreID        id,
-                void            **outData,
-                size_t           *outSize,
-                LogStoreRevision *outRev)
+int LogStoreCompact(LogStore                      store,
+                    const LogStoreCompactOptions *options,
+                    uint64_t                     *outBytesReclaimed)
 {
-    if (NULL == store || NULL == outData || NULL != *outData)
+    if (NULL == store)
     {
         return kLogStoreInvalidParameter;
     }
 
-    LogStoreLock;
+    if (NULL != store->shards)
+    {
+        uint64_t reclaimed = 0;
 
-    // Get index entry for this id.
+        for (int i = 0; i < store->shardCount; ++i)
+        {
+            uint64_t shardReclaimed = 0;
 
-    IndexEntry entry;
+            int result = LogStoreCompact(store->shards[i], options, 
+                                         &shardReclaimed);
 
-    int result = indexFileRead(store, id, &entry);
+            reclaimed += shardReclaimed;
 
-    if (kLogStoreOK != result)
-    {
-        LogStoreUnlock;
+            if (kLogStoreOK != result)
+            {
+                return result;
+            }
+        }
 
-        return result;
+        if (NULL != outBytesReclaimed)
+        {
+            *outBytesReclaimed = reclaimed;
+        }
+
+        return kLogStoreOK;
     }
 
-    // Deleted?
+    Compaction c;
+
+    memset(&c, 0, sizeof(c));
+
+    c.store          = store;
+    c.logFileNo      = -1;
+    c.newFileNo      = -1;
+    c.inCapacity     = kCompactBufferSize;
+    c.recordsPerLock = kCompactRecordsPerLock;
 
-    if ((IndexEntry) -1 == entry)
+    if (NULL != options && options->bufferSize > 0)
     {
-        LogStoreUnlock;
+        c.inCapacity = options->bufferSize;
+    }
 
-        return kLogStoreNotFound;
+    if (NULL != options && options->recordsPerLock > 0)
+    {
+        c.recordsPerLock = options->recordsPerLock;
     }
 
-    off_t            entryOffset   = indexEntryGetOffset(entry);
-    LogStoreRevision entryRevision = indexEntryGetRevision(entry);
+    c.outCapacity = c.inCapacity;
 
-    // Read the record descriptor from the log.
+    pthread_mutex_lock(&store->compactMutex);
 
-    LogFileEntryHeader header = { 0, 0 };
+    // Snapshots refer to records that compaction would move or drop.
 
-    int bytesRead = 0;
+    LogStoreLock;
 
-    do
+    int result = NULL == store->snapshots ? kLogStoreOK : kLogStoreBusy;
+
+    LogStoreUnlock;
+
+    char *cpath = storeAllocate(store, strlen(store->logFilePath) + 
+                                       strlen("-compact") + 1);
+
+    c.in  = storeAllocate(store, c.inCapacity);
+    c.out = storeAllocate(store, c.outCapacity);
+
+    if (NULL == cpath || NULL == c.in || NULL == c.out)
     {
-        bytesRead = pread(store->logFileNo, header, sizeof(header), entryOffset);
+        result = kLogStoreOutOfMemory;
     }
-    while (bytesRead == -1 && errno == EINTR);
-
-    if (bytesRead < sizeof(header))
+    else if (kLogStoreOK == result)
     {
-        LogStoreUnlock;
+        sprintf(cpath, "%s-compact", store->logFilePath);
 
-        return kLogStoreInputOutputError;
+        int flags = O_CREAT | O_TRUNC | O_RDWR | kOtherOpenFlags;
+
+        if (-1 == (c.logFileNo = logFileScanBegin(store)) ||
+            -1 == (c.newFileNo = open(cpath, flags, 0777)))
+        {
+            result = kLogStoreInputOutputError;
+        }
+        else if (NULL == (c.newFileHandle = logFileHandleMake(store, 
+                                                              c.newFileNo)))
+        {
+            result = kLogStoreOutOfMemory;
+        }
     }
 
-    // Sanity check that the ID in the file is the ID expected.
+    // Copy what is in the log now, letting others use the store meanwhile.
+
+    off_t oldSize = 0;
 
-    if (header[0] != id || header[1] == 0)
+    if (kLogStoreOK == result)
     {
+        LogStoreLock;
+        oldSize = store->logFileSize;
         LogStoreUnlock;
 
-        return kLogStoreTampered;
+        result = compactionCopy(&c, 0, oldSize, 0);
     }
 
-    // Read the log record into user data.
-
-    *outData = malloc(header[1]);
+    // Copy whatever was appended in the meantime and swap in the new log.
 
-    if (NULL == *outData)
+    if (kLogStoreOK == result)
     {
-        LogStoreUnlock;
+        LogStoreLock;
 
-        return kLogStoreOutOfMemory;
-    }
+        off_t end = oldSize;
 
-    off_t entryDataOffset = entryOffset + sizeof(header);
+        // Buffered appends are copied along with the rest.
 
-    bytesRead = 0;
+        if (NULL != store->snapshots)
+        {
+            result = kLogStoreBusy;
+        }
+        else
+        {
+            result = appendBufferFlush(store);
+        }
 
-    do
-    {
-        bytesRead = pread(store->logFileNo, *outData,
-                          header[1], entryDataOffset);
-    }
-    while (bytesRead == -1 && errno == EINTR);
+        oldSize = store->logFileSize;
 
-    if (bytesRead < header[1])
-    {
-        free(*outData);
+        if (kLogStoreOK == result)
+        {
+            result = compactionCopy(&c, end, oldSize, 1);
+        }
 
-        LogStoreUnlock;
+        if (kLogStoreOK == result)
+        {
+            result = compactionFlush(&c);
+        }
 
-        return kLogStoreInputOutputError;
-    }
+        if (kLogStoreOK == result)
+        {
+            syncWait(store);
 
-    if (outSize)
-    {
-        *outSize = header[1];
+            result = compactionSwap(&c, cpath);
+
+            store->writeSequence++;
+        }
+
+        if (NULL != outBytesReclaimed && -1 == c.newFileNo)
+        {
+            *outBytesReclaimed = oldSize - store->logFileSize;
+        }
+
+        LogStoreUnlock;
     }
 
-    if (outRev)
+    if (-1 != c.newFileNo)
     {
-        *outRev = entryRevision;
+        close(c.newFileNo);
+        unlink(cpath);
     }
 
-    LogStoreUnlock;
+    storeFree(store, c.newFileHandle);
 
-    return kLogStoreOK;
+    logFileScanEnd(store, c.logFileNo);
+
+    storeFree(store, cpath);
+    storeFree(store, c.in);
+    storeFree(store, c.out);
+    storeFree(store, c.relocations);
+
+    pthread_mutex_unlock(&store->compactMutex);
+
+    return result;
 }
 
-int LogStoreRemove(LogStore store, LogStoreID id)
+int LogStoreClose(LogStore *sp)
 {
-    if (!store)
+    if (NULL == sp || NULL == *sp)
     {
         return kLogStoreInvalidParameter;
     }
 
-    LogStoreLock;
+    LogStore store = *sp;
 
-    // Clear the index file entry for the ID.
-    // Note: we do _not_ free up the ID for reuse.
+    // Asynchronous calls still in progress are finished first.
 
-    int result = indexFileWrite(store, id, (off_t) -1, (LogStoreRevision) -1);
+    logStoreAsyncDestroy(store->async);
 
-    if (kLogStoreOK != result)
+    if (NULL != store->shards)
     {
-        LogStoreUnlock;
+        int result = kLogStoreOK;
 
-        return result;
-    }
+        for (int i = 0; i < store->shardCount; ++i)
+        {
+            store->shards[i]->async = NULL;
 
-    // Append a "delete record" to the log file.
+            int shardResult = LogStoreClose(&store->shards[i]);
 
-    LogFileEntryHeader header = { id, 0 };
+            if (kLogStoreOK == result)
+            {
+                result = shardResult;
+            }
+        }
 
-    int bytesWritten = 0;
+        storeFree(store, store->shards);
+        storeFree(store, store);
 
-    do
-    {
-        bytesWritten = write(store->logFileNo, header, sizeof(header));
+        *sp = NULL;
+
+        return result;
     }
-    while (bytesWritten == -1 && errno == EINTR);
 
-    if (bytesWritten < sizeof(header))
-    {
-        LogStoreUnlock;
+    LogStoreLock;
 
-        return kLogStoreInputOutputError;
-    }
+    store->growStop = 1;
 
-    LogStoreUnlock;
+    pthread_cond_signal(&store->growCond);
 
-    return kLogStoreOK;
-}
+    LogStoreUnlock;
 
-int LogStoreSync(LogStore store)
-{
-    if (!store)
-    {
-        return kLogStoreInvalidParameter;
-    }
+    pthread_join(store->growThread, NULL);
 
     LogStoreLock;
 
-    fsync(store->logFileNo);
+    syncWait(store);
 
-    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
+    // Once the log and the index are on disk, the index is clean.  It counts
+    // only the IDs made, not those reserved.  If buffered appends cannot be
+    // written, the index names records the log lacks, so it is left dirty.
+
+    store->indexFileReserved = store->indexFileCount;
+
+    int result = appendBufferFlush(store);
+
+    // A log padded or preallocated past its records is cut back to them.
+
+    if (kLogStoreOK == result && 
+        store->logFileAllocated > store->logFileSize &&
+        -1 == ftruncate(store->logFileNo, store->logFileSize))
     {
-        msync(store->indexFileMapping, store->indexFileMappingSize, MS_SYNC);
+        result = kLogStoreInputOutputError;
     }
-    else
+
+    if (kLogStoreOK == result)
     {
-        fsync(store->indexFileNo);
+        result = indexFileCheckpoint(store, kIndexFileClean);
     }
 
+    indexFileUnmap(store);
+
+    logFileMappingRelease(store, store->logFileMapping);
+    logFileHandleRelease(store, store->logFileHandle);
+
+    close(store->indexFileNo);
+
     LogStoreUnlock;
 
-    return kLogStoreOK;
+    pthread_mutex_destroy(&store->mutex);
+    pthread_mutex_destroy(&store->compactMutex);
+    pthread_mutex_destroy(&store->appendMutex);
+    pthread_cond_destroy(&store->syncCond);
+    pthread_cond_destroy(&store->growCond);
+
+    logStoreCacheDestroy(store->cache);
+
+    storeFree(store, store->appendBufferMemory);
+    storeFree(store, store->logFilePath);
+    storeFree(store, store);
+
+    *sp = NULL;
+
+    return result;
 }
 
-int LogStoreClose(LogStore *sp)
+int LogStoreGetCacheStats(LogStore store, LogStoreCacheStats *outStats)
 {
-    if (NULL == sp || NULL == *sp)
+    if (NULL == store || NULL == outStats)
     {
         return kLogStoreInvalidParameter;
     }
 
-    LogStore store = *sp;
+    if (NULL != store->shards)
+    {
+        memset(outStats, 0, sizeof(LogStoreCacheStats));
 
-    LogStoreLock;
+        for (int i = 0; i < store->shardCount; ++i)
+        {
+            LogStoreCacheStats stats;
 
-    if (NULL != store->indexFileMapping && store->indexFileMappingSize > 0)
-    {
-        munmap(store->indexFileMapping, store->indexFileMappingSize);
-    }
+            LogStoreGetCacheStats(store->shards[i], &stats);
 
-    close(store->logFileNo);
-    close(store->indexFileNo);
+            outStats->hits      += stats.hits;
+            outStats->misses    += stats.misses;
+            outStats->evictions += stats.evictions;
+            outStats->size      += stats.size;
+        }
 
-    LogStoreUnlock;
+        return kLogStoreOK;
+    }
 
-    pthread_mutex_destroy(&store->mutex);
+    if (NULL == store->cache)
+    {
+        memset(outStats, 0, sizeof(LogStoreCacheStats));
+    }
+    else
+    {
+        logStoreCacheGetStats(store->cache, outStats);
+    }
 
     return kLogStoreOK;
 }
@@ -692,6 +6734,8 @@ char *LogStoreDescribe(int code)
         case kLogStoreNotFound:         return "no such entity";
         case kLogStoreTampered:         return "data was tampered with";
         case kLogStoreRevisionConflict: return "revision conflict";
+        case kLogStoreBufferTooSmall:   return "buffer too small";
+        case kLogStoreBusy:             return "busy";
     }
 
     return NULL;
@@ -1,6 +1,9 @@
 #ifndef LOGSTORE_H
 #define LOGSTORE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" 
 {
@@ -9,6 +12,9 @@ extern "C"
 struct LogStore;
 typedef struct LogStore *LogStore;
 
+struct LogStoreSnapshot;
+typedef struct LogStoreSnapshot *LogStoreSnapshot;
+
 enum 
 {
     kLogStoreOK,        
@@ -17,11 +23,104 @@ enum
     kLogStoreInvalidParameter,
     kLogStoreNotFound,
     kLogStoreRevisionConflict,
-    kLogStoreTampered
+    kLogStoreTampered,
+    kLogStoreBufferTooSmall,
+    kLogStoreBusy
+};
+
+typedef uint64_t LogStoreID;
+typedef uint32_t LogStoreRevision;
+
+enum
+{
+    kLogStoreOptionMapLog      = 1 << 0,    // map the log for LogStoreGetView
+    kLogStoreOptionCompress    = 1 << 1,    // compress values that are put
+    kLogStoreOptionNoChecksums = 1 << 2,    // append records without checksums
+    kLogStoreOptionNoRing      = 1 << 3,    // no io_uring for async reads
+    kLogStoreOptionDirect      = 1 << 4     // O_DIRECT log; see LogStoreOptions
+};
+
+/**
+ * Records appended to the log carry a CRC32C of their payload (unless the
+ * store was opened with kLogStoreOptionNoChecksums).  These say how often gets
+ * check it against what they read; a mismatch is kLogStoreTampered.
+ */
+
+enum
+{
+    kLogStoreVerifyAlways,          // check every record read
+    kLogStoreVerifySampled,         // check about one record read in 16
+    kLogStoreVerifyNever
+};
+
+/**
+ * How much LogStoreSync does.  A store syncs at the level it was opened with
+ * (LogStoreOptions.durability); LogStoreSyncWith picks one per call.
+ */
+
+enum
+{
+    kLogStoreDurabilityFull,        // fsync the log; write back the index
+    kLogStoreDurabilityData,        // fdatasync the log; write back the index
+    kLogStoreDurabilityOrdered,     // start writing back the log, then the
+                                    // index, without waiting (sync_file_range)
+    kLogStoreDurabilityNone         // only write out the append buffer
 };
 
-typedef uint32_t LogStoreID;
-typedef uint16_t LogStoreRevision;
+/**
+ * Allocates and frees whatever a store allocates, including the values
+ * returned by LogStoreGet and LogStoreGetMany.  'context' is passed to both.
+ */
+
+typedef struct LogStoreAllocator
+{
+    void *(*allocate)(void *context, size_t size);
+    void  (*deallocate)(void *context, void *pointer);
+    void   *context;
+} LogStoreAllocator;
+
+/**
+ * Options for LogStoreOpenWithOptions.  Zero-initialize and set only what
+ * you need; zero values select the defaults.
+ *
+ * With an append buffer, puts and removes append to memory, and the buffer
+ * is written to the log with one write when it fills, when 'flushInterval'
+ * has passed since it was first appended to (if not 0), and on LogStoreSync
+ * and LogStoreClose.  Gets serve buffered values from memory.  Buffered
+ * appends are lost if the process dies, not only if the system does.
+ *
+ * With kLogStoreOptionDirect, puts and gets bypass the page cache: the log is
+ * written and read with O_DIRECT, a block at a time.  Appends are staged in
+ * the append buffer (1 MiB unless 'appendBufferSize' is set), whose blocks
+ * are written whole, and a get reads the blocks its record lies in.  This
+ * keeps memory use down when the application caches values itself.  Opening,
+ * iterating and compacting still read the log through the page cache.  The
+ * log's file system must support O_DIRECT.
+ *
+ * With 'preallocateSize', the log file is extended with fallocate that many
+ * bytes at a time ahead of the appends, so that appending neither allocates
+ * blocks nor changes the size of the file.  The preallocated bytes read as
+ * zeroes; opening after a crash finds the end of the records by scanning,
+ * and closing cuts the file back to them.  The index file is then allocated
+ * densely as it grows, rather than sparsely.  Without fallocate support in
+ * the file system, both files grow as they would without.
+ */
+
+typedef struct LogStoreOptions
+{
+    int               flags;              // kLogStoreOption... flags
+    LogStoreAllocator allocator;          // malloc and free
+    size_t            cacheSize;          // bytes to cache (0: no cache)
+    int               cacheShards;        // independently locked parts (16)
+    size_t            compressThreshold;  // smaller values stored raw (128)
+    int               verify;             // kLogStoreVerify... (always)
+    size_t            inlineSize;         // values kept in the index (0)
+    size_t            appendBufferSize;   // appends buffered in memory (0)
+    unsigned          flushInterval;      // ms they may stay buffered (0)
+    int               asyncThreads;       // for the ...Async calls (0: none)
+    int               durability;         // kLogStoreDurability... (full)
+    size_t            preallocateSize;    // log bytes allocated ahead (0)
+} LogStoreOptions;
 
 /**
  * Opens a logstore.
@@ -29,7 +128,12 @@ typedef uint16_t LogStoreRevision;
  * @param path The filesystem path to the log file associated 
  * with the logstore.  A sister file ('path'-index) lives in the
  * same directory.  These files are created as needed; use umask
- * for desired permissions.
+ * for desired permissions.  A store that was closed cleanly opens in
+ * constant time.  Otherwise, the log appended since the last LogStoreSync is
+ * replayed into the index; a record torn by a crash at the end of the log is
+ * cut off.  A missing index is rebuilt from the whole log.  An index written
+ * by an earlier version of logstore is upgraded, reading a record prefix for
+ * each value in it.
  * @param outStore [out] The store to create. The store is dynamically
  * allocated.  Be sure to pass a pointer to a 'LogStore' that is
  * initialized to NULL.
@@ -38,12 +142,47 @@ typedef uint16_t LogStoreRevision;
 
 int LogStoreOpen(LogStore *outStore, const char *path);
 
+/**
+ * Opens a logstore with options.
+ *
+ * @param outStore [out] As for LogStoreOpen.
+ * @param path As for LogStoreOpen.
+ * @param options The options.  Optional; NULL is the same as LogStoreOpen.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreOpenWithOptions(LogStore              *outStore, 
+                            const char            *path,
+                            const LogStoreOptions *options);
+
+/**
+ * Opens a store sharded over several logstores, e.g. on different disks, so
+ * that puts to different shards do not contend for one lock or one log.  Each
+ * shard is a log and index as for LogStoreOpen.  The shard of a value is part
+ * of its ID (LogStoreMakeID makes IDs in each shard in turn), so a sharded
+ * store must always be reopened with the same paths in the same order.  The
+ * sharded store is used with the same functions as any other.
+ *
+ * @param outStore [out] As for LogStoreOpen.
+ * @param paths The paths of the logs of the shards, as for LogStoreOpen.
+ * @param shardCount The number of paths.
+ * @param options The options of every shard.  Optional.  The cache size is 
+ * that of the whole store, split evenly over the shards.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreOpenSharded(LogStore              *outStore,
+                        const char *const     *paths,
+                        int                    shardCount,
+                        const LogStoreOptions *options);
+
 /**
  * Closes an open logstore.
  *
  * @param store The store to close. Accepts a pointer to the logstore.
  * The logstore is closed, its memory released, and the pointer is set
- * to NULL.
+ * to NULL.  The log and index are flushed to disk and the index is marked
+ * clean so that the next open need not rebuild it.
  * @return code (e.g. kLogStoreOK).
  */
 
@@ -54,12 +193,43 @@ int LogStoreClose(LogStore *store);
  * has actually been transferred to the disk device and is not sitting in 
  * OS or disk buffers.  Note: *tries*.
  *
+ * Concurrent syncs are group-committed: one flush covers the writes of every
+ * thread waiting on it, and the flush does not block puts or gets.  A sync
+ * also checkpoints the index: should the process die, the next open replays
+ * only what was appended to the log after it.  Only the parts of the index
+ * written since the last sync are written back.
+ *
+ * The store syncs at the durability level it was opened with (full, unless
+ * LogStoreOptions.durability says otherwise).
+ *
  * @param store The store to sync.
  * @return code (e.g. kLogStoreOK).
  */
 
 int LogStoreSync(LogStore store);
 
+/**
+ * Syncs at the given durability level rather than the store's.
+ *
+ * kLogStoreDurabilityFull and kLogStoreDurabilityData sync as LogStoreSync
+ * describes; the latter skips metadata that is not needed to read the log
+ * back, such as its modification time.  A data sync may be covered by a
+ * concurrent flush at either level, a full sync only by a full one.
+ *
+ * kLogStoreDurabilityOrdered starts writing the log and then the index back
+ * to disk and returns without waiting for either.  It promises nothing should
+ * the system crash, but it makes the next full sync cheaper and bounds how
+ * much of the log the system holds in memory.  kLogStoreDurabilityNone only
+ * writes the append buffer to the log, which is enough to survive the process
+ * dying.  Neither checkpoints the index.
+ *
+ * @param store The store to sync.
+ * @param durability kLogStoreDurability...
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreSyncWith(LogStore store, int durability);
+
 /** 
  * Entries in the log have unique IDs.  This creates a unique ID
  * so that a new entry may be subsequently stored.
@@ -71,6 +241,23 @@ int LogStoreSync(LogStore store);
 
 int LogStoreMakeID(LogStore store, LogStoreID *outID);
 
+/**
+ * Makes 'count' IDs at once, e.g. for a bulk load.  The IDs are consecutive: 
+ * firstID, firstID + 1, and so on.  In a sharded store (see 
+ * LogStoreOpenSharded), they are all in one shard and are instead firstID, 
+ * firstID + shardCount, and so on.
+ *
+ * Making IDs does not take the store's lock, except to reserve IDs in blocks
+ * every so often.
+ *
+ * @param store The store.
+ * @param count The number of IDs to make.
+ * @param outFirstID [out] The first ID made.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreMakeIDs(LogStore store, size_t count, LogStoreID *outFirstID);
+
 /**
  * Puts or stores a value to the logstore.
  *
@@ -80,6 +267,17 @@ int LogStoreMakeID(LogStore store, LogStoreID *outID);
  * @param size The size of 'data' in bytes (must be > 0).
  * @param rev The revision of the data.  For new values,
  * use a rev of 0.
+ *
+ * When the store was opened with kLogStoreOptionCompress, values of at least
+ * LogStoreOptions.compressThreshold bytes are compressed before they are
+ * appended to the log, if that makes them smaller.  Gets decompress them.
+ *
+ * Values of up to LogStoreOptions.inlineSize bytes (at most 60) are kept in
+ * their index entries as well as appended to the log, so that gets of them
+ * read neither the log nor the cache.  Index entries have room for 4 bytes of
+ * value; larger inline sizes take larger entries, and opening a store with an
+ * inline size its index entries do not match rebuilds its index.
+ *
  * @return code (e.g. kLogStoreOK).
  */
 
@@ -89,6 +287,38 @@ int LogStorePut(LogStore store,
                 size_t size, 
                 LogStoreRevision rev);
 
+/**
+ * A value to put with LogStorePutMany.  The fields are as for LogStorePut.
+ */
+
+typedef struct LogStorePutEntry
+{
+    LogStoreID        id;
+    void             *data;
+    size_t            size;
+    LogStoreRevision  rev;
+} LogStorePutEntry;
+
+/**
+ * Puts many values at once.  The revisions of all entries are checked and
+ * the records are appended to the log in as few writes as possible while
+ * holding the store's lock once.  Entries are put in order, so a later entry
+ * for the same ID must name the revision made by the earlier one.
+ *
+ * @param store The store to which the values should be saved.
+ * @param entries The values to put.
+ * @param count The number of entries.
+ * @param results [out] The code for each entry (e.g. kLogStoreOK or 
+ * kLogStoreRevisionConflict).  Required; must hold 'count' codes.
+ * @return kLogStoreOK if every entry was put, otherwise the code of the 
+ * first entry that was not.
+ */
+
+int LogStorePutMany(LogStore                store,
+                    const LogStorePutEntry *entries,
+                    size_t                  count,
+                    int                    *results);
+
 /**
  * Gets or loads a value from the logstore by ID.
  *
@@ -97,12 +327,18 @@ int LogStorePut(LogStore store,
  * @param outData [out] A pointer to a NULL-initialized buffer. Logstore
  * will read the value from disk and allocate *outData to point to the
  * value read.  Required. void *data = NULL; LogStoreGet(..., &data, ...)
+ * The value is allocated with the store's allocator (see LogStoreOptions);
+ * by default, release it with free().
  * @param outSize [out] The size of the value read in bytes. Optional.
  * If you do not care about the size, pass NULL.
  * @param outRev [out] The current/latest revision/version of the value 
  * in the logstore.  Optional.  If you do not care about the revision, 
  * pass NULL.
  *
+ * Gets do not take the store's lock; they run concurrently with each other
+ * and with puts, removes, and compaction.  The index knows where a value is
+ * and how large it is, so a get that misses the cache reads the log once.
+ *
  * @return code (e.g. kLogStoreOK).
  */
 
@@ -112,6 +348,293 @@ int LogStoreGet(LogStore store,
                 size_t *outSize, 
                 LogStoreRevision *outRev);
 
+/**
+ * Gets or loads a value from the logstore by ID into a buffer supplied by 
+ * the caller.  Nothing is allocated.
+ *
+ * @param store The store from which the value should be loaded.
+ * @param id The ID of the value (see LogStoreMakeID).
+ * @param buffer The buffer to read the value into.  Required.
+ * @param capacity The size of 'buffer' in bytes.
+ * @param outSize [out] The size of the value in bytes.  Optional, but if
+ * 'buffer' is too small, this is how to learn the size required.
+ * @param outRev [out] The current revision of the value.  Optional.
+ * @return code (e.g. kLogStoreOK, or kLogStoreBufferTooSmall when the value 
+ * does not fit in 'buffer').
+ */
+
+int LogStoreGetInto(LogStore          store,
+                    LogStoreID        id,
+                    void             *buffer,
+                    size_t            capacity,
+                    size_t           *outSize,
+                    LogStoreRevision *outRev);
+
+/**
+ * Gets many values at once.  All index entries are resolved first, then the
+ * records are read in the order they appear in the log, reading records that
+ * lie close together with a single call, to minimize seeking.  Results are 
+ * reported in the order of 'ids'.
+ *
+ * @param store The store from which the values should be loaded.
+ * @param ids The IDs of the values.
+ * @param count The number of IDs.
+ * @param outData [out] An array of 'count' NULL-initialized buffers.  Each
+ * value read is allocated as for LogStoreGet.  Required.
+ * @param outSizes [out] An array of 'count' sizes.  Optional.
+ * @param outRevs [out] An array of 'count' revisions.  Optional.
+ * @param results [out] The code for each ID (e.g. kLogStoreOK or
+ * kLogStoreNotFound).  Required; must hold 'count' codes.
+ * @return kLogStoreOK if every value was read, otherwise the code of the 
+ * first ID that was not.
+ */
+
+int LogStoreGetMany(LogStore          store,
+                    const LogStoreID *ids,
+                    size_t            count,
+                    void            **outData,
+                    size_t           *outSizes,
+                    LogStoreRevision *outRevs,
+                    int              *results);
+
+/**
+ * Learns whether a value exists, its size, and its revision, from the index
+ * alone: the log is not read and the value is not copied.  The revision is
+ * the one to pass to LogStorePut to replace the value (or to put it again
+ * once removed).
+ *
+ * @param store The store.
+ * @param id The ID of the value.
+ * @param outExists [out] 1 if the ID has a value, 0 if it was never put or
+ * has been removed.  Optional.
+ * @param outSize [out] The size of the value in bytes, or 0.  Optional.
+ * @param outRev [out] The current revision of the value.  Optional.
+ * @return code (e.g. kLogStoreOK).  An ID without a value is not an error.
+ */
+
+int LogStoreStat(LogStore          store,
+                 LogStoreID        id,
+                 int              *outExists,
+                 size_t           *outSize,
+                 LogStoreRevision *outRev);
+
+/**
+ * LogStoreStat for many IDs at once.  The output arrays, each optional, must
+ * hold 'count' elements.
+ *
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreStatMany(LogStore          store,
+                     const LogStoreID *ids,
+                     size_t            count,
+                     int              *outExists,
+                     size_t           *outSizes,
+                     LogStoreRevision *outRevs);
+
+/**
+ * Called by LogStoreIterate for each value.  'data' is only valid during the
+ * call.  Return kLogStoreOK to go on; anything else stops the iteration.
+ */
+
+typedef int (*LogStoreIterateCallback)(void            *context,
+                                       LogStoreID       id,
+                                       const void      *data,
+                                       size_t           size,
+                                       LogStoreRevision rev);
+
+enum
+{
+    kLogStoreIterateNoCache = 1 << 0    // drop the log from the page cache
+};
+
+/**
+ * Visits every value in the store, in the order the values are found in the
+ * log (that of a shard at a time, for a sharded store).  The log is read
+ * sequentially in large pieces; records of values since replaced or removed
+ * are skipped.  This is how to export a whole store: it runs at the speed
+ * the disk reads, where a get per ID runs at the speed it seeks.
+ *
+ * Values put or removed during the iteration may be visited as they were
+ * before or not at all.  Compaction waits for the iteration to finish, so
+ * the callback must not compact the store; it may do anything else.
+ *
+ * @param store The store.
+ * @param callback Called for each value.
+ * @param context Passed to 'callback'.
+ * @param flags kLogStoreIterate... flags.  kLogStoreIterateNoCache keeps a
+ * one-off scan, such as an export, from evicting what is in the page cache.
+ * @return code (e.g. kLogStoreOK), or what the callback returned to stop.
+ */
+
+int LogStoreIterate(LogStore                store,
+                    LogStoreIterateCallback callback,
+                    void                   *context,
+                    int                     flags);
+
+/**
+ * Takes a snapshot of a store: what its values are at this instant, for as
+ * long as the snapshot is open, no matter what is put or removed meanwhile.
+ * Taking a snapshot costs next to nothing.  Writers are not held up; the
+ * first change to a page of the index after a snapshot is taken saves the
+ * page as it was, so an open snapshot costs memory in proportion to the
+ * pages of the index changed meanwhile.
+ *
+ * A store with a snapshot open cannot be compacted (see LogStoreCompact).
+ * Close all snapshots before closing the store.
+ *
+ * @param store The store.
+ * @param outSnapshot [out] The snapshot.  Must be NULL on input.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreSnapshotOpen(LogStore store, LogStoreSnapshot *outSnapshot);
+
+/**
+ * Closes a snapshot taken with LogStoreSnapshotOpen.
+ *
+ * @param ioSnapshot The snapshot.  Set to NULL.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreSnapshotClose(LogStoreSnapshot *ioSnapshot);
+
+/**
+ * LogStoreGet as of a snapshot.  Values read through a snapshot bypass the
+ * read cache.
+ *
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreSnapshotGet(LogStoreSnapshot  snapshot,
+                        LogStoreID        id,
+                        void            **outData,
+                        size_t           *outSize,
+                        LogStoreRevision *outRev);
+
+/**
+ * LogStoreIterate as of a snapshot: visits exactly the values of the store
+ * when the snapshot was taken.
+ *
+ * @return code (e.g. kLogStoreOK), or what the callback returned to stop.
+ */
+
+int LogStoreSnapshotIterate(LogStoreSnapshot        snapshot,
+                            LogStoreIterateCallback callback,
+                            void                   *context,
+                            int                     flags);
+
+/**
+ * A reference to a value returned by LogStoreGetView.  Treat as opaque.
+ */
+
+typedef struct LogStoreView
+{
+    struct LogFileMapping *mapping;
+    void                  *buffer;
+} LogStoreView;
+
+/**
+ * Gets a value without copying it.  When the store was opened with 
+ * kLogStoreOptionMapLog, the value returned points directly into a read-only
+ * memory mapping of the log file.  Otherwise the value is read into a buffer
+ * owned by the view.  Either way, the value remains valid (even across
+ * puts, removes, and compaction) until the view is released.  A mapped 
+ * value starts wherever its record put it, so the pointer has no alignment
+ * guarantee; copy the value out (e.g. with memcpy) before loading from it as 
+ * a wider type.
+ *
+ * @param store The store from which the value should be viewed.
+ * @param id The ID of the value (see LogStoreMakeID).
+ * @param outData [out] The value.  Required.  Do not modify or free it.
+ * @param outSize [out] The size of the value in bytes.  Optional.
+ * @param outView [out] The view to release with LogStoreReleaseView once 
+ * done with the value.  Required.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreGetView(LogStore      store,
+                    LogStoreID    id,
+                    const void  **outData,
+                    size_t       *outSize,
+                    LogStoreView *outView);
+
+/**
+ * Releases a view returned by LogStoreGetView.  Release all views before 
+ * closing the store.
+ *
+ * @param store The store the view was returned by.
+ * @param view The view to release.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreReleaseView(LogStore store, LogStoreView *view);
+
+/**
+ * Called when an asynchronous get is done, on a thread of the store's (see
+ * LogStoreOptions.asyncThreads).  On success, 'data' is the value, allocated
+ * as for LogStoreGet; it is the callback's to free.  Otherwise it is NULL.
+ */
+
+typedef void (*LogStoreGetCallback)(void            *context,
+                                    int              result,
+                                    void            *data,
+                                    size_t           size,
+                                    LogStoreRevision rev);
+
+/**
+ * Called when an asynchronous put or sync is done, on a thread of the
+ * store's, with the code the call would have returned.
+ */
+
+typedef void (*LogStoreDoneCallback)(void *context, int result);
+
+/**
+ * Gets a value without waiting for the disk.  The read of the log is
+ * submitted to an io_uring where the system has one (unless the store was
+ * opened with kLogStoreOptionNoRing), so that thousands of gets can be in
+ * flight with only a thread or two; otherwise it is done by the store's
+ * threads.  Compaction and growing the index wait for the reads in flight.
+ *
+ * @param store The store, opened with LogStoreOptions.asyncThreads set.
+ * @param id The ID of the value to get.
+ * @param callback Called once when the get is done, unless submitting it
+ * fails.
+ * @param context Passed to 'callback'.
+ * @return code (e.g. kLogStoreOK) of submitting the get.
+ */
+
+int LogStoreGetAsync(LogStore            store,
+                     LogStoreID          id,
+                     LogStoreGetCallback callback,
+                     void               *context);
+
+/**
+ * Puts a value without waiting, as LogStorePut does on one of the store's
+ * threads.  'data' must stay as it is until the callback is called.
+ *
+ * @return code (e.g. kLogStoreOK) of submitting the put.
+ */
+
+int LogStorePutAsync(LogStore             store,
+                     LogStoreID           id,
+                     void                *data,
+                     size_t               size,
+                     LogStoreRevision     rev,
+                     LogStoreDoneCallback callback,
+                     void                *context);
+
+/**
+ * Syncs without waiting, as LogStoreSync does on one of the store's threads.
+ * Concurrent syncs share a flush, as usual.
+ *
+ * @return code (e.g. kLogStoreOK) of submitting the sync.
+ */
+
+int LogStoreSyncAsync(LogStore             store, 
+                      LogStoreDoneCallback callback,
+                      void                *context);
+
 /**
  * Removes a value by ID.  Note that IDs should be treated as black
  * box opaque values.  Also, IDs are not recycled.
@@ -123,6 +646,66 @@ int LogStoreGet(LogStore store,
 
 int LogStoreRemove(LogStore store, LogStoreID id);
 
+/**
+ * Options for LogStoreCompact.  Zero-initialize and set only what you need;
+ * zero values select the defaults.
+ */
+
+typedef struct LogStoreCompactOptions
+{
+    size_t bufferSize;      // bytes read from the log at a time (1 MiB)
+    size_t recordsPerLock;  // records checked per hold of the lock (1024)
+} LogStoreCompactOptions;
+
+/**
+ * Compacts the log file by copying the live records (those named by the 
+ * index) into a fresh log file, swapping it in place of the old log, and 
+ * rewriting the index offsets.  Superseded records are dropped.
+ *
+ * The copy runs without holding the store's lock for more than a batch of 
+ * records at a time, so puts, gets, and removes may proceed concurrently.
+ * Only the final swap (copying records appended during the compaction and
+ * updating the index) is done while holding the lock.
+ *
+ * The client decides when to compact; logstore never does so on its own.
+ *
+ * @param store The store to compact.
+ * @param options Compaction options.  Optional; pass NULL for defaults.
+ * @param outBytesReclaimed [out] The number of bytes by which the log file
+ * shrunk.  Optional.
+ * @return code (e.g. kLogStoreOK).  kLogStoreBusy if a snapshot of the store
+ * is open (see LogStoreSnapshotOpen).
+ */
+
+int LogStoreCompact(LogStore                      store, 
+                    const LogStoreCompactOptions *options,
+                    uint64_t                     *outBytesReclaimed);
+
+/**
+ * Counters of the read cache (see LogStoreOptions.cacheSize).
+ */
+
+typedef struct LogStoreCacheStats
+{
+    uint64_t hits;          // gets answered from the cache
+    uint64_t misses;        // gets that read the log
+    uint64_t evictions;     // values evicted to stay within the budget
+    size_t   size;          // bytes currently cached, including overhead
+} LogStoreCacheStats;
+
+/**
+ * Gets the counters of the read cache.  Values are cached by ID and revision
+ * when they are read, and dropped when they are put or removed.  Eviction is
+ * adaptive (ARC) so a scan of many values read once does not evict values
+ * read repeatedly.
+ *
+ * @param store The store.
+ * @param outStats [out] The counters.  All zero if the store has no cache.
+ * @return code (e.g. kLogStoreOK).
+ */
+
+int LogStoreGetCacheStats(LogStore store, LogStoreCacheStats *outStats);
+
 /**
  * Describes in English an error/response code.
  *
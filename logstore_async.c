@@ -0,0 +1,597 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "logstore.h"
+#include "logstore_private.h"
+
+// The engine behind the asynchronous calls.  Work is queued for a pool of
+// threads.  Reads go to an io_uring where the system has one: they are
+// submitted as they come and a reaper thread completes them, so that as many
+// are in flight as the ring holds however few threads there are.  Without a
+// ring, the threads do the reads too.  Completing work may submit more, and
+// the engine is only stopped once all of it is done.
+
+#define kAsyncRingEntries 256
+
+struct LogStoreAsync
+{
+    LogStoreAllocator  allocator;
+    pthread_mutex_t    mutex;
+    pthread_cond_t     workCond;            // work queued, or stopping
+    LogStoreAsyncWork *head;                // queued for the threads
+    LogStoreAsyncWork *tail;
+    unsigned           active;              // being completed
+    pthread_cond_t     idleCond;            // nothing active
+    int                stop;
+    pthread_t         *threads;
+    int                threadCount;
+
+    int                ringFileNo;          // -1 if there is no ring
+    int                ringFailed;          // reads go to the threads if set
+    pthread_t          reaper;
+    pthread_cond_t     ringCond;            // room in the ring, or failed
+    pthread_cond_t     reapCond;            // reads in flight, or stopping
+    unsigned           ringInFlight;
+    unsigned           ringEntries;
+    void              *sqRing;              // the mappings of the ring
+    size_t             sqRingSize;
+    void              *cqRing;
+    size_t             cqRingSize;
+    void              *sqes;
+    size_t             sqesSize;
+    unsigned          *sqTail;
+    unsigned          *sqMask;
+    unsigned          *sqArray;
+    unsigned          *cqHead;
+    unsigned          *cqTail;
+    unsigned          *cqMask;
+    void              *cqes;
+};
+
+static inline void *asyncAllocate(LogStoreAsync *async, size_t size)
+{
+    return async->allocator.allocate(async->allocator.context, size);
+}
+
+static inline void asyncFree(LogStoreAsync *async, void *pointer)
+{
+    if (NULL != pointer)
+    {
+        async->allocator.deallocate(async->allocator.context, pointer);
+    }
+}
+
+// Read into the iovecs of a work item from its offset, past the first 'done'
+// bytes (already read).  Returns the number of bytes read in all.
+
+static size_t asyncReadv(LogStoreAsyncWork *work, size_t done)
+{
+    struct iovec *iov   = work->iov;
+    int           count = work->iovCount;
+    size_t        total = done;
+    size_t        skip  = done;
+
+    for (;;)
+    {
+        while (count > 0 && skip >= iov->iov_len)
+        {
+            skip -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (0 == count)
+        {
+            return total;
+        }
+
+        iov->iov_base  = (char *)iov->iov_base + skip;
+        iov->iov_len  -= skip;
+
+        ssize_t bytesRead = preadv(work->fileNo, iov, count,
+                                   work->offset + total);
+
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            skip = 0;
+
+            continue;
+        }
+
+        if (bytesRead <= 0)
+        {
+            return total;
+        }
+
+        total += bytesRead;
+        skip   = bytesRead;
+    }
+}
+
+// Queue work for the threads.  The caller holds the mutex.
+
+static void asyncQueue(LogStoreAsync *async, LogStoreAsyncWork *work)
+{
+    work->next = NULL;
+
+    if (NULL == async->tail)
+    {
+        async->head = work;
+    }
+    else
+    {
+        async->tail->next = work;
+    }
+
+    async->tail = work;
+
+    pthread_cond_signal(&async->workCond);
+}
+
+// Note that 'count' work items were completed.  The caller holds the mutex.
+
+static void asyncFinished(LogStoreAsync *async, unsigned count)
+{
+    async->active -= count;
+
+    if (0 == async->active)
+    {
+        pthread_cond_broadcast(&async->idleCond);
+    }
+}
+
+static void *asyncThread(void *arg)
+{
+    LogStoreAsync *async = arg;
+
+    pthread_mutex_lock(&async->mutex);
+
+    for (;;)
+    {
+        while (NULL == async->head && !async->stop)
+        {
+            pthread_cond_wait(&async->workCond, &async->mutex);
+        }
+
+        LogStoreAsyncWork *work = async->head;
+
+        if (NULL == work)
+        {
+            break;
+        }
+
+        if (NULL == (async->head = work->next))
+        {
+            async->tail = NULL;
+        }
+
+        async->active++;
+
+        pthread_mutex_unlock(&async->mutex);
+
+        work->done(work, -1 == work->fileNo ? 0 : asyncReadv(work, 0));
+
+        pthread_mutex_lock(&async->mutex);
+
+        asyncFinished(async, 1);
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+
+    return NULL;
+}
+
+#ifdef __linux__
+
+static int ringEnter(LogStoreAsync *async, unsigned submit, unsigned wait)
+{
+    long result;
+
+    do
+    {
+        result = syscall(__NR_io_uring_enter, async->ringFileNo, submit, wait,
+                         wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    }
+    while (result == -1 && errno == EINTR);
+
+    return (int)result;
+}
+
+// Put a read in the ring and submit it, waiting for room if need be.  The
+// reaper cannot wait for room, since only it makes room, so it gets
+// kLogStoreBusy instead, as does anyone once the ring has failed; the read is
+// then left to the threads.  A read the ring does not take is taken back and
+// kLogStoreInputOutputError returned.  The caller holds the mutex.
+
+static int ringSubmit(LogStoreAsync *async, LogStoreAsyncWork *work)
+{
+    int isReaper = pthread_equal(pthread_self(), async->reaper);
+
+    while (!async->ringFailed && async->ringInFlight == async->ringEntries)
+    {
+        if (isReaper)
+        {
+            return kLogStoreBusy;
+        }
+
+        pthread_cond_wait(&async->ringCond, &async->mutex);
+    }
+
+    if (async->ringFailed)
+    {
+        return kLogStoreBusy;
+    }
+
+    unsigned tail  = *async->sqTail;
+    unsigned index = tail & *async->sqMask;
+
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)async->sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->user_data = (uintptr_t)work;
+    sqe->opcode    = IORING_OP_READV;
+    sqe->fd        = work->fileNo;
+    sqe->addr      = (uintptr_t)work->iov;
+    sqe->len       = work->iovCount;
+    sqe->off       = work->offset;
+
+    async->sqArray[index] = index;
+
+    __atomic_store_n(async->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    if (1 != ringEnter(async, 1, 0))
+    {
+        __atomic_store_n(async->sqTail, tail, __ATOMIC_RELEASE);
+
+        return kLogStoreInputOutputError;
+    }
+
+    if (0 == async->ringInFlight++)
+    {
+        pthread_cond_signal(&async->reapCond);
+    }
+
+    return kLogStoreOK;
+}
+
+// Complete reads as the ring reports them, until the engine stops.  Room in
+// the ring is made before the reads are completed, since completing one may
+// submit another.  A full completion queue (EBUSY) is made room in by
+// reaping.  Should waiting on the ring fail otherwise, no more reads are sent
+// to it, and those in flight are polled for, since they may yet land in their
+// buffers.
+
+#define kAsyncReapBatch 64
+
+static void *ringReaper(void *arg)
+{
+    LogStoreAsync *async = arg;
+
+    LogStoreAsyncWork *works[kAsyncReapBatch];
+    int                results[kAsyncReapBatch];
+
+    pthread_mutex_lock(&async->mutex);
+
+    for (;;)
+    {
+        while (0 == async->ringInFlight && !async->stop)
+        {
+            pthread_cond_wait(&async->reapCond, &async->mutex);
+        }
+
+        if (0 == async->ringInFlight)
+        {
+            break;
+        }
+
+        int failed = async->ringFailed;
+
+        pthread_mutex_unlock(&async->mutex);
+
+        if (failed)
+        {
+            struct timespec pause = { 0, 1000000 };
+
+            nanosleep(&pause, NULL);
+        }
+        else if (ringEnter(async, 0, 1) < 0 && EBUSY != errno)
+        {
+            pthread_mutex_lock(&async->mutex);
+
+            async->ringFailed = 1;
+
+            pthread_cond_broadcast(&async->ringCond);
+
+            pthread_mutex_unlock(&async->mutex);
+        }
+
+        unsigned head  = *async->cqHead;
+        unsigned tail  = __atomic_load_n(async->cqTail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+
+        for (; head != tail && count < kAsyncReapBatch; ++head, ++count)
+        {
+            struct io_uring_cqe *cqe =
+                (struct io_uring_cqe *)async->cqes + (head & *async->cqMask);
+
+            works[count]   = (LogStoreAsyncWork *)(uintptr_t)cqe->user_data;
+            results[count] = cqe->res;
+        }
+
+        __atomic_store_n(async->cqHead, head, __ATOMIC_RELEASE);
+
+        pthread_mutex_lock(&async->mutex);
+
+        async->ringInFlight -= count;
+        async->active       += count;
+
+        pthread_cond_broadcast(&async->ringCond);
+
+        pthread_mutex_unlock(&async->mutex);
+
+        // A short read is finished here.
+
+        for (unsigned i = 0; i < count; ++i)
+        {
+            works[i]->done(works[i], results[i] < 0 ? 0 : 
+                                     asyncReadv(works[i], results[i]));
+        }
+
+        pthread_mutex_lock(&async->mutex);
+
+        asyncFinished(async, count);
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+
+    return NULL;
+}
+
+static void ringDestroy(LogStoreAsync *async)
+{
+    if (NULL != async->sqes)
+    {
+        munmap(async->sqes, async->sqesSize);
+    }
+
+    if (NULL != async->cqRing && async->cqRing != async->sqRing)
+    {
+        munmap(async->cqRing, async->cqRingSize);
+    }
+
+    if (NULL != async->sqRing)
+    {
+        munmap(async->sqRing, async->sqRingSize);
+    }
+
+    close(async->ringFileNo);
+
+    async->ringFileNo = -1;
+}
+
+// Set up the ring.  Failing that, reads go to the threads.
+
+static void ringCreate(LogStoreAsync *async)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+
+    async->ringFileNo = syscall(__NR_io_uring_setup, kAsyncRingEntries,
+                                &params);
+
+    if (-1 == async->ringFileNo)
+    {
+        return;
+    }
+
+    async->ringEntries = params.sq_entries;
+    async->sqRingSize  = params.sq_off.array +
+                         params.sq_entries * sizeof(unsigned);
+    async->cqRingSize  = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    async->sqesSize    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (async->cqRingSize > async->sqRingSize)
+        {
+            async->sqRingSize = async->cqRingSize;
+        }
+
+        async->cqRingSize = async->sqRingSize;
+    }
+
+    void *sqRing = mmap(0, async->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, async->ringFileNo,
+                        IORING_OFF_SQ_RING);
+    void *cqRing = sqRing;
+
+    if (MAP_FAILED != sqRing && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cqRing = mmap(0, async->cqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, async->ringFileNo,
+                      IORING_OFF_CQ_RING);
+    }
+
+    void *sqes = mmap(0, async->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, async->ringFileNo,
+                      IORING_OFF_SQES);
+
+    async->sqRing = MAP_FAILED == sqRing ? NULL : sqRing;
+    async->cqRing = MAP_FAILED == cqRing ? NULL : cqRing;
+    async->sqes   = MAP_FAILED == sqes ? NULL : sqes;
+
+    if (NULL == async->sqRing || NULL == async->cqRing || NULL == async->sqes)
+    {
+        ringDestroy(async);
+
+        return;
+    }
+
+    async->sqTail  = (unsigned *)((char *)sqRing + params.sq_off.tail);
+    async->sqMask  = (unsigned *)((char *)sqRing + params.sq_off.ring_mask);
+    async->sqArray = (unsigned *)((char *)sqRing + params.sq_off.array);
+    async->cqHead  = (unsigned *)((char *)cqRing + params.cq_off.head);
+    async->cqTail  = (unsigned *)((char *)cqRing + params.cq_off.tail);
+    async->cqMask  = (unsigned *)((char *)cqRing + params.cq_off.ring_mask);
+    async->cqes    = (char *)cqRing + params.cq_off.cqes;
+
+    if (0 != pthread_create(&async->reaper, NULL, ringReaper, async))
+    {
+        ringDestroy(async);
+    }
+}
+
+#endif
+
+LogStoreAsync *logStoreAsyncCreate(const LogStoreAllocator *allocator,
+                                   int                      threadCount,
+                                   int                      useRing)
+{
+    LogStoreAsync *async = allocator->allocate(allocator->context,
+                                               sizeof(LogStoreAsync));
+
+    if (NULL == async)
+    {
+        return NULL;
+    }
+
+    memset(async, 0, sizeof(LogStoreAsync));
+
+    async->allocator  = *allocator;
+    async->ringFileNo = -1;
+    async->threads    = asyncAllocate(async, threadCount * sizeof(pthread_t));
+
+    if (NULL == async->threads)
+    {
+        asyncFree(async, async);
+
+        return NULL;
+    }
+
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->workCond, NULL);
+    pthread_cond_init(&async->idleCond, NULL);
+    pthread_cond_init(&async->ringCond, NULL);
+    pthread_cond_init(&async->reapCond, NULL);
+
+    for (; async->threadCount < threadCount; async->threadCount++)
+    {
+        if (0 != pthread_create(&async->threads[async->threadCount], NULL,
+                                asyncThread, async))
+        {
+            logStoreAsyncDestroy(async);
+
+            return NULL;
+        }
+    }
+
+#ifdef __linux__
+    if (useRing)
+    {
+        ringCreate(async);
+    }
+#endif
+
+    return async;
+}
+
+void logStoreAsyncDestroy(LogStoreAsync *async)
+{
+    if (NULL == async)
+    {
+        return;
+    }
+
+    // Work in progress is finished first, along with any work it submits.
+
+    pthread_mutex_lock(&async->mutex);
+
+    while (NULL != async->head || async->active > 0 || 
+           async->ringInFlight > 0)
+    {
+        pthread_cond_wait(&async->idleCond, &async->mutex);
+    }
+
+    async->stop = 1;
+
+    pthread_cond_broadcast(&async->workCond);
+    pthread_cond_broadcast(&async->reapCond);
+
+    pthread_mutex_unlock(&async->mutex);
+
+    for (int i = 0; i < async->threadCount; ++i)
+    {
+        pthread_join(async->threads[i], NULL);
+    }
+
+#ifdef __linux__
+    if (-1 != async->ringFileNo)
+    {
+        pthread_join(async->reaper, NULL);
+
+        ringDestroy(async);
+    }
+#endif
+
+    pthread_mutex_destroy(&async->mutex);
+    pthread_cond_destroy(&async->workCond);
+    pthread_cond_destroy(&async->idleCond);
+    pthread_cond_destroy(&async->ringCond);
+    pthread_cond_destroy(&async->reapCond);
+
+    asyncFree(async, async->threads);
+    asyncFree(async, async);
+}
+
+void logStoreAsyncSubmit(LogStoreAsync *async, LogStoreAsyncWork *work)
+{
+    pthread_mutex_lock(&async->mutex);
+
+#ifdef __linux__
+    if (-1 != work->fileNo && -1 != async->ringFileNo)
+    {
+        int result = ringSubmit(async, work);
+
+        if (kLogStoreBusy == result)
+        {
+            asyncQueue(async, work);
+        }
+
+        pthread_mutex_unlock(&async->mutex);
+
+        // A read that could not be submitted fails as a short one.
+
+        if (kLogStoreInputOutputError == result)
+        {
+            work->done(work, 0);
+        }
+
+        return;
+    }
+#endif
+
+    asyncQueue(async, work);
+
+    pthread_mutex_unlock(&async->mutex);
+}
+
+int logStoreAsyncUsesRing(LogStoreAsync *async)
+{
+    return -1 != async->ringFileNo;
+}
@@ -0,0 +1,589 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logstore.h"
+#include "logstore_private.h"
+
+// The cache is split into shards by ID, each with its own lock, so that gets
+// of different IDs rarely contend.  Each shard is managed with ARC (Megiddo &
+// Modha's Adaptive Replacement Cache), weighted by bytes instead of entries:
+//
+//   T1: values seen once recently        B1: IDs recently evicted from T1
+//   T2: values seen at least twice       B2: IDs recently evicted from T2
+//
+// T1 and T2 hold at most 'capacity' bytes between them.  B1 and B2 are
+// "ghosts" that only remember the ID and size of what was evicted.  A miss
+// that hits a ghost in B1 means T1 is too small, and vice versa, so the
+// target size of T1 adapts to the workload.  A scan only ever passes through
+// T1, so it cannot flush what has been used repeatedly from T2.
+
+enum
+{
+    kCacheT1,
+    kCacheT2,
+    kCacheB1,
+    kCacheB2,
+    kCacheListCount
+};
+
+#define kCacheDefaultShardCount 16
+
+typedef struct CacheEntry
+{
+    struct CacheEntry *hashNext;
+    struct CacheEntry *prev;            // in its list; MRU is head.next
+    struct CacheEntry *next;
+    LogStoreID         id;
+    LogStoreRevision   rev;
+    int                list;            // kCacheT1 ...
+    size_t             size;            // of the value
+    void              *data;            // NULL for ghosts
+} CacheEntry;
+
+typedef struct CacheList
+{
+    CacheEntry         head;            // circular, with a sentinel
+    size_t             bytes;
+} CacheList;
+
+typedef struct CacheShard
+{
+    pthread_mutex_t    mutex;
+    CacheEntry       **buckets;
+    size_t             bucketCount;
+    size_t             entryCount;
+    CacheList          lists[kCacheListCount];
+    size_t             capacity;        // 'c' in ARC, in bytes
+    size_t             target;          // 'p' in ARC: target bytes for T1
+    uint64_t           hits;
+    uint64_t           misses;
+    uint64_t           evictions;
+} CacheShard;
+
+struct LogStoreCache
+{
+    LogStoreAllocator  allocator;
+    int                shardCount;
+    CacheShard         shards[];
+};
+
+// What an entry costs against the budget.
+
+static inline size_t cacheWeight(size_t size)
+{
+    return size + sizeof(CacheEntry);
+}
+
+static inline uint64_t cacheHash(LogStoreID id)
+{
+    return (uint64_t)id * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline CacheShard *cacheShardOf(LogStoreCache *cache, LogStoreID id)
+{
+    return &cache->shards[(cacheHash(id) >> 32) % cache->shardCount];
+}
+
+static inline CacheEntry **cacheBucketOf(CacheShard *shard, LogStoreID id)
+{
+    return &shard->buckets[cacheHash(id) & (shard->bucketCount - 1)];
+}
+
+static inline void *cacheAllocate(LogStoreCache *cache, size_t size)
+{
+    return cache->allocator.allocate(cache->allocator.context, size);
+}
+
+static inline void cacheFree(LogStoreCache *cache, void *pointer)
+{
+    if (NULL != pointer)
+    {
+        cache->allocator.deallocate(cache->allocator.context, pointer);
+    }
+}
+
+static CacheEntry *cacheFind(CacheShard *shard, LogStoreID id)
+{
+    CacheEntry *e = *cacheBucketOf(shard, id);
+
+    while (NULL != e && e->id != id)
+    {
+        e = e->hashNext;
+    }
+
+    return e;
+}
+
+static void cacheListUnlink(CacheShard *shard, CacheEntry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+
+    shard->lists[e->list].bytes -= cacheWeight(e->size);
+}
+
+static void cacheListPushMRU(CacheShard *shard, CacheEntry *e, int list)
+{
+    CacheList *l = &shard->lists[list];
+
+    e->list = list;
+    e->prev = &l->head;
+    e->next = l->head.next;
+
+    l->head.next->prev = e;
+    l->head.next       = e;
+
+    l->bytes += cacheWeight(e->size);
+}
+
+static inline CacheEntry *cacheListLRU(CacheShard *shard, int list)
+{
+    CacheList *l = &shard->lists[list];
+
+    return l->head.prev == &l->head ? NULL : l->head.prev;
+}
+
+// Grow the hash table of a shard as entries are added.  Failing to grow only
+// makes chains longer.
+
+static void cacheRehash(LogStoreCache *cache, CacheShard *shard)
+{
+    size_t       bucketCount = shard->bucketCount * 2;
+    CacheEntry **buckets     = cacheAllocate(cache,
+                                             bucketCount * sizeof(CacheEntry *));
+
+    if (NULL == buckets)
+    {
+        return;
+    }
+
+    memset(buckets, 0, bucketCount * sizeof(CacheEntry *));
+
+    for (size_t i = 0; i < shard->bucketCount; ++i)
+    {
+        CacheEntry *e = shard->buckets[i];
+
+        while (NULL != e)
+        {
+            CacheEntry *next = e->hashNext;
+            size_t      b    = cacheHash(e->id) & (bucketCount - 1);
+
+            e->hashNext = buckets[b];
+            buckets[b]  = e;
+
+            e = next;
+        }
+    }
+
+    cacheFree(cache, shard->buckets);
+
+    shard->buckets     = buckets;
+    shard->bucketCount = bucketCount;
+}
+
+// Remove an entry from the shard altogether.
+
+static void cacheRemove(LogStoreCache *cache, CacheShard *shard, CacheEntry *e)
+{
+    CacheEntry **link = cacheBucketOf(shard, e->id);
+
+    while (*link != e)
+    {
+        link = &(*link)->hashNext;
+    }
+
+    *link = e->hashNext;
+
+    cacheListUnlink(shard, e);
+
+    shard->entryCount--;
+
+    cacheFree(cache, e->data);
+    cacheFree(cache, e);
+}
+
+// Turn the LRU value of T1 or T2 into a ghost in B1 or B2 respectively.
+
+static void cacheDemote(LogStoreCache *cache, CacheShard *shard, int list)
+{
+    CacheEntry *e = cacheListLRU(shard, list);
+
+    cacheListUnlink(shard, e);
+
+    cacheFree(cache, e->data);
+    e->data = NULL;
+
+    cacheListPushMRU(shard, e, kCacheT1 == list ? kCacheB1 : kCacheB2);
+
+    shard->evictions++;
+}
+
+// ARC's REPLACE: make room for 'size' more bytes in T1 + T2.
+
+static void cacheReplace(LogStoreCache *cache,
+                         CacheShard    *shard,
+                         size_t         size,
+                         int            hitB2)
+{
+    CacheList *t1 = &shard->lists[kCacheT1];
+    CacheList *t2 = &shard->lists[kCacheT2];
+
+    while (t1->bytes + t2->bytes + cacheWeight(size) > shard->capacity &&
+           t1->bytes + t2->bytes > 0)
+    {
+        if (t1->bytes > 0 &&
+            (t1->bytes > shard->target ||
+             (hitB2 && t1->bytes == shard->target) ||
+             0 == t2->bytes))
+        {
+            cacheDemote(cache, shard, kCacheT1);
+        }
+        else
+        {
+            cacheDemote(cache, shard, kCacheT2);
+        }
+    }
+}
+
+// Drop the LRU ghost of a list.
+
+static int cacheDropGhost(LogStoreCache *cache, CacheShard *shard, int list)
+{
+    CacheEntry *e = cacheListLRU(shard, list);
+
+    if (NULL == e)
+    {
+        return 0;
+    }
+
+    cacheRemove(cache, shard, e);
+
+    return 1;
+}
+
+LogStoreCache *logStoreCacheCreate(const LogStoreAllocator *allocator,
+                                   size_t                   capacity,
+                                   int                      shardCount)
+{
+    if (shardCount <= 0)
+    {
+        shardCount = kCacheDefaultShardCount;
+    }
+
+    size_t size = sizeof(LogStoreCache) + shardCount * sizeof(CacheShard);
+
+    LogStoreCache *cache = allocator->allocate(allocator->context, size);
+
+    if (NULL == cache)
+    {
+        return NULL;
+    }
+
+    memset(cache, 0, size);
+
+    cache->allocator  = *allocator;
+    cache->shardCount = shardCount;
+
+    for (int i = 0; i < shardCount; ++i)
+    {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_init(&shard->mutex, NULL);
+
+        for (int l = 0; l < kCacheListCount; ++l)
+        {
+            shard->lists[l].head.prev = &shard->lists[l].head;
+            shard->lists[l].head.next = &shard->lists[l].head;
+        }
+
+        shard->capacity    = capacity / shardCount;
+        shard->bucketCount = 64;
+        shard->buckets     = cacheAllocate(cache,
+                                           64 * sizeof(CacheEntry *));
+
+        if (NULL == shard->buckets)
+        {
+            cache->shardCount = i + 1;
+
+            logStoreCacheDestroy(cache);
+
+            return NULL;
+        }
+
+        memset(shard->buckets, 0, 64 * sizeof(CacheEntry *));
+    }
+
+    return cache;
+}
+
+void logStoreCacheDestroy(LogStoreCache *cache)
+{
+    if (NULL == cache)
+    {
+        return;
+    }
+
+    for (int i = 0; i < cache->shardCount; ++i)
+    {
+        CacheShard *shard = &cache->shards[i];
+
+        for (int l = 0; l < kCacheListCount; ++l)
+        {
+            while (cacheDropGhost(cache, shard, l))
+            {
+            }
+        }
+
+        cacheFree(cache, shard->buckets);
+
+        pthread_mutex_destroy(&shard->mutex);
+    }
+
+    cacheFree(cache, cache);
+}
+
+int logStoreCacheGet(LogStoreCache    *cache,
+                     LogStoreID        id,
+                     LogStoreRevision  rev,
+                     void            **ioData,
+                     size_t            capacity,
+                     size_t           *outSize)
+{
+    CacheShard *shard = cacheShardOf(cache, id);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    CacheEntry *e = cacheFind(shard, id);
+
+    if (NULL == e || NULL == e->data || e->rev != rev)
+    {
+        shard->misses++;
+
+        pthread_mutex_unlock(&shard->mutex);
+
+        return kLogStoreNotFound;
+    }
+
+    int result = kLogStoreOK;
+
+    if (outSize)
+    {
+        *outSize = e->size;
+    }
+
+    if (NULL == *ioData)
+    {
+        *ioData = cacheAllocate(cache, e->size);
+
+        if (NULL == *ioData)
+        {
+            result = kLogStoreOutOfMemory;
+        }
+    }
+    else if (e->size > capacity)
+    {
+        result = kLogStoreBufferTooSmall;
+    }
+
+    if (kLogStoreOK == result)
+    {
+        memcpy(*ioData, e->data, e->size);
+    }
+
+    // A hit in T1 or T2 makes the entry the MRU of T2.
+
+    cacheListUnlink(shard, e);
+    cacheListPushMRU(shard, e, kCacheT2);
+
+    shard->hits++;
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    return result;
+}
+
+void logStoreCachePut(LogStoreCache    *cache,
+                      LogStoreID        id,
+                      LogStoreRevision  rev,
+                      const void       *data,
+                      size_t            size)
+{
+    CacheShard *shard = cacheShardOf(cache, id);
+
+    if (cacheWeight(size) > shard->capacity)
+    {
+        return;
+    }
+
+    void *copy = cacheAllocate(cache, size);
+
+    if (NULL == copy)
+    {
+        return;
+    }
+
+    memcpy(copy, data, size);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    CacheList *t1 = &shard->lists[kCacheT1];
+    CacheList *b1 = &shard->lists[kCacheB1];
+    CacheList *b2 = &shard->lists[kCacheB2];
+
+    CacheEntry *e = cacheFind(shard, id);
+
+    if (NULL != e && NULL != e->data)
+    {
+        // Some other revision is cached; forget it.
+
+        cacheRemove(cache, shard, e);
+
+        e = NULL;
+    }
+
+    if (NULL != e)
+    {
+        // A ghost hit.  Favor the list it was evicted from.
+
+        size_t delta = cacheWeight(size);
+
+        if (kCacheB1 == e->list)
+        {
+            if (b2->bytes > b1->bytes)
+            {
+                delta *= b2->bytes / b1->bytes;
+            }
+
+            shard->target = shard->target + delta < shard->capacity ?
+                            shard->target + delta : shard->capacity;
+        }
+        else
+        {
+            if (b1->bytes > b2->bytes)
+            {
+                delta *= b1->bytes / b2->bytes;
+            }
+
+            shard->target = shard->target > delta ? shard->target - delta : 0;
+        }
+
+        int hitB2 = kCacheB2 == e->list;
+
+        cacheListUnlink(shard, e);
+
+        cacheReplace(cache, shard, size, hitB2);
+
+        e->rev  = rev;
+        e->size = size;
+        e->data = copy;
+
+        cacheListPushMRU(shard, e, kCacheT2);
+    }
+    else
+    {
+        e = cacheAllocate(cache, sizeof(CacheEntry));
+
+        if (NULL == e)
+        {
+            pthread_mutex_unlock(&shard->mutex);
+
+            cacheFree(cache, copy);
+
+            return;
+        }
+
+        // Keep T1 + B1 within the capacity and everything within twice it.
+
+        size_t weight = cacheWeight(size);
+
+        while (t1->bytes + b1->bytes + weight > shard->capacity &&
+               cacheDropGhost(cache, shard, kCacheB1))
+        {
+        }
+
+        while (t1->bytes + weight > shard->capacity)
+        {
+            CacheEntry *lru = cacheListLRU(shard, kCacheT1);
+
+            cacheRemove(cache, shard, lru);
+
+            shard->evictions++;
+        }
+
+        size_t total = 0;
+
+        for (int l = 0; l < kCacheListCount; ++l)
+        {
+            total += shard->lists[l].bytes;
+        }
+
+        while (total + weight > 2 * shard->capacity &&
+               b2->bytes > 0)
+        {
+            total -= cacheWeight(cacheListLRU(shard, kCacheB2)->size);
+
+            cacheDropGhost(cache, shard, kCacheB2);
+        }
+
+        cacheReplace(cache, shard, size, 0);
+
+        e->id   = id;
+        e->rev  = rev;
+        e->size = size;
+        e->data = copy;
+
+        CacheEntry **bucket = cacheBucketOf(shard, id);
+
+        e->hashNext = *bucket;
+        *bucket     = e;
+
+        shard->entryCount++;
+
+        cacheListPushMRU(shard, e, kCacheT1);
+
+        if (shard->entryCount > shard->bucketCount)
+        {
+            cacheRehash(cache, shard);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void logStoreCacheInvalidate(LogStoreCache *cache, LogStoreID id)
+{
+    CacheShard *shard = cacheShardOf(cache, id);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    CacheEntry *e = cacheFind(shard, id);
+
+    if (NULL != e && NULL != e->data)
+    {
+        cacheRemove(cache, shard, e);
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void logStoreCacheGetStats(LogStoreCache *cache, LogStoreCacheStats *outStats)
+{
+    memset(outStats, 0, sizeof(LogStoreCacheStats));
+
+    for (int i = 0; i < cache->shardCount; ++i)
+    {
+        CacheShard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+
+        outStats->hits      += shard->hits;
+        outStats->misses    += shard->misses;
+        outStats->evictions += shard->evictions;
+        outStats->size      += shard->lists[kCacheT1].bytes +
+                               shard->lists[kCacheT2].bytes;
+
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
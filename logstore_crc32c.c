@@ -0,0 +1,292 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "logstore.h"
+#include "logstore_private.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define kCrc32cHardware 1
+#else
+#define kCrc32cHardware 0
+#endif
+
+// CRC32C (Castagnoli), as used for the checksums of records in the log.  On
+// x86-64 CPUs with SSE4.2 it is computed with the crc32 instruction, three
+// streams at a time to hide its latency; elsewhere, 8 bytes at a time with
+// tables (slicing-by-8).
+
+#define kCrc32cPolynomial 0x82f63b78U
+
+// Interleaved streams are combined by shifting the CRC of one over the length
+// of the next, which takes a table for each length used.
+
+#define kCrc32cLong  8192
+#define kCrc32cShort 256
+
+static uint32_t crc32cTable[8][256];
+
+#if kCrc32cHardware
+static uint32_t crc32cLongShift[4][256];
+static uint32_t crc32cShortShift[4][256];
+#endif
+
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+static int            crc32cHasHardware;
+
+static inline uint64_t crc32cLoad64(const unsigned char *p)
+{
+    uint64_t value;
+
+    memcpy(&value, p, sizeof(value));
+
+    return value;
+}
+
+static uint32_t crc32cSoftware(uint32_t crc, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    crc = ~crc;
+
+    while (size > 0 && ((uintptr_t)p & 7))
+    {
+        crc = crc32cTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        size--;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t word = crc32cLoad64(p) ^ crc;
+
+        crc = crc32cTable[7][word & 0xff] ^
+              crc32cTable[6][(word >> 8) & 0xff] ^
+              crc32cTable[5][(word >> 16) & 0xff] ^
+              crc32cTable[4][(word >> 24) & 0xff] ^
+              crc32cTable[3][(word >> 32) & 0xff] ^
+              crc32cTable[2][(word >> 40) & 0xff] ^
+              crc32cTable[1][(word >> 48) & 0xff] ^
+              crc32cTable[0][word >> 56];
+    }
+#endif
+
+    while (size > 0)
+    {
+        crc = crc32cTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        size--;
+    }
+
+    return ~crc;
+}
+
+#if kCrc32cHardware
+
+// Shifting a CRC over zeros is linear over GF(2), so the shift over a given
+// number of zero bytes is a 32x32 bit matrix.
+
+static uint32_t crc32cMatrixTimes(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+
+    for (; vector; vector >>= 1, matrix++)
+    {
+        if (vector & 1)
+        {
+            sum ^= *matrix;
+        }
+    }
+
+    return sum;
+}
+
+static void crc32cMatrixSquare(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; ++n)
+    {
+        square[n] = crc32cMatrixTimes(matrix, matrix[n]);
+    }
+}
+
+// Make the tables that shift a CRC over 'size' zero bytes, a power of two.
+
+static void crc32cMakeShift(uint32_t shift[4][256], size_t size)
+{
+    uint32_t even[32];
+    uint32_t odd[32];
+
+    // The operator for one zero bit, then for two and four.
+
+    odd[0] = kCrc32cPolynomial;
+
+    for (int n = 1; n < 32; ++n)
+    {
+        odd[n] = 1U << (n - 1);
+    }
+
+    crc32cMatrixSquare(even, odd);
+    crc32cMatrixSquare(odd, even);
+
+    // Square up to one zero byte, then to 'size' zero bytes.
+
+    const uint32_t *op = NULL;
+
+    for (;;)
+    {
+        crc32cMatrixSquare(even, odd);
+
+        size >>= 1;
+
+        if (0 == size)
+        {
+            op = even;
+
+            break;
+        }
+
+        crc32cMatrixSquare(odd, even);
+
+        size >>= 1;
+
+        if (0 == size)
+        {
+            op = odd;
+
+            break;
+        }
+    }
+
+    for (uint32_t n = 0; n < 256; ++n)
+    {
+        shift[0][n] = crc32cMatrixTimes(op, n);
+        shift[1][n] = crc32cMatrixTimes(op, n << 8);
+        shift[2][n] = crc32cMatrixTimes(op, n << 16);
+        shift[3][n] = crc32cMatrixTimes(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32cShift(uint32_t shift[4][256], uint32_t crc)
+{
+    return shift[0][crc & 0xff] ^
+           shift[1][(crc >> 8) & 0xff] ^
+           shift[2][(crc >> 16) & 0xff] ^
+           shift[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const void *data, size_t size)
+{
+    const unsigned char *p    = data;
+    uint64_t             crc0 = ~crc;
+
+    while (size > 0 && ((uintptr_t)p & 7))
+    {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        size--;
+    }
+
+    // Three streams of 'length' bytes each, combined at the end of each block.
+
+    static const size_t lengths[2] = { kCrc32cLong, kCrc32cShort };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        size_t length = lengths[i];
+
+        uint32_t (*shift)[256] = kCrc32cLong == length ?
+                                 crc32cLongShift : crc32cShortShift;
+
+        for (; size >= length * 3; size -= length * 3, p += length * 2)
+        {
+            uint64_t             crc1 = 0;
+            uint64_t             crc2 = 0;
+            const unsigned char *end  = p + length;
+
+            for (; p < end; p += 8)
+            {
+                crc0 = _mm_crc32_u64(crc0, crc32cLoad64(p));
+                crc1 = _mm_crc32_u64(crc1, crc32cLoad64(p + length));
+                crc2 = _mm_crc32_u64(crc2, crc32cLoad64(p + length * 2));
+            }
+
+            crc0 = crc32cShift(shift, crc0) ^ crc1;
+            crc0 = crc32cShift(shift, crc0) ^ crc2;
+        }
+    }
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        crc0 = _mm_crc32_u64(crc0, crc32cLoad64(p));
+    }
+
+    while (size > 0)
+    {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        size--;
+    }
+
+    return ~(uint32_t)crc0;
+}
+
+#endif
+
+static void crc32cInitialize(void)
+{
+    for (uint32_t n = 0; n < 256; ++n)
+    {
+        uint32_t crc = n;
+
+        for (int k = 0; k < 8; ++k)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ kCrc32cPolynomial : crc >> 1;
+        }
+
+        crc32cTable[0][n] = crc;
+    }
+
+    for (uint32_t n = 0; n < 256; ++n)
+    {
+        uint32_t crc = crc32cTable[0][n];
+
+        for (int k = 1; k < 8; ++k)
+        {
+            crc = crc32cTable[0][crc & 0xff] ^ (crc >> 8);
+
+            crc32cTable[k][n] = crc;
+        }
+    }
+
+#if kCrc32cHardware
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32cMakeShift(crc32cLongShift, kCrc32cLong);
+        crc32cMakeShift(crc32cShortShift, kCrc32cShort);
+
+        crc32cHasHardware = 1;
+    }
+#endif
+}
+
+uint32_t logStoreCrc32c(uint32_t crc, const void *data, size_t size)
+{
+    pthread_once(&crc32cOnce, crc32cInitialize);
+
+#if kCrc32cHardware
+    if (crc32cHasHardware)
+    {
+        return crc32cHardware(crc, data, size);
+    }
+#endif
+
+    return crc32cSoftware(crc, data, size);
+}
+
+uint32_t logStoreCrc32cSoftware(uint32_t crc, const void *data, size_t size)
+{
+    pthread_once(&crc32cOnce, crc32cInitialize);
+
+    return crc32cSoftware(crc, data, size);
+}
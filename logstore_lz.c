@@ -0,0 +1,281 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "logstore.h"
+#include "logstore_private.h"
+
+// A small LZ77 codec in the manner of LZ4, used to compress values in the
+// log (see kLogStoreOptionCompress).  A compressed block is a sequence of
+//
+//   token        high 4 bits: literal count, low 4 bits: match length - 4;
+//                15 in either means more length bytes follow
+//   [length]     literal count - 15, as bytes of 255 and a final byte < 255
+//   literals
+//   offset       2 bytes, little-endian, back from the current position
+//   [length]     match length - 4 - 15, as for the literal count
+//
+// The last sequence has only literals.  Matches are found with a single
+// hash table of recent positions; speed is favored over ratio.
+
+#define kLzHashBits     12
+#define kLzMinMatch     4
+#define kLzMaxOffset    65535
+#define kLzLastLiterals 5               // the last bytes are always literals
+#define kLzMinInput     12              // don't bother looking for matches
+
+static inline uint32_t lzLoad32(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+
+    return value;
+}
+
+static inline uint32_t lzHash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - kLzHashBits);
+}
+
+// Write a length of 15 or more: the part past 15 as bytes of 255 and a final
+// byte less than 255.
+
+static inline uint8_t *lzWriteLength(uint8_t *op, size_t length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        *op++ = 255;
+    }
+
+    *op++ = (uint8_t)length;
+
+    return op;
+}
+
+// Append a sequence.  Returns NULL if it does not fit.  An offset of 0 means
+// the sequence has no match.
+
+static uint8_t *lzWriteSequence(uint8_t       *op,
+                                uint8_t       *opEnd,
+                                const uint8_t *literals,
+                                size_t         literalLength,
+                                size_t         offset,
+                                size_t         matchLength)
+{
+    size_t worstCase = 1 + literalLength / 255 + 1 + literalLength +
+                       2 + matchLength / 255 + 1;
+
+    if (worstCase > (size_t)(opEnd - op))
+    {
+        return NULL;
+    }
+
+    uint8_t *token = op++;
+
+    *token = (literalLength < 15 ? literalLength : 15) << 4;
+
+    if (literalLength >= 15)
+    {
+        op = lzWriteLength(op, literalLength);
+    }
+
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (0 == offset)
+    {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    *token |= matchLength < 15 ? matchLength : 15;
+
+    if (matchLength >= 15)
+    {
+        op = lzWriteLength(op, matchLength);
+    }
+
+    return op;
+}
+
+size_t logStoreLzCompress(const void *source,
+                          size_t      sourceSize,
+                          void       *dest,
+                          size_t      destCapacity)
+{
+    const uint8_t *src    = source;
+    const uint8_t *ip     = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end    = src + sourceSize;
+    uint8_t       *op     = dest;
+    uint8_t       *opEnd  = op + destCapacity;
+
+    if (sourceSize >= kLzMinInput && sourceSize < UINT32_MAX)
+    {
+        uint32_t table[1 << kLzHashBits];
+
+        memset(table, 0, sizeof(table));
+
+        const uint8_t *matchLimit  = end - kLzLastLiterals;
+        const uint8_t *searchLimit = end - kLzMinInput;
+
+        while (ip < searchLimit)
+        {
+            uint32_t       sequence = lzLoad32(ip);
+            uint32_t       h        = lzHash(sequence);
+            const uint8_t *ref      = src + table[h];
+
+            table[h] = ip - src;
+
+            if (ref >= ip || ip - ref > kLzMaxOffset ||
+                lzLoad32(ref) != sequence)
+            {
+                // Skip ahead faster the longer nothing has matched.
+
+                ip += 1 + ((ip - anchor) >> 6);
+
+                continue;
+            }
+
+            const uint8_t *mp = ip + kLzMinMatch;
+            const uint8_t *rp = ref + kLzMinMatch;
+
+            while (mp < matchLimit && *mp == *rp)
+            {
+                mp++;
+                rp++;
+            }
+
+            op = lzWriteSequence(op, opEnd, anchor, ip - anchor,
+                                 ip - ref, mp - ip - kLzMinMatch);
+
+            if (NULL == op)
+            {
+                return 0;
+            }
+
+            ip     = mp;
+            anchor = ip;
+        }
+    }
+
+    op = lzWriteSequence(op, opEnd, anchor, end - anchor, 0, 0);
+
+    if (NULL == op)
+    {
+        return 0;
+    }
+
+    return op - (uint8_t *)dest;
+}
+
+// Read a length continued past 15.  Returns 0 if the input ends first.
+
+static inline int lzReadLength(const uint8_t **ip,
+                               const uint8_t  *ipEnd,
+                               size_t         *length)
+{
+    uint8_t b;
+
+    do
+    {
+        if (*ip >= ipEnd)
+        {
+            return 0;
+        }
+
+        b = *(*ip)++;
+
+        *length += b;
+    }
+    while (255 == b);
+
+    return 1;
+}
+
+int logStoreLzDecompress(const void *source,
+                         size_t      sourceSize,
+                         void       *dest,
+                         size_t      destSize)
+{
+    const uint8_t *ip    = source;
+    const uint8_t *ipEnd = ip + sourceSize;
+    uint8_t       *op    = dest;
+    uint8_t       *opEnd = op + destSize;
+
+    while (ip < ipEnd)
+    {
+        unsigned token  = *ip++;
+        size_t   length = token >> 4;
+
+        if (15 == length && !lzReadLength(&ip, ipEnd, &length))
+        {
+            return kLogStoreTampered;
+        }
+
+        if (length > (size_t)(ipEnd - ip) || length > (size_t)(opEnd - op))
+        {
+            return kLogStoreTampered;
+        }
+
+        memcpy(op, ip, length);
+
+        op += length;
+        ip += length;
+
+        if (ip == ipEnd)
+        {
+            break;
+        }
+
+        if (ipEnd - ip < 2)
+        {
+            return kLogStoreTampered;
+        }
+
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+
+        ip += 2;
+
+        if (0 == offset || offset > (size_t)(op - (uint8_t *)dest))
+        {
+            return kLogStoreTampered;
+        }
+
+        length = token & 15;
+
+        if (15 == length && !lzReadLength(&ip, ipEnd, &length))
+        {
+            return kLogStoreTampered;
+        }
+
+        length += kLzMinMatch;
+
+        if (length > (size_t)(opEnd - op))
+        {
+            return kLogStoreTampered;
+        }
+
+        const uint8_t *ref = op - offset;
+
+        if (offset >= length)
+        {
+            memcpy(op, ref, length);
+
+            op += length;
+        }
+        else
+        {
+            // The match overlaps what it produces (e.g. a run of a byte).
+
+            while (length-- > 0)
+            {
+                *op++ = *ref++;
+            }
+        }
+    }
+
+    return op == opEnd ? kLogStoreOK : kLogStoreTampered;
+}
@@ -1,24 +1,203 @@
 #ifndef LOGSTORE_PRIVATE_H
 #define LOGSTORE_PRIVATE_H
 
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "logstore.h"
+
 #ifdef __cplusplus
 extern "C" 
 {
 #endif
 
+// Index entries are striped over this many sequence numbers.  See
+// indexSeqWriteBegin.
+
+#define kIndexSeqStripes 64
+
+// The read cache (logstore_cache.c).  Values are cached by ID and revision;
+// a get that finds a different revision than the index names is a miss.
+
+typedef struct LogStoreCache LogStoreCache;
+
+LogStoreCache *logStoreCacheCreate(const LogStoreAllocator *allocator,
+                                   size_t                   capacity,
+                                   int                      shardCount);
+void logStoreCacheDestroy(LogStoreCache *cache);
+int  logStoreCacheGet(LogStoreCache    *cache,
+                      LogStoreID        id,
+                      LogStoreRevision  rev,
+                      void            **ioData,
+                      size_t            capacity,
+                      size_t           *outSize);
+void logStoreCachePut(LogStoreCache    *cache,
+                      LogStoreID        id,
+                      LogStoreRevision  rev,
+                      const void       *data,
+                      size_t            size);
+void logStoreCacheInvalidate(LogStoreCache *cache, LogStoreID id);
+void logStoreCacheGetStats(LogStoreCache *cache, LogStoreCacheStats *outStats);
+
+// The codec for compressed values (logstore_lz.c).  Compressing returns the
+// size of the compressed data, or 0 if it does not fit in 'destCapacity'.
+// Decompressing must produce exactly 'destSize' bytes, or the data is
+// reported as tampered.
+
+size_t logStoreLzCompress(const void *source,
+                          size_t      sourceSize,
+                          void       *dest,
+                          size_t      destCapacity);
+int    logStoreLzDecompress(const void *source,
+                            size_t      sourceSize,
+                            void       *dest,
+                            size_t      destSize);
+
+// CRC32C (logstore_crc32c.c).  'crc' is 0 or the CRC of preceding data.  The
+// software version is what is used when the CPU lacks SSE4.2.
+
+uint32_t logStoreCrc32c(uint32_t crc, const void *data, size_t size);
+uint32_t logStoreCrc32cSoftware(uint32_t crc, const void *data, size_t size);
+
+// The engine behind the asynchronous calls (logstore_async.c).  A work item
+// with a 'fileNo' of -1 is run on one of the engine's threads; any other is a
+// read of its iovecs from its offset, done with io_uring where there is one
+// (and 'useRing' was asked for) or else on a thread.  Either way, 'done' is
+// called on a thread of the engine's, with the number of bytes read.
+// Destroying the engine waits for the work submitted.
+
+typedef struct LogStoreAsync LogStoreAsync;
+typedef struct LogStoreAsyncWork LogStoreAsyncWork;
+
+struct LogStoreAsyncWork
+{
+    LogStoreAsyncWork *next;                    // in the engine's queue
+    void             (*done)(LogStoreAsyncWork *work, size_t bytesRead);
+    int                fileNo;
+    struct iovec      *iov;
+    int                iovCount;
+    off_t              offset;
+};
+
+LogStoreAsync *logStoreAsyncCreate(const LogStoreAllocator *allocator,
+                                   int                      threadCount,
+                                   int                      useRing);
+void logStoreAsyncDestroy(LogStoreAsync *async);
+void logStoreAsyncSubmit(LogStoreAsync *async, LogStoreAsyncWork *work);
+int  logStoreAsyncUsesRing(LogStoreAsync *async);
+
+// A read-only mapping of (a prefix of) the log file.  The store holds a
+// reference to the current mapping and every view holds one to the mapping it
+// points into.
+
+struct LogFileMapping
+{
+    char           *base;
+    size_t          size;
+    int             logFileNo;                  // the log file mapped
+    unsigned        refCount;
+};
+
+// The descriptor of a log file, closed once nothing refers to it.  The store
+// holds a reference to that of its current log, and an asynchronous get holds
+// one to the log it reads while the read is in flight (see LogStoreGetAsync).
+
+struct LogFileHandle
+{
+    int             logFileNo;
+    unsigned        refCount;
+};
+
+// A snapshot of a store's index (see LogStoreSnapshotOpen).  Entries are
+// saved a page at a time, as they were when the snapshot was taken, before
+// they are first changed; pages saved at once for several snapshots are
+// shared.  A snapshot of a sharded store is one snapshot per shard.
+
+typedef struct LogStoreSnapshotPage LogStoreSnapshotPage;
+
+struct LogStoreSnapshot
+{
+    LogStore        store;
+    LogStoreSnapshot older;                     // the store's snapshots
+    LogStoreSnapshot newer;
+    uint64_t        indexFileCount;             // IDs made when taken
+    off_t           logFileSize;                // log when taken
+
+    uint64_t       *pageKeys;                   // page number + 1, or 0
+    LogStoreSnapshotPage **pages;               // saved entries
+    size_t          pageCount;
+    size_t          pageCapacity;               // a power of 2
+
+    LogStoreSnapshot *shards;
+    int             shardCount;
+};
+
 struct LogStore 
 {
     int             logFileNo;
-    off_t           logFileSize;
+    off_t           logFileSize;                // written to the log file
+    off_t           logFileAllocated;           // size of the file itself
+    size_t          logFilePreallocate;         // bytes at a time, or 0
+    char           *logFilePath;
+    char           *appendBuffer;               // appended after it, or NULL
+    char           *appendBufferMemory;         // allocated for it
+    char           *appendBufferBlock;          // see kLogStoreOptionDirect
+    size_t          appendBufferSize;
+    size_t          appendBufferCapacity;
+    struct timespec appendBufferSince;          // when first appended to
+    unsigned        flushInterval;              // milliseconds, or 0
+    int             options;                    // kLogStoreOption...
+    LogStoreAllocator allocator;
+    struct LogFileMapping *logFileMapping;      // see LogStoreGetView
+    struct LogFileHandle *logFileHandle;        // of logFileNo
+    LogStoreCache  *cache;                      // NULL if not caching
+    LogStoreAsync  *async;                      // NULL without async calls
+    size_t          compressThreshold;          // see kLogStoreOptionCompress
+    size_t          inlineSize;                 // see IndexEntry
+    int             verify;                     // kLogStoreVerify...
+    int             durability;                 // kLogStoreDurability...
+
+    LogStoreSnapshot snapshots;                 // newest first
+    LogStore       *shards;                     // see LogStoreOpenSharded
+    int             shardCount;
+    unsigned        nextShard;                  // of the next ID made
 
     int             indexFileNo;
-    int             indexFileCapacity;
-    int             indexFileCount;
+    size_t          indexFileEntrySize;         // see IndexEntry
+    uint64_t        indexFileCapacity;
+    uint64_t        indexFileCount;             // IDs made
+    uint64_t        indexFileReserved;          // IDs the header counts
     int             indexFileGrowthCount;
+    uint64_t        indexFileGrowAt;            // count that wakes the grower
     void           *indexFileMapping;
     size_t          indexFileMappingSize;
+    size_t          indexFileAddressSpace;      // reserved for it, or 0
+    off_t           indexFileCheckpoint;        // log indexed and on disk
+    uint64_t        indexFileWindowFrom;        // IDs written since open, as
+    uint64_t        indexFileWindowTo;          // the header has them
+    size_t          indexFileDirtyFrom;         // entries written since the
+    size_t          indexFileDirtyTo;           // last sync (none if 0)
+    int             indexFileHeaderDirty;       // and the header, if set
 
     pthread_mutex_t mutex;
+    pthread_mutex_t compactMutex;               // one compaction at a time
+    pthread_mutex_t appendMutex;                // the append buffer, for gets
+
+    uint64_t        writeSequence;              // bumped by every change
+    uint64_t        syncedSequence;             // changes known to be on disk
+    uint64_t        syncedFullSequence;         // and their metadata too
+    int             syncInProgress;             // a flush is being done
+    pthread_cond_t  syncCond;                   // signaled when it is done
+
+    pthread_t       growThread;                 // grows the index ahead
+    pthread_cond_t  growCond;                   // wakes it
+    int             growStop;
+
+    unsigned        epoch;                      // see epochEnter
+    unsigned        epochReaders[2];
+    unsigned        indexSeq[kIndexSeqStripes];
 };
 
 #ifdef __cplusplus
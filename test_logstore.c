@@ -3,9 +3,12 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h> 
+#include <sys/wait.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
 
 #include "logstore_private.h"
 #include "logstore.h"
@@ -67,7 +70,7 @@ void testPut()
     }
     struct stat lst;
     assert(fstat(s->logFileNo, &lst) != -1);
-    assert(lst.st_size == kEntryCount * (sizeof(uint32_t)*2 + sizeof(int)));
+    assert(lst.st_size == kEntryCount * (sizeof(uint32_t)*4 + sizeof(int)));
     assert(kLogStoreOK == LogStoreClose(&s));
 }
 
@@ -77,7 +80,7 @@ void testOpenExistingNonEmptyLog()
     assert(kLogStoreOK == LogStoreOpen(&s, "log"));
     assert(s->indexFileNo > 2); // [0,2] stdin/out/err
     assert(s->logFileNo > 2);
-    assert(s->logFileSize == kEntryCount * (sizeof(uint32_t)*2 + sizeof(int)));
+    assert(s->logFileSize == kEntryCount * (sizeof(uint32_t)*4 + sizeof(int)));
     assert(s->indexFileCount == kEntryCount);
     assert(s->indexFileCapacity >= kEntryCount);
     assert(s->indexFileMapping != NULL);
@@ -151,6 +154,2691 @@ void testRemove()
     assert(kLogStoreOK == LogStoreClose(&s));
 }
 
+// Supersede half of the entries then compact.  Only the latest revision of
+// each entry and the delete record for entry 0 (which is wide) should remain
+// in the log.
+
+void testCompact() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    for (int i=1; i<kEntryCount/2; ++i) 
+    {
+        assert(kLogStoreOK == LogStorePut(s, i, &i, sizeof(i), 1));
+    }
+
+    off_t sizeBefore = s->logFileSize;
+    off_t sizeAfter = (kEntryCount - 1) * (sizeof(uint32_t)*4 + sizeof(int)) 
+                    + sizeof(uint32_t)*6;
+
+    uint64_t reclaimed = 0;
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, &reclaimed));
+    assert(s->logFileSize == sizeAfter);
+    assert(reclaimed == sizeBefore - sizeAfter);
+
+    struct stat lst;
+    assert(fstat(s->logFileNo, &lst) != -1);
+    assert(lst.st_size == sizeAfter);
+
+    for (int i=1; i<kEntryCount; ++i) 
+    {
+        void *data = NULL;
+        size_t size = 0;
+        LogStoreRevision rev = 0;
+        assert(kLogStoreOK == LogStoreGet(s, i, &data, &size, &rev));
+        assert(size == sizeof(int));
+        assert(*(int *)data == i);
+        assert(rev == (i < kEntryCount/2 ? 2 : 1));
+        free(data);
+    }
+
+    void *data = NULL;
+    assert(kLogStoreNotFound == LogStoreGet(s, 0, &data, NULL, NULL));
+
+    // The compacted log keeps accepting puts.
+
+    int value = -1;
+    assert(kLogStoreOK == LogStorePut(s, 1, &value, sizeof(value), 2));
+    assert(kLogStoreOK == LogStoreGet(s, 1, &data, NULL, NULL));
+    assert(*(int *)data == value);
+    free(data);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+#define kSyncThreadCount 8
+
+static void *putAndSyncThread(void *arg)
+{
+    LogStore s = arg;
+    for (int i=0; i<kEntryCount/kSyncThreadCount; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, &id, sizeof(id), 0));
+        assert(kLogStoreOK == LogStoreSync(s));
+    }
+    return NULL;
+}
+
+// Threads that each sync after every put share flushes; once they are all
+// done, every write has been flushed.
+
+void testGroupCommit() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreID first = s->indexFileCount;
+
+    pthread_t threads[kSyncThreadCount];
+    for (int i=0; i<kSyncThreadCount; ++i) 
+    {
+        assert(0 == pthread_create(&threads[i], NULL, putAndSyncThread, s));
+    }
+    for (int i=0; i<kSyncThreadCount; ++i) 
+    {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    assert(!s->syncInProgress);
+    assert(s->syncedSequence == s->writeSequence);
+
+    for (LogStoreID id=first; id<s->indexFileCount; ++id) 
+    {
+        void *data = NULL;
+        assert(kLogStoreOK == LogStoreGet(s, id, &data, NULL, NULL));
+        assert(*(LogStoreID *)data == id);
+        free(data);
+    }
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+#define kGetThreadCount 4
+
+static volatile int stopGets = 0;
+
+static void *getThread(void *arg)
+{
+    LogStore s = arg;
+    while (!stopGets) 
+    {
+        for (int i=2; i<kEntryCount; ++i) 
+        {
+            void *data = NULL;
+            size_t size = 0;
+            assert(kLogStoreOK == LogStoreGet(s, i, &data, &size, NULL));
+            assert(size == sizeof(int));
+            assert(*(int *)data == i);
+            free(data);
+        }
+    }
+    return NULL;
+}
+
+// Gets run without the lock while the index is grown and remapped and while
+// the log is compacted and swapped.
+
+void testConcurrentGets() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    stopGets = 0;
+
+    pthread_t threads[kGetThreadCount];
+    for (int i=0; i<kGetThreadCount; ++i) 
+    {
+        assert(0 == pthread_create(&threads[i], NULL, getThread, s));
+    }
+
+    int growths = s->indexFileGrowthCount;
+    while (s->indexFileGrowthCount == growths) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+    }
+
+    for (int i=2; i<kEntryCount; i += 2) 
+    {
+        LogStoreRevision rev;
+        void *data = NULL;
+        assert(kLogStoreOK == LogStoreGet(s, i, &data, NULL, &rev));
+        assert(kLogStoreOK == LogStorePut(s, i, data, sizeof(int), rev));
+        free(data);
+    }
+
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+
+    stopGets = 1;
+    for (int i=0; i<kGetThreadCount; ++i) 
+    {
+        assert(0 == pthread_join(threads[i], NULL));
+    }
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Put more entries than fit in one write, including a second put of an ID in
+// the batch, a revision conflict, and a bad entry.
+
+#define kPutManyCount 3000
+
+void testPutMany() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    static LogStorePutEntry entries[kPutManyCount];
+    static int values[kPutManyCount];
+    static int results[kPutManyCount];
+
+    for (int i=0; i<kPutManyCount; ++i) 
+    {
+        values[i] = i;
+        assert(kLogStoreOK == LogStoreMakeID(s, &entries[i].id));
+        entries[i].data = &values[i];
+        entries[i].size = sizeof(int);
+        entries[i].rev = 0;
+    }
+
+    entries[10].id = entries[5].id;     // second put of the same ID
+    entries[10].rev = 1;
+    entries[20].rev = 7;                // conflict
+    entries[30].size = 0;               // bad
+
+    off_t sizeBefore = s->logFileSize;
+
+    assert(kLogStoreRevisionConflict == 
+           LogStorePutMany(s, entries, kPutManyCount, results));
+
+    for (int i=0; i<kPutManyCount; ++i) 
+    {
+        int expected = kLogStoreOK;
+        if (i == 20) expected = kLogStoreRevisionConflict;
+        if (i == 30) expected = kLogStoreInvalidParameter;
+        assert(results[i] == expected);
+    }
+
+    assert(s->logFileSize == sizeBefore + 
+           (kPutManyCount - 2) * (sizeof(uint32_t)*4 + sizeof(int)));
+
+    for (int i=0; i<kPutManyCount; ++i) 
+    {
+        if (i == 5 || i == 20 || i == 30) continue;
+        void *data = NULL;
+        LogStoreRevision rev;
+        assert(kLogStoreOK == LogStoreGet(s, entries[i].id, &data, NULL, &rev));
+        assert(*(int *)data == i);
+        assert(rev == (i == 10 ? 2 : 1));
+        free(data);
+    }
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Get entries in an order unrelated to their order in the log, including a
+// missing entry and the same entry twice.
+
+void testGetMany() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreID ids[kEntryCount];
+    void *data[kEntryCount];
+    size_t sizes[kEntryCount];
+    LogStoreRevision revs[kEntryCount];
+    int results[kEntryCount];
+
+    for (int i=0; i<kEntryCount; ++i) 
+    {
+        ids[i] = (i * 7919) % kEntryCount;
+        data[i] = NULL;
+    }
+    ids[1] = ids[2];
+
+    assert(kLogStoreNotFound == LogStoreGetMany(s, ids, kEntryCount, data, 
+                                                sizes, revs, results));
+
+    for (int i=0; i<kEntryCount; ++i) 
+    {
+        LogStoreID id = ids[i];
+        if (id == 0) 
+        {
+            assert(results[i] == kLogStoreNotFound);
+            assert(data[i] == NULL);
+            continue;
+        }
+
+        void *expected = NULL;
+        size_t size;
+        LogStoreRevision rev;
+        assert(kLogStoreOK == LogStoreGet(s, id, &expected, &size, &rev));
+        assert(results[i] == kLogStoreOK);
+        assert(sizes[i] == size);
+        assert(revs[i] == rev);
+        assert(0 == memcmp(data[i], expected, size));
+        free(expected);
+        free(data[i]);
+    }
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Views point into a mapping of the log and stay valid after the log they
+// point into is compacted away.  Without kLogStoreOptionMapLog, views own a
+// copy of the value.
+
+void testGetView() 
+{
+    for (int mapped=0; mapped<2; ++mapped) 
+    {
+        LogStoreOptions options = { mapped ? kLogStoreOptionMapLog : 0 };
+        LogStore s = NULL;
+        assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+        LogStoreView views[kEntryCount];
+        const void *data[kEntryCount];
+
+        for (int i=2; i<kEntryCount; ++i) 
+        {
+            size_t size = 0;
+            assert(kLogStoreOK == LogStoreGetView(s, i, &data[i], &size, 
+                                                  &views[i]));
+            assert(size == sizeof(int));
+            assert(*(const int *)data[i] == i);
+            assert((views[i].mapping != NULL) == mapped);
+        }
+
+        LogStoreView view;
+        const void *removed = NULL;
+        assert(kLogStoreNotFound == LogStoreGetView(s, 0, &removed, NULL, 
+                                                    &view));
+
+        for (int i=2; i<kEntryCount; i += 2) 
+        {
+            LogStoreRevision rev;
+            void *value = NULL;
+            assert(kLogStoreOK == LogStoreGet(s, i, &value, NULL, &rev));
+            assert(kLogStoreOK == LogStorePut(s, i, value, sizeof(int), rev));
+            free(value);
+        }
+
+        assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+
+        for (int i=2; i<kEntryCount; ++i) 
+        {
+            assert(*(const int *)data[i] == i);
+            assert(kLogStoreOK == LogStoreReleaseView(s, &views[i]));
+        }
+
+        // A view after the log was swapped maps the new log.
+
+        assert(kLogStoreOK == LogStoreGetView(s, 2, &data[2], NULL, &view));
+        assert(*(const int *)data[2] == 2);
+        assert(kLogStoreOK == LogStoreReleaseView(s, &view));
+
+        assert(kLogStoreOK == LogStoreClose(&s));
+        assert(s == NULL);
+    }
+}
+
+// Values are read into a caller's buffer without allocating; a buffer that is
+// too small reports the size required.
+
+void testGetInto() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    int value = 0;
+    size_t size = 0;
+    LogStoreRevision rev = 0;
+    assert(kLogStoreOK == LogStoreGetInto(s, 3, &value, sizeof(value), 
+                                          &size, &rev));
+    assert(value == 3);
+    assert(size == sizeof(int));
+    assert(rev >= 1);
+
+    char small = 0;
+    size = 0;
+    assert(kLogStoreBufferTooSmall == LogStoreGetInto(s, 3, &small, 1, 
+                                                      &size, NULL));
+    assert(size == sizeof(int));
+
+    assert(kLogStoreNotFound == LogStoreGetInto(s, 0, &value, sizeof(value), 
+                                                NULL, NULL));
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+typedef struct CountingAllocator 
+{
+    int allocations;
+    int outstanding;
+} CountingAllocator;
+
+static void *countingAllocate(void *context, size_t size)
+{
+    CountingAllocator *a = context;
+    a->allocations++;
+    a->outstanding++;
+    return malloc(size);
+}
+
+static void countingDeallocate(void *context, void *pointer)
+{
+    CountingAllocator *a = context;
+    a->outstanding--;
+    free(pointer);
+}
+
+// Everything the store allocates, including values, comes from the allocator
+// given at open time.
+
+// Stats come from the index alone.  The revision of a value that does not
+// exist is the one to put it with.
+
+void testStat() 
+{
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    int exists = 0;
+    size_t size = 0;
+    LogStoreRevision rev = 0;
+    assert(kLogStoreOK == LogStoreStat(s, 3, &exists, &size, &rev));
+    assert(exists && size == sizeof(int) && rev >= 1);
+    assert(kLogStoreOK == LogStoreStat(s, 3, NULL, NULL, NULL));
+    LogStoreRevision rev3 = rev;
+
+    assert(kLogStoreOK == LogStoreStat(s, 0, &exists, &size, &rev));
+    assert(!exists && size == 0 && rev == (LogStoreRevision) -1);
+
+    LogStoreID ids[3] = { 3, 0, s->indexFileCount + 5 };
+    int existing[3];
+    size_t sizes[3];
+    LogStoreRevision revs[3];
+    assert(kLogStoreOK == LogStoreStatMany(s, ids, 3, existing, sizes, revs));
+    assert(existing[0] && sizes[0] == sizeof(int) && revs[0] == rev3);
+    assert(!existing[1] && revs[1] == (LogStoreRevision) -1);
+    assert(!existing[2] && sizes[2] == 0 && revs[2] == 0);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+void testAllocator() 
+{
+    CountingAllocator counts = { 0, 0 };
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.allocator.allocate = countingAllocate;
+    options.allocator.deallocate = countingDeallocate;
+    options.allocator.context = &counts;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+    assert(counts.allocations > 0);
+
+    int before = counts.allocations;
+    void *data = NULL;
+    assert(kLogStoreOK == LogStoreGet(s, 3, &data, NULL, NULL));
+    assert(counts.allocations == before + 1);
+    countingDeallocate(&counts, data);
+
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+    assert(counts.outstanding == 0);
+}
+
+void testCache() 
+{
+    CountingAllocator counts = { 0, 0 };
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.allocator.allocate = countingAllocate;
+    options.allocator.deallocate = countingDeallocate;
+    options.allocator.context = &counts;
+    options.cacheSize = 2048;
+    options.cacheShards = 1;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    LogStoreCacheStats stats;
+    assert(kLogStoreOK == LogStoreGetCacheStats(s, &stats));
+    assert(stats.hits == 0 && stats.misses == 0 && stats.size == 0);
+
+    // A miss, then a hit.
+
+    int value = 0;
+    LogStoreRevision rev = 0;
+    for (int i = 0; i < 2; ++i) 
+    {
+        assert(kLogStoreOK == LogStoreGetInto(s, 3, &value, sizeof(value), 
+                                              NULL, &rev));
+        assert(value == 3);
+    }
+
+    assert(kLogStoreOK == LogStoreGetCacheStats(s, &stats));
+    assert(stats.hits == 1 && stats.misses == 1 && stats.size > 0);
+
+    // Puts drop what is cached.
+
+    value = 33;
+    assert(kLogStoreOK == LogStorePut(s, 3, &value, sizeof(value), rev));
+    value = 0;
+    assert(kLogStoreOK == LogStoreGetInto(s, 3, &value, sizeof(value), 
+                                          NULL, &rev));
+    assert(value == 33);
+    value = 3;
+    assert(kLogStoreOK == LogStorePut(s, 3, &value, sizeof(value), rev));
+
+    // A scan of values read once does not evict values read twice.
+
+    for (int i = 0; i < 2; ++i) 
+        for (LogStoreID id = 10; id < 15; ++id) 
+            assert(kLogStoreOK == LogStoreGetInto(s, id, &value, 
+                                                  sizeof(value), NULL, NULL));
+
+    for (LogStoreID id = 100; id < 600; ++id) 
+    {
+        void *data = NULL;
+        assert(kLogStoreOK == LogStoreGet(s, id, &data, NULL, NULL));
+        assert(*(int *)data == id);
+        countingDeallocate(&counts, data);
+    }
+
+    assert(kLogStoreOK == LogStoreGetCacheStats(s, &stats));
+    assert(stats.evictions > 0 && stats.size <= options.cacheSize);
+
+    uint64_t hits = stats.hits;
+
+    LogStoreID ids[5] = { 10, 11, 12, 13, 14 };
+    void *data[5] = { NULL, NULL, NULL, NULL, NULL };
+    int results[5];
+    assert(kLogStoreOK == LogStoreGetMany(s, ids, 5, data, NULL, NULL, 
+                                          results));
+    for (int i = 0; i < 5; ++i) 
+    {
+        assert(*(int *)data[i] == ids[i]);
+        countingDeallocate(&counts, data[i]);
+    }
+
+    assert(kLogStoreOK == LogStoreGetCacheStats(s, &stats));
+    assert(stats.hits == hits + 5);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+    assert(counts.outstanding == 0);
+}
+
+// Values that compress well are stored compressed and read back intact by
+// every kind of get, even by a store opened without compression.
+
+#define kCompressibleSize 4096
+
+static const char kCompressibleText[] = 
+    "{\"name\": \"logstore\", \"count\": 0}";
+
+static void makeCompressibleValue(char *value, int seed) 
+{
+    for (int i=0; i<kCompressibleSize; ++i) 
+        value[i] = kCompressibleText[i % (sizeof(kCompressibleText) - 1)] + 
+                   (i % 97 == 0 ? seed : 0);
+}
+
+void testCompression() 
+{
+    // The codec round-trips runs, text, and noise.
+
+    char raw[kCompressibleSize], packed[kCompressibleSize * 2];
+    char unpacked[kCompressibleSize];
+    for (int kind=0; kind<3; ++kind) 
+    {
+        for (size_t size=0; size<=kCompressibleSize; size = size * 2 + 1) 
+        {
+            for (size_t i=0; i<size; ++i) 
+                raw[i] = kind == 0 ? 'x' : kind == 1 ? "abcab"[i % 5] : rand();
+            size_t packedSize = logStoreLzCompress(raw, size, packed, 
+                                                   sizeof(packed));
+            assert(packedSize > 0);
+            assert(kLogStoreOK == logStoreLzDecompress(packed, packedSize, 
+                                                       unpacked, size));
+            assert(0 == memcmp(raw, unpacked, size));
+            if (size > 1)
+                assert(kLogStoreTampered == 
+                       logStoreLzDecompress(packed, packedSize, unpacked, 
+                                            size - 1));
+        }
+    }
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.flags = kLogStoreOptionCompress | kLogStoreOptionMapLog;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    LogStoreID ids[3];
+    for (int i=0; i<3; ++i) 
+        assert(kLogStoreOK == LogStoreMakeID(s, &ids[i]));
+
+    char value[kCompressibleSize];
+    makeCompressibleValue(value, 1);
+    off_t before = s->logFileSize;
+    assert(kLogStoreOK == LogStorePut(s, ids[0], value, sizeof(value), 0));
+    assert(s->logFileSize - before < sizeof(value) / 2);
+
+    // Below the threshold, and not worth compressing.
+
+    int small = 42;
+    before = s->logFileSize;
+    assert(kLogStoreOK == LogStorePut(s, ids[1], &small, sizeof(small), 0));
+    assert(s->logFileSize - before == 16 + sizeof(small));
+
+    char noise[1024];
+    for (int i=0; i<sizeof(noise); ++i) 
+        noise[i] = rand();
+    before = s->logFileSize;
+    LogStorePutEntry entries[2] = 
+    {
+        { ids[2], noise, sizeof(noise), 0 },
+        { ids[0], value, sizeof(value), 1 }
+    };
+    int results[3];
+    assert(kLogStoreOK == LogStorePutMany(s, entries, 2, results));
+    assert(s->logFileSize - before < 32 + sizeof(noise) + sizeof(value) / 2);
+
+    for (int reopen=0; reopen<2; ++reopen) 
+    {
+        void *data = NULL;
+        size_t size = 0;
+        assert(kLogStoreOK == LogStoreGet(s, ids[0], &data, &size, NULL));
+        assert(size == sizeof(value) && 0 == memcmp(data, value, size));
+        free(data);
+
+        size = 0;
+        assert(kLogStoreBufferTooSmall == 
+               LogStoreGetInto(s, ids[0], noise, 16, &size, NULL));
+        assert(size == sizeof(value));
+
+        void *many[3] = { NULL, NULL, NULL };
+        size_t sizes[3];
+        assert(kLogStoreOK == LogStoreGetMany(s, ids, 3, many, sizes, NULL, 
+                                              results));
+        assert(sizes[0] == sizeof(value) && 0 == memcmp(many[0], value, 
+                                                        sizeof(value)));
+        assert(sizes[1] == sizeof(small) && *(int *)many[1] == small);
+        assert(sizes[2] == sizeof(noise) && 0 == memcmp(many[2], noise, 
+                                                        sizeof(noise)));
+        for (int i=0; i<3; ++i) 
+            free(many[i]);
+
+        const void *view = NULL;
+        LogStoreView handle;
+        assert(kLogStoreOK == LogStoreGetView(s, ids[0], &view, &size, 
+                                              &handle));
+        assert(size == sizeof(value) && 0 == memcmp(view, value, size));
+        assert(kLogStoreOK == LogStoreReleaseView(s, &handle));
+
+        assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+        assert(kLogStoreOK == LogStoreClose(&s));
+        assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    }
+
+    // A value that decodes to other than the size the index gives is 
+    // tampered with, however it is read.
+
+    off_t sizeAt = 64 + ids[0] * s->indexFileEntrySize + 8;
+    assert(kLogStoreOK == LogStoreClose(&s));
+    int fd = open("log-index", O_RDWR);
+    assert(fd != -1);
+    uint64_t indexedSize = sizeof(value) + 1;
+    assert(sizeof(indexedSize) == pwrite(fd, &indexedSize, 
+                                         sizeof(indexedSize), sizeAt));
+    close(fd);
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    void *data = NULL;
+    assert(kLogStoreTampered == LogStoreGet(s, ids[0], &data, NULL, NULL));
+    void *many[3] = { NULL, NULL, NULL };
+    assert(kLogStoreTampered == LogStoreGetMany(s, ids, 3, many, NULL, NULL, 
+                                                results));
+    assert(results[0] == kLogStoreTampered && NULL == many[0]);
+    assert(results[1] == kLogStoreOK && results[2] == kLogStoreOK);
+    for (int i=0; i<3; ++i) 
+        free(many[i]);
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Records carry a CRC32C of their payload that gets check, as configured.
+
+void testChecksums() 
+{
+    assert(0xe3069283 == logStoreCrc32c(0, "123456789", 9));
+    assert(0xe3069283 == logStoreCrc32cSoftware(0, "123456789", 9));
+
+    static char buffer[3 * 8192 * 2 + 64];
+    for (int i=0; i<sizeof(buffer); ++i) 
+        buffer[i] = rand();
+    for (size_t size=0; size<sizeof(buffer) - 8; size = size * 3 + 1) 
+    {
+        for (int align=0; align<8; ++align) 
+        {
+            uint32_t crc = logStoreCrc32c(0, buffer + align, size);
+            assert(crc == logStoreCrc32cSoftware(0, buffer + align, size));
+            assert(crc == logStoreCrc32c(logStoreCrc32c(0, buffer + align, 
+                                                        size / 2), 
+                                         buffer + align + size / 2, 
+                                         size - size / 2));
+        }
+    }
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    LogStoreID id;
+    assert(kLogStoreOK == LogStoreMakeID(s, &id));
+    int value = 7;
+    off_t offset = s->logFileSize;
+    assert(kLogStoreOK == LogStorePut(s, id, &value, sizeof(value), 0));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // Flip a bit of the value on disk.
+
+    int fd = open("log", O_RDWR);
+    assert(fd != -1);
+    int corrupt = value ^ 0x100;
+    assert(sizeof(corrupt) == pwrite(fd, &corrupt, sizeof(corrupt), 
+                                     offset + 16));
+
+    LogStoreOptions options;
+    for (int verify=kLogStoreVerifyAlways; verify<=kLogStoreVerifyNever; 
+         verify += kLogStoreVerifyNever - kLogStoreVerifyAlways) 
+    {
+        memset(&options, 0, sizeof(options));
+        options.verify = verify;
+        options.flags = kLogStoreOptionMapLog;
+        assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+        int expected = kLogStoreVerifyNever == verify ? kLogStoreOK : 
+                       kLogStoreTampered;
+        int got = 0;
+        assert(expected == LogStoreGetInto(s, id, &got, sizeof(got), 
+                                           NULL, NULL));
+
+        void *data[1] = { NULL };
+        int results[1];
+        assert(expected == LogStoreGetMany(s, &id, 1, data, NULL, NULL, 
+                                           results));
+        free(data[0]);
+
+        const void *view = NULL;
+        LogStoreView handle;
+        if (expected == kLogStoreOK) 
+        {
+            assert(kLogStoreOK == LogStoreGetView(s, id, &view, NULL, 
+                                                  &handle));
+            int viewed = 0;
+            memcpy(&viewed, view, sizeof(viewed));
+            assert(viewed == corrupt);
+            assert(kLogStoreOK == LogStoreReleaseView(s, &handle));
+        }
+        else 
+        {
+            assert(expected == LogStoreGetView(s, id, &view, NULL, &handle));
+        }
+
+        assert(kLogStoreOK == LogStoreClose(&s));
+    }
+
+    // Sampling checks some gets but not all.
+
+    memset(&options, 0, sizeof(options));
+    options.verify = kLogStoreVerifySampled;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+    int tampered = 0;
+    for (int i=0; i<32; ++i) 
+    {
+        int got = 0;
+        if (kLogStoreTampered == LogStoreGetInto(s, id, &got, sizeof(got), 
+                                                 NULL, NULL))
+            tampered++;
+    }
+    assert(tampered > 0 && tampered < 32);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    assert(sizeof(value) == pwrite(fd, &value, sizeof(value), offset + 16));
+    close(fd);
+
+    // Records may still be appended without checksums.
+
+    memset(&options, 0, sizeof(options));
+    options.flags = kLogStoreOptionNoChecksums;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+    offset = s->logFileSize;
+    assert(kLogStoreOK == LogStorePut(s, id, &value, sizeof(value), 1));
+    assert(s->logFileSize == offset + 12 + sizeof(value));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    int got = 0;
+    assert(kLogStoreOK == LogStoreGetInto(s, id, &got, sizeof(got), 
+                                          NULL, NULL));
+    assert(got == value);
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Every entry has its value and revision after the child of testRecovery put
+// them: odd entries once, even ones twice, and entry 1 removed.  The IDs the
+// child reserved count as made.
+
+void checkRecovered(LogStore s) 
+{
+    assert(s->indexFileCount >= kEntryCount);
+    for (int i=0; i<kEntryCount; ++i) 
+    {
+        void *data = NULL;
+        size_t size = 0;
+        LogStoreRevision rev = 0;
+        if (1 == i) 
+        {
+            assert(kLogStoreNotFound == LogStoreGet(s, i, &data, &size, &rev));
+            continue;
+        }
+        assert(kLogStoreOK == LogStoreGet(s, i, &data, &size, &rev));
+        assert(size == sizeof(int));
+        assert(*(int *)data == (i % 2 ? i : -i));
+        assert(rev == (i % 2 ? 1 : 2));
+        free(data);
+    }
+}
+
+// The log past the last sync is replayed into the index when the store was
+// not closed, and the index is rebuilt from the whole log when it is missing
+// or cannot be trusted.  A record torn by a crash is cut off.
+
+void testRecovery() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (0 == pid) 
+    {
+        LogStore s = NULL;
+        if (kLogStoreOK != LogStoreOpen(&s, "log"))
+            _exit(1);
+        for (int i=0; i<kEntryCount; ++i) 
+        {
+            LogStoreID id;
+            if (kLogStoreOK != LogStoreMakeID(s, &id) || 
+                kLogStoreOK != LogStorePut(s, id, &i, sizeof(i), 0))
+                _exit(1);
+        }
+        if (kLogStoreOK != LogStoreSync(s))
+            _exit(1);
+        for (int i=0; i<kEntryCount; i += 2) 
+        {
+            int value = -i;
+            if (kLogStoreOK != LogStorePut(s, i, &value, sizeof(value), 1))
+                _exit(1);
+        }
+        if (kLogStoreOK != LogStoreRemove(s, 1))
+            _exit(1);
+        _exit(0);   // without closing the store
+    }
+
+    int status = 0;
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    // The header took in the IDs put before the entries were written, and
+    // the open after the crash checks just those.
+
+    int fd = open("log-index", O_RDONLY);
+    assert(fd != -1);
+    uint64_t window[2];
+    assert(sizeof(window) == pread(fd, window, sizeof(window), 32));
+    assert(window[0] == 0 && window[1] >= kEntryCount);
+    close(fd);
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    checkRecovered(s);
+    assert(s->indexFileWindowTo == 0);
+    off_t logFileSize = s->logFileSize;
+    assert(s->indexFileCheckpoint == logFileSize);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // A record whose payload never made it, and half a descriptor.
+
+    fd = open("log", O_WRONLY | O_APPEND);
+    assert(fd != -1);
+    uint32_t torn[3] = { 2, 100, 5 };
+    assert(sizeof(torn) == write(fd, torn, sizeof(torn)));
+    unlink("log-index");
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->logFileSize == logFileSize);
+    checkRecovered(s);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    assert(sizeof(uint32_t) == write(fd, torn, sizeof(uint32_t)));
+    close(fd);
+    unlink("log-index");
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->logFileSize == logFileSize);
+    checkRecovered(s);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // A clean index is used as is.
+
+    struct stat before, after;
+    assert(0 == stat("log-index", &before));
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->indexFileGrowthCount == 0);
+    checkRecovered(s);
+    assert(kLogStoreOK == LogStoreClose(&s));
+    assert(0 == stat("log-index", &after));
+    assert(before.st_size == after.st_size);
+
+    // The index before the checkpoint is trusted as is, even when the store
+    // was not closed (the header's state says dirty).
+
+    fd = open("log-index", O_RDWR);
+    assert(fd != -1);
+    uint64_t location, changed;
+    uint32_t entryRev, dirty = 1;
+    assert(sizeof(location) == pread(fd, &location, sizeof(location), 
+                                     64 + 5 * 24));
+    assert(sizeof(entryRev) == pread(fd, &entryRev, sizeof(entryRev), 
+                                     64 + 5 * 24 + 16));
+    entryRev++;
+    assert(sizeof(entryRev) == pwrite(fd, &entryRev, sizeof(entryRev), 
+                                      64 + 5 * 24 + 16));
+    assert(sizeof(dirty) == pwrite(fd, &dirty, sizeof(dirty), 8));
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    LogStoreRevision rev = 0;
+    void *data = NULL;
+    assert(kLogStoreOK == LogStoreGet(s, 5, &data, NULL, &rev));
+    assert(rev == 2);
+    free(data);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // An entry past the checkpoint that is not backed by the log means the
+    // index got to disk ahead of the log; it is rebuilt.  The ID was put 
+    // since the store was opened, so the window has it.
+
+    changed = (location & 0xf000000000000000ULL) | (logFileSize + 100);
+    assert(sizeof(changed) == pwrite(fd, &changed, sizeof(changed), 
+                                     64 + 5 * 24));
+    window[0] = 5;
+    window[1] = 6;
+    assert(sizeof(window) == pwrite(fd, window, sizeof(window), 32));
+    assert(sizeof(dirty) == pwrite(fd, &dirty, sizeof(dirty), 8));
+    close(fd);
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    checkRecovered(s);
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// A sharded store spreads IDs over its shards and is otherwise used like
+// any other, from several threads at once.
+
+#define kShardCount 3
+
+static const char *shardPaths[kShardCount] = 
+{ 
+    "log-shard0", "log-shard1", "log-shard2" 
+};
+
+static void *shardedPutThread(void *arg) 
+{
+    LogStore s = arg;
+    for (int i=0; i<kEntryCount; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        int value = id;
+        assert(kLogStoreOK == LogStorePut(s, id, &value, sizeof(value), 0));
+    }
+    return NULL;
+}
+
+static int shardedVisit(void *context, LogStoreID id, const void *data, 
+                        size_t size, LogStoreRevision rev) 
+{
+    uint64_t *visited = context;
+    assert(*(const int *)data == (id < kShardCount ? -1 : id));
+    visited[0]++;
+    visited[1] += id;
+    return kLogStoreOK;
+}
+
+void testSharded() 
+{
+    char path[64];
+    for (int i=0; i<kShardCount; ++i) 
+    {
+        unlink(shardPaths[i]);
+        snprintf(path, sizeof(path), "%s-index", shardPaths[i]);
+        unlink(path);
+    }
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenSharded(&s, shardPaths, kShardCount, 
+                                              NULL));
+
+    pthread_t threads[4];
+    for (int i=0; i<4; ++i) 
+        assert(0 == pthread_create(&threads[i], NULL, shardedPutThread, s));
+    for (int i=0; i<4; ++i) 
+        assert(0 == pthread_join(threads[i], NULL));
+
+    // IDs were made in every shard in turn.
+
+    for (int i=0; i<kShardCount; ++i) 
+    {
+        assert(s->shards[i]->indexFileCount >= 4 * kEntryCount / 3);
+        assert(s->shards[i]->indexFileCount <= 4 * kEntryCount / 3 + 1);
+    }
+
+    LogStoreID ids[4 * kEntryCount];
+    for (int i=0; i<4 * kEntryCount; ++i) 
+        ids[i] = 4 * kEntryCount - 1 - i;
+
+    int value = 0;
+    for (int i=0; i<4 * kEntryCount; i += 7) 
+    {
+        assert(kLogStoreOK == LogStoreGetInto(s, ids[i], &value, 
+                                              sizeof(value), NULL, NULL));
+        assert(value == ids[i]);
+    }
+
+    void *data[4 * kEntryCount];
+    memset(data, 0, sizeof(data));
+    LogStoreRevision revs[4 * kEntryCount];
+    int results[4 * kEntryCount];
+    assert(kLogStoreOK == LogStoreGetMany(s, ids, 4 * kEntryCount, data, 
+                                          NULL, revs, results));
+    for (int i=0; i<4 * kEntryCount; ++i) 
+    {
+        assert(*(int *)data[i] == ids[i] && revs[i] == 1);
+        free(data[i]);
+    }
+
+    LogStorePutEntry entries[kShardCount + 1];
+    for (int i=0; i<kShardCount + 1; ++i) 
+    {
+        entries[i].id = i;
+        entries[i].data = &value;
+        entries[i].size = sizeof(value);
+        entries[i].rev = 1;
+    }
+    entries[kShardCount].rev = 0;
+    value = -1;
+    assert(kLogStoreRevisionConflict == LogStorePutMany(s, entries, 
+                                                        kShardCount + 1, 
+                                                        results));
+    for (int i=0; i<kShardCount; ++i) 
+        assert(kLogStoreOK == results[i]);
+    assert(kLogStoreRevisionConflict == results[kShardCount]);
+
+    assert(kLogStoreOK == LogStoreRemove(s, 4));
+    assert(kLogStoreOK == LogStoreSync(s));
+    uint64_t reclaimed = 0;
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, &reclaimed));
+    assert(reclaimed > 0);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    assert(kLogStoreOK == LogStoreOpenSharded(&s, shardPaths, kShardCount, 
+                                              NULL));
+    LogStoreRevision rev = 0;
+    const void *view = NULL;
+    LogStoreView handle;
+    assert(kLogStoreOK == LogStoreGetView(s, 2, &view, NULL, &handle));
+    int viewed = 0;
+    memcpy(&viewed, view, sizeof(viewed));
+    assert(viewed == -1);
+    assert(kLogStoreOK == LogStoreReleaseView(s, &handle));
+    assert(kLogStoreOK == LogStoreGetInto(s, 3, &value, sizeof(value), NULL, 
+                                          &rev));
+    assert(value == 3 && rev == 1);
+    void *removed = NULL;
+    assert(kLogStoreNotFound == LogStoreGet(s, 4, &removed, NULL, NULL));
+    LogStoreID statIDs[2] = { 2, 4 };
+    int exists[2];
+    assert(kLogStoreOK == LogStoreStatMany(s, statIDs, 2, exists, NULL, revs));
+    assert(exists[0] && revs[0] == 2 && !exists[1]);
+
+    // Iteration covers every shard and reports IDs of the whole store.
+
+    uint64_t visited[2] = { 0, 0 };
+    assert(kLogStoreOK == LogStoreIterate(s, shardedVisit, visited, 0));
+    assert(visited[0] == 4 * kEntryCount - 1);
+    assert(visited[1] == (4 * kEntryCount - 1) * 4 * kEntryCount / 2 - 4);
+
+    LogStoreSnapshot snapshot = NULL;
+    assert(kLogStoreOK == LogStoreSnapshotOpen(s, &snapshot));
+    assert(kLogStoreOK == LogStorePut(s, 5, &value, sizeof(value), 1));
+    void *old = NULL;
+    assert(kLogStoreOK == LogStoreSnapshotGet(snapshot, 5, &old, NULL, NULL));
+    assert(*(int *)old == 5);
+    free(old);
+    assert(kLogStoreBusy == LogStoreCompact(s, NULL, NULL));
+    assert(kLogStoreOK == LogStoreSnapshotClose(&snapshot));
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// IDs are made without the lock by many threads at once, singly or in
+// ranges, and the index grows ahead of them in the background.
+
+#define kMakeIDsPerThread 10000
+
+static void *makeIDsThread(void *arg) 
+{
+    LogStore s = ((void **)arg)[0];
+    LogStoreID *ids = ((void **)arg)[1];
+    for (int i=0; i<kMakeIDsPerThread; i += 10) 
+    {
+        if (i % 20) 
+        {
+            LogStoreID first;
+            assert(kLogStoreOK == LogStoreMakeIDs(s, 10, &first));
+            for (int k=0; k<10; ++k) 
+                ids[i + k] = first + k;
+        }
+        else 
+        {
+            for (int k=0; k<10; ++k) 
+                assert(kLogStoreOK == LogStoreMakeID(s, &ids[i + k]));
+        }
+    }
+    return NULL;
+}
+
+static int compareIDs(const void *a, const void *b) 
+{
+    LogStoreID x = *(const LogStoreID *)a, y = *(const LogStoreID *)b;
+    return x < y ? -1 : x > y;
+}
+
+void testMakeIDs() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreID first, next;
+    assert(kLogStoreInvalidParameter == LogStoreMakeIDs(s, 0, &first));
+    assert(kLogStoreOK == LogStoreMakeIDs(s, 10, &first));
+    assert(kLogStoreOK == LogStoreMakeID(s, &next));
+    assert(first == 0 && next == 10);
+
+    static LogStoreID ids[4][kMakeIDsPerThread];
+    pthread_t threads[4];
+    void *args[4][2];
+    for (int i=0; i<4; ++i) 
+    {
+        args[i][0] = s;
+        args[i][1] = ids[i];
+        assert(0 == pthread_create(&threads[i], NULL, makeIDsThread, args[i]));
+    }
+    for (int i=0; i<4; ++i) 
+        assert(0 == pthread_join(threads[i], NULL));
+    LogStoreID *all = &ids[0][0];
+    qsort(all, 4 * kMakeIDsPerThread, sizeof(LogStoreID), compareIDs);
+    for (int i=0; i<4 * kMakeIDsPerThread; ++i) 
+        assert(all[i] == 11 + i);
+
+    // Crossing the mark wakes the grower, which doubles the index in place.
+
+    int capacity = s->indexFileCapacity;
+    void *mapping = s->indexFileMapping;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, s->indexFileGrowAt - 
+                                          s->indexFileCount, &first));
+    for (int tries=0; tries<5000 && 
+         capacity == __atomic_load_n(&s->indexFileCapacity, __ATOMIC_ACQUIRE); 
+         ++tries) 
+        usleep(1000);
+    assert(s->indexFileCapacity >= 2 * capacity);
+    assert(s->indexFileMapping == mapping);
+    assert(s->indexFileCapacity == (s->indexFileMappingSize - 64) / 24);
+    assert(s->indexFileGrowthCount == 2);
+
+    // A range larger than the index grows it right away.
+
+    capacity = s->indexFileCapacity;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, capacity, &first));
+    assert(s->indexFileCapacity > first + capacity - 1);
+    assert(s->indexFileMapping == mapping);
+    int value = 1;
+    assert(kLogStoreOK == LogStorePut(s, first + capacity - 1, &value, 
+                                      sizeof(value), 0));
+    LogStoreID made = s->indexFileCount;
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // Only the IDs made are counted once closed, but IDs reserved are never
+    // made again should the store not be closed.
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->indexFileCount == made);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (0 == pid) 
+    {
+        if (kLogStoreOK != LogStoreOpen(&s, "log") ||
+            kLogStoreOK != LogStoreMakeID(s, &next) || next != made)
+            _exit(1);
+        _exit(0);
+    }
+    int status = 0;
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(kLogStoreOK == LogStoreMakeID(s, &next));
+    assert(next > made);
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// IDs past 32 bits are written with wide records.  The index is sparse, so
+// making that many IDs costs little.
+
+void testWideRecords() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, (1ULL << 32) + 2, &first));
+    LogStoreID id = first + (1ULL << 32) + 1;
+    int value = 42;
+    assert(kLogStoreOK == LogStorePut(s, id, &value, sizeof(value), 0));
+    assert(kLogStoreOK == LogStorePut(s, 5, &value, sizeof(value), 0));
+    assert(s->logFileSize == sizeof(uint32_t)*8 + sizeof(value) + 
+                             sizeof(uint32_t)*4 + sizeof(value));
+
+    int *data = NULL;
+    size_t size = 0;
+    LogStoreRevision rev = 0;
+    assert(kLogStoreOK == LogStoreGet(s, id, (void **)&data, &size, &rev));
+    assert(*data == 42 && size == sizeof(value) && rev == 1);
+    free(data);
+
+    LogStoreID ids[2] = { id, 5 };
+    void *values[2] = { NULL, NULL };
+    int results[2];
+    assert(kLogStoreOK == LogStoreGetMany(s, ids, 2, values, NULL, NULL, 
+                                          results));
+    assert(42 == *(int *)values[0] && 42 == *(int *)values[1]);
+    free(values[0]);
+    free(values[1]);
+
+    assert(kLogStoreOK == LogStoreRemove(s, 5));
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // The index is rebuilt from wide records just as well.
+
+    unlink("log-index");
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->indexFileCount == id + 1);
+    data = NULL;
+    assert(kLogStoreOK == LogStoreGet(s, id, (void **)&data, &size, &rev));
+    assert(*data == 42 && rev == 1);
+    free(data);
+    data = NULL;
+    assert(kLogStoreNotFound == LogStoreGet(s, 5, (void **)&data, &size, 
+                                            &rev));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// An index of the previous version (8-byte entries of a 16-bit revision and a
+// 48-bit offset) is upgraded on open.  The revisions of records written
+// before the log had them are taken from it.
+
+void testUpgrade() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    // ID 0 is put twice, ID 1 once, and ID 2 is put and removed.
+
+    uint32_t records[] = 
+    { 
+        0, 4, 10,  1, 4, 11,  0, 4, 12,  2, 4, 13,  2, 0 
+    };
+    int fd = open("log", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(sizeof(records) == write(fd, records, sizeof(records)));
+    close(fd);
+
+    uint32_t header[16] = { 0x5849534c, 2, 3, 0, sizeof(records), 0 };
+    uint64_t entries[3] = 
+    { 
+        (5ULL << 48) | 24, (9ULL << 48) | 12, (uint64_t) -1 
+    };
+    fd = open("log-index", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(sizeof(header) == write(fd, header, sizeof(header)));
+    assert(sizeof(entries) == write(fd, entries, sizeof(entries)));
+    close(fd);
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->indexFileCount == 3);
+
+    int *data = NULL;
+    LogStoreRevision rev = 0;
+    assert(kLogStoreOK == LogStoreGet(s, 0, (void **)&data, NULL, &rev));
+    assert(*data == 12 && rev == 5);
+    free(data);
+    data = NULL;
+    assert(kLogStoreOK == LogStoreGet(s, 1, (void **)&data, NULL, &rev));
+    assert(*data == 11 && rev == 9);
+    free(data);
+    data = NULL;
+    assert(kLogStoreNotFound == LogStoreGet(s, 2, (void **)&data, NULL, 
+                                            &rev));
+    int value = 14;
+    assert(kLogStoreOK == LogStorePut(s, 0, &value, sizeof(value), 5));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    uint32_t version = 0;
+    fd = open("log-index", O_RDONLY);
+    assert(sizeof(version) == pread(fd, &version, sizeof(version), 4));
+    close(fd);
+    assert(3 == version);
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(kLogStoreOK == LogStoreGet(s, 0, (void **)&data, NULL, &rev));
+    assert(*data == 14 && rev == 6);
+    free(data);
+    data = NULL;
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // Back then, a removal of ID 0 was all zeroes.  A crash after a 
+    // compaction, before the next sync, does not take it for a hole.
+
+    uint32_t removal[] = { 0, 4, 10,  0, 0,  1, 4, 11 };
+    fd = open("log", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(sizeof(removal) == write(fd, removal, sizeof(removal)));
+    close(fd);
+
+    header[2] = 2;
+    header[4] = sizeof(removal);
+    entries[0] = (uint64_t) -1;
+    entries[1] = (1ULL << 48) | 20;
+    fd = open("log-index", O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    assert(fd != -1);
+    assert(sizeof(header) == write(fd, header, sizeof(header)));
+    assert(2 * sizeof(entries[0]) == write(fd, entries, 
+                                           2 * sizeof(entries[0])));
+    close(fd);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (0 == pid) 
+    {
+        if (kLogStoreOK != LogStoreOpen(&s, "log") ||
+            kLogStoreOK != LogStoreCompact(s, NULL, NULL))
+            _exit(1);
+        _exit(0);   // without closing the store
+    }
+
+    int status = 0;
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(kLogStoreNotFound == LogStoreGet(s, 0, (void **)&data, NULL, 
+                                            &rev));
+    assert(kLogStoreOK == LogStoreGet(s, 1, (void **)&data, NULL, &rev));
+    assert(*data == 11);
+    free(data);
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Small values are kept in the index as well as the log when asked for, and
+// gets of them then do not read the log.  The size of index entries follows
+// the inline size asked for.
+
+void testInlineValues() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.inlineSize = 12;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+    assert(s->indexFileEntrySize == 32);
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, 101, &first));
+    for (uint64_t id = 0; id < 100; ++id) 
+    {
+        uint64_t value = id * 3;
+        assert(kLogStoreOK == LogStorePut(s, id, &value, sizeof(value), 0));
+    }
+    char large[100];
+    memset(large, 'x', sizeof(large));
+    assert(kLogStoreOK == LogStorePut(s, 100, large, sizeof(large), 0));
+    assert(kLogStoreOK == LogStoreRemove(s, 7));
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // Opening with another inline size rebuilds the index; opening with none
+    // keeps it as it is.
+
+    size_t entrySizes[3] = { 24, 24, 32 };
+    for (int i = 0; i < 3; ++i) 
+    {
+        options.inlineSize = i == 0 ? 4 : i == 1 ? 0 : 12;
+        assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+        assert(s->indexFileEntrySize == entrySizes[i]);
+        assert(s->indexFileCount == 101);
+        uint64_t value = 0;
+        assert(kLogStoreOK == LogStoreGetInto(s, 8, &value, sizeof(value), 
+                                              NULL, NULL));
+        assert(value == 24);
+        assert(kLogStoreOK == LogStoreClose(&s));
+    }
+
+    // Wipe the log: inline values are still there, while others are not.
+
+    int fd = open("log", O_WRONLY);
+    assert(fd != -1);
+    struct stat st;
+    assert(0 == fstat(fd, &st));
+    assert(0 == ftruncate(fd, 0) && 0 == ftruncate(fd, st.st_size));
+    close(fd);
+
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    uint64_t *data = NULL;
+    size_t size = 0;
+    LogStoreRevision rev = 0;
+    assert(kLogStoreOK == LogStoreGet(s, 9, (void **)&data, &size, &rev));
+    assert(*data == 27 && size == sizeof(uint64_t) && rev == 1);
+    free(data);
+    data = NULL;
+    assert(kLogStoreNotFound == LogStoreGet(s, 7, (void **)&data, &size, 
+                                            &rev));
+    assert(kLogStoreTampered == LogStoreGet(s, 100, (void **)&data, &size, 
+                                            &rev));
+
+    uint32_t small = 0;
+    assert(kLogStoreBufferTooSmall == LogStoreGetInto(s, 9, &small, 
+                                                      sizeof(small), &size, 
+                                                      NULL));
+    assert(size == sizeof(uint64_t));
+
+    LogStoreID ids[3] = { 1, 2, 99 };
+    void *values[3] = { NULL, NULL, NULL };
+    size_t sizes[3];
+    int results[3];
+    assert(kLogStoreOK == LogStoreGetMany(s, ids, 3, values, sizes, NULL, 
+                                          results));
+    for (int i = 0; i < 3; ++i) 
+    {
+        assert(*(uint64_t *)values[i] == ids[i] * 3);
+        assert(sizes[i] == sizeof(uint64_t));
+        free(values[i]);
+    }
+
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    options.inlineSize = 61;
+    assert(kLogStoreInvalidParameter == LogStoreOpenWithOptions(&s, "log", 
+                                                                &options));
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// Iteration visits each value once, at its latest revision, in the order
+// the values are found in the log.
+
+#define kIterateCount 200
+
+typedef struct IterateVisits 
+{
+    int count;
+    int stopAfter;
+    LogStoreID ids[kIterateCount];
+} IterateVisits;
+
+static int iterateVisit(void *context, LogStoreID id, const void *data, 
+                        size_t size, LogStoreRevision rev) 
+{
+    IterateVisits *visits = context;
+    assert(visits->count < kIterateCount);
+    visits->ids[visits->count++] = id;
+
+    if (id == 7) 
+    {
+        char expected[kCompressibleSize];
+        makeCompressibleValue(expected, 7);
+        assert(size == kCompressibleSize && rev == 2);
+        assert(0 == memcmp(data, expected, size));
+    }
+    else 
+    {
+        assert(size == sizeof(int));
+        assert(*(const int *)data == (id % 3 ? id : id + 1000));
+        assert(rev == (id % 3 ? 1 : 2));
+    }
+
+    return visits->count == visits->stopAfter ? -1 : kLogStoreOK;
+}
+
+void testIterate() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStoreOptions options = { kLogStoreOptionCompress };
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, kIterateCount, &first));
+    for (int i=0; i<kIterateCount; ++i) 
+        assert(kLogStoreOK == LogStorePut(s, i, &i, sizeof(i), 0));
+    for (int i=0; i<kIterateCount; i += 3) 
+    {
+        int value = i + 1000;
+        assert(kLogStoreOK == LogStorePut(s, i, &value, sizeof(value), 1));
+    }
+    for (int i=0; i<kIterateCount; i += 5) 
+        assert(kLogStoreOK == LogStoreRemove(s, i));
+    char value[kCompressibleSize];
+    makeCompressibleValue(value, 7);
+    assert(kLogStoreOK == LogStorePut(s, 7, value, sizeof(value), 1));
+
+    // Values never replaced come first, then those replaced, then 7.
+
+    LogStoreID expected[kIterateCount];
+    int expectedCount = 0;
+    for (int pass=0; pass<2; ++pass) 
+        for (int i=0; i<kIterateCount; ++i) 
+            if (i % 5 && i != 7 && (0 == i % 3) == pass) 
+                expected[expectedCount++] = i;
+    expected[expectedCount++] = 7;
+
+    for (int flags=0; flags<=kLogStoreIterateNoCache; ++flags) 
+    {
+        IterateVisits visits = { 0, 0 };
+        assert(kLogStoreOK == LogStoreIterate(s, iterateVisit, &visits, 
+                                              flags));
+        assert(visits.count == expectedCount);
+        assert(0 == memcmp(visits.ids, expected, 
+                           expectedCount * sizeof(LogStoreID)));
+    }
+
+    IterateVisits visits = { 0, 10 };
+    assert(-1 == LogStoreIterate(s, iterateVisit, &visits, 0));
+    assert(visits.count == 10);
+
+    assert(kLogStoreInvalidParameter == LogStoreIterate(s, NULL, NULL, 0));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// Snapshots see the store as it was when they were taken, whatever is put or
+// removed since.  They save only the pages of the index changed meanwhile.
+
+static int snapshotVisit(void *context, LogStoreID id, const void *data, 
+                         size_t size, LogStoreRevision rev) 
+{
+    int *count = context;
+    assert(size == sizeof(int) && *(const int *)data == id && rev == 1);
+    ++*count;
+    return kLogStoreOK;
+}
+
+void testSnapshots() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, kEntryCount, &first));
+    for (int i=0; i<kEntryCount; ++i) 
+        assert(kLogStoreOK == LogStorePut(s, i, &i, sizeof(i), 0));
+
+    LogStoreSnapshot a = NULL;
+    assert(kLogStoreOK == LogStoreSnapshotOpen(s, &a));
+
+    for (int i=0; i<100; ++i) 
+    {
+        int value = i + 5000;
+        assert(kLogStoreOK == LogStorePut(s, i, &value, sizeof(value), 1));
+    }
+    assert(kLogStoreOK == LogStoreRemove(s, 500));
+    LogStoreID id;
+    assert(kLogStoreOK == LogStoreMakeID(s, &id));
+    assert(kLogStoreOK == LogStorePut(s, id, &id, sizeof(int), 0));
+    assert(a->pageCount == 2);
+
+    int *data = NULL;
+    LogStoreRevision rev = 0;
+    assert(kLogStoreOK == LogStoreSnapshotGet(a, 5, (void **)&data, NULL, 
+                                              &rev));
+    assert(*data == 5 && rev == 1);
+    free(data);
+    data = NULL;
+    assert(kLogStoreOK == LogStoreSnapshotGet(a, 500, (void **)&data, NULL, 
+                                              NULL));
+    assert(*data == 500);
+    free(data);
+    data = NULL;
+    assert(kLogStoreNotFound == LogStoreSnapshotGet(a, id, (void **)&data, 
+                                                    NULL, NULL));
+    assert(kLogStoreOK == LogStoreGet(s, 5, (void **)&data, NULL, &rev));
+    assert(*data == 5005 && rev == 2);
+    free(data);
+    data = NULL;
+
+    // A page changed after both snapshots were taken is saved once for both.
+
+    LogStoreSnapshot b = NULL;
+    assert(kLogStoreOK == LogStoreSnapshotOpen(s, &b));
+    int value = 7;
+    assert(kLogStoreOK == LogStorePut(s, 1, &value, sizeof(value), 2));
+    assert(kLogStoreOK == LogStorePut(s, 200, &value, sizeof(value), 1));
+    assert(a->pageCount == 3 && b->pageCount == 2);
+    assert(kLogStoreBusy == LogStoreCompact(s, NULL, NULL));
+    assert(0 == strcmp("busy", LogStoreDescribe(kLogStoreBusy)));
+
+    int count = 0;
+    assert(kLogStoreOK == LogStoreSnapshotIterate(a, snapshotVisit, &count, 
+                                                  0));
+    assert(count == kEntryCount);
+    assert(kLogStoreOK == LogStoreSnapshotClose(&a));
+    assert(NULL == a);
+
+    assert(kLogStoreOK == LogStoreSnapshotGet(b, 1, (void **)&data, NULL, 
+                                              &rev));
+    assert(*data == 5001 && rev == 2);
+    free(data);
+    data = NULL;
+    assert(kLogStoreOK == LogStoreSnapshotGet(b, 200, (void **)&data, NULL, 
+                                              &rev));
+    assert(*data == 200 && rev == 1);
+    free(data);
+    assert(kLogStoreOK == LogStoreSnapshotClose(&b));
+
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// With an append buffer, appends reach the log file only when the buffer is
+// flushed, but gets see them at once.
+
+static int countVisit(void *context, LogStoreID id, const void *data, 
+                      size_t size, LogStoreRevision rev) 
+{
+    ++*(int *)context;
+    return kLogStoreOK;
+}
+
+static off_t logFileSizeOnDisk() 
+{
+    struct stat st;
+    assert(0 == stat("log", &st));
+    return st.st_size;
+}
+
+void testAppendBuffer() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.appendBufferSize = 4096;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, 100, &first));
+    for (uint64_t id = 0; id < 50; ++id) 
+    {
+        uint64_t value = id * 2;
+        assert(kLogStoreOK == LogStorePut(s, id, &value, sizeof(value), 0));
+    }
+    uint64_t values[2] = { 100, 102 };
+    LogStorePutEntry entries[2] = 
+    {
+        { 50, &values[0], sizeof(uint64_t), 0 },
+        { 51, &values[1], sizeof(uint64_t), 0 }
+    };
+    int results[2];
+    assert(kLogStoreOK == LogStorePutMany(s, entries, 2, results));
+    assert(kLogStoreOK == results[0] && kLogStoreOK == results[1]);
+    assert(kLogStoreOK == LogStoreRemove(s, 4));
+    assert(s->logFileSize == 0 && s->appendBufferSize > 0);
+    assert(0 == logFileSizeOnDisk());
+
+    uint64_t value = 0;
+    assert(kLogStoreOK == LogStoreGetInto(s, 3, &value, sizeof(value), 
+                                          NULL, NULL));
+    assert(value == 6);
+    assert(kLogStoreNotFound == LogStoreGetInto(s, 4, &value, sizeof(value), 
+                                                NULL, NULL));
+
+    LogStoreID ids[52];
+    void *data[52];
+    for (int i = 0; i < 52; ++i) 
+    {
+        ids[i] = i;
+        data[i] = NULL;
+    }
+    int getResults[52];
+    assert(kLogStoreNotFound == LogStoreGetMany(s, ids, 52, data, NULL, 
+                                                NULL, getResults));
+    for (int i = 0; i < 52; ++i) 
+    {
+        assert(i == 4 ? kLogStoreNotFound == getResults[i] : 
+                        kLogStoreOK == getResults[i]);
+        assert(i == 4 || *(uint64_t *)data[i] == i * 2);
+        free(data[i]);
+    }
+
+    // A value too large for the buffer flushes it and goes straight to the
+    // file, as does a sync.
+
+    char large[8000];
+    memset(large, 'x', sizeof(large));
+    assert(kLogStoreOK == LogStorePut(s, 60, large, sizeof(large), 0));
+    assert(s->appendBufferSize == 0);
+    assert(s->logFileSize == logFileSizeOnDisk());
+
+    assert(kLogStoreOK == LogStorePut(s, 61, &value, sizeof(value), 0));
+    assert(s->appendBufferSize > 0);
+    assert(kLogStoreOK == LogStoreSync(s));
+    assert(s->appendBufferSize == 0);
+    assert(s->logFileSize == logFileSizeOnDisk());
+
+    // Iterating, and closing, flush it too.
+
+    assert(kLogStoreOK == LogStorePut(s, 62, &value, sizeof(value), 0));
+    int count = 0;
+    assert(kLogStoreOK == LogStoreIterate(s, countVisit, &count, 0));
+    assert(count == 54);
+    assert(kLogStoreOK == LogStorePut(s, 63, &value, sizeof(value), 0));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(kLogStoreOK == LogStoreGetInto(s, 51, &value, sizeof(value), 
+                                          NULL, NULL));
+    assert(value == 102);
+    assert(kLogStoreOK == LogStoreGetInto(s, 63, &value, sizeof(value), 
+                                          NULL, NULL));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // The grower flushes the buffer once the interval is up.
+
+    options.flushInterval = 10;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+    off_t size = s->logFileSize;
+    assert(kLogStoreOK == LogStorePut(s, 64, &value, sizeof(value), 0));
+    assert(size == logFileSizeOnDisk());
+    for (int i = 0; i < 1000 && size == logFileSizeOnDisk(); ++i) 
+        usleep(1000);
+    assert(size < logFileSizeOnDisk());
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// Asynchronous calls complete on the store's threads, through io_uring or
+// without it.
+
+#define kAsyncCount 200
+
+typedef struct AsyncWait 
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int pending;
+    int results[kAsyncCount + 2];
+    uint64_t values[kAsyncCount + 2];
+    LogStoreRevision revs[kAsyncCount + 2];
+} AsyncWait;
+
+typedef struct AsyncSlot 
+{
+    AsyncWait *wait;
+    int index;
+} AsyncSlot;
+
+static void asyncDone(AsyncWait *wait) 
+{
+    pthread_mutex_lock(&wait->mutex);
+    if (0 == --wait->pending) 
+        pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+static void asyncGot(void *context, int result, void *data, size_t size, 
+                     LogStoreRevision rev) 
+{
+    AsyncSlot *slot = context;
+    slot->wait->results[slot->index] = result;
+    slot->wait->revs[slot->index] = rev;
+    if (kLogStoreOK == result) 
+    {
+        assert(size >= sizeof(uint64_t));
+        memcpy(&slot->wait->values[slot->index], data, sizeof(uint64_t));
+        free(data);
+    }
+    else 
+        assert(NULL == data);
+    asyncDone(slot->wait);
+}
+
+static void asyncPut(void *context, int result) 
+{
+    AsyncSlot *slot = context;
+    slot->wait->results[slot->index] = result;
+    asyncDone(slot->wait);
+}
+
+static void asyncWaitAll(AsyncWait *wait) 
+{
+    pthread_mutex_lock(&wait->mutex);
+    while (wait->pending > 0) 
+        pthread_cond_wait(&wait->cond, &wait->mutex);
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+void testAsync() 
+{
+    AsyncWait wait;
+    pthread_mutex_init(&wait.mutex, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    AsyncSlot slots[kAsyncCount + 2];
+    for (int i = 0; i < kAsyncCount + 2; ++i) 
+    {
+        slots[i].wait = &wait;
+        slots[i].index = i;
+    }
+
+    for (int pass = 0; pass < 2; ++pass) 
+    {
+        unlink("log");
+        unlink("log-index");
+
+        LogStoreOptions options;
+        memset(&options, 0, sizeof(options));
+        options.flags = kLogStoreOptionCompress;
+        if (pass == 1) 
+            options.flags |= kLogStoreOptionNoRing;
+        options.asyncThreads = 2;
+
+        LogStore s = NULL;
+        assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+        assert(logStoreAsyncUsesRing(s->async) == (pass == 0));
+
+        // IDs 0 ... kAsyncCount - 1 get a value (compressible for every
+        // tenth), kAsyncCount is removed and kAsyncCount + 1 is never put.
+
+        LogStoreID first;
+        assert(kLogStoreOK == LogStoreMakeIDs(s, kAsyncCount + 2, &first));
+        char value[kCompressibleSize];
+        for (uint64_t id = 0; id <= kAsyncCount; ++id) 
+        {
+            makeCompressibleValue(value, id);
+            memcpy(value, &id, sizeof(id));
+            assert(kLogStoreOK == LogStorePut(s, id, value, 
+                                              id % 10 ? sizeof(id) : 
+                                                        sizeof(value), 0));
+        }
+        assert(kLogStoreOK == LogStoreRemove(s, kAsyncCount));
+
+        wait.pending = kAsyncCount + 2;
+        for (int i = 0; i < kAsyncCount + 2; ++i) 
+            assert(kLogStoreOK == LogStoreGetAsync(s, i, asyncGot, 
+                                                   &slots[i]));
+        asyncWaitAll(&wait);
+        for (int i = 0; i < kAsyncCount; ++i) 
+        {
+            assert(kLogStoreOK == wait.results[i]);
+            assert(wait.values[i] == i && wait.revs[i] == 1);
+        }
+        assert(kLogStoreNotFound == wait.results[kAsyncCount]);
+        assert(kLogStoreNotFound == wait.results[kAsyncCount + 1]);
+
+        // Puts, then a sync, then gets of what was put.
+
+        uint64_t values[kAsyncCount];
+        wait.pending = kAsyncCount;
+        for (int i = 0; i < kAsyncCount; ++i) 
+        {
+            values[i] = i * 7;
+            assert(kLogStoreOK == LogStorePutAsync(s, i, &values[i], 
+                                                   sizeof(uint64_t), 1, 
+                                                   asyncPut, &slots[i]));
+        }
+        asyncWaitAll(&wait);
+        for (int i = 0; i < kAsyncCount; ++i) 
+            assert(kLogStoreOK == wait.results[i]);
+
+        wait.pending = 1;
+        assert(kLogStoreOK == LogStoreSyncAsync(s, asyncPut, &slots[0]));
+        asyncWaitAll(&wait);
+        assert(kLogStoreOK == wait.results[0]);
+        assert(s->syncedSequence == s->writeSequence);
+
+        wait.pending = kAsyncCount;
+        for (int i = 0; i < kAsyncCount; ++i) 
+            assert(kLogStoreOK == LogStoreGetAsync(s, i, asyncGot, 
+                                                   &slots[i]));
+        asyncWaitAll(&wait);
+        for (int i = 0; i < kAsyncCount; ++i) 
+            assert(wait.values[i] == i * 7 && wait.revs[i] == 2);
+
+        assert(kLogStoreInvalidParameter == LogStoreGetAsync(s, 0, NULL, 
+                                                             NULL));
+
+        // Gets in flight when the store is closed are completed first.
+
+        wait.pending = kAsyncCount;
+        for (int i = 0; i < kAsyncCount; ++i) 
+            assert(kLogStoreOK == LogStoreGetAsync(s, i, asyncGot, 
+                                                   &slots[i]));
+        assert(kLogStoreOK == LogStoreClose(&s));
+        assert(0 == wait.pending);
+
+        assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+        assert(kLogStoreInvalidParameter == LogStoreGetAsync(s, 0, asyncGot, 
+                                                             &slots[0]));
+        assert(kLogStoreOK == LogStoreClose(&s));
+    }
+
+    // A sharded store shares one engine between its shards.
+
+    for (int i = 0; i < kShardCount; ++i) 
+    {
+        char indexPath[64];
+        snprintf(indexPath, sizeof(indexPath), "%s-index", shardPaths[i]);
+        unlink(shardPaths[i]);
+        unlink(indexPath);
+    }
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.asyncThreads = 1;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenSharded(&s, shardPaths, kShardCount, 
+                                              &options));
+    LogStoreID ids[kShardCount * 2];
+    uint64_t values[kShardCount * 2];
+    wait.pending = kShardCount * 2;
+    for (int i = 0; i < kShardCount * 2; ++i) 
+    {
+        values[i] = i + 100;
+        assert(kLogStoreOK == LogStoreMakeID(s, &ids[i]));
+        assert(kLogStoreOK == LogStorePutAsync(s, ids[i], &values[i], 
+                                               sizeof(uint64_t), 0, 
+                                               asyncPut, &slots[i]));
+    }
+    asyncWaitAll(&wait);
+    wait.pending = kShardCount * 2;
+    for (int i = 0; i < kShardCount * 2; ++i) 
+        assert(kLogStoreOK == LogStoreGetAsync(s, ids[i], asyncGot, 
+                                               &slots[i]));
+    asyncWaitAll(&wait);
+    for (int i = 0; i < kShardCount * 2; ++i) 
+        assert(kLogStoreOK == wait.results[i] && wait.values[i] == i + 100);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    pthread_mutex_destroy(&wait.mutex);
+    pthread_cond_destroy(&wait.cond);
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// Gets queued behind puts on the engine's one thread do not hold up a
+// compaction that the puts wait for.  The engine's thread is held at a gate
+// while the compaction takes the lock; the puts then wait for the lock, with
+// the gets behind them.
+
+typedef struct AsyncGate 
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int open;
+} AsyncGate;
+
+static void asyncWaitAtGate(void *context, int result) 
+{
+    AsyncGate *gate = context;
+    pthread_mutex_lock(&gate->mutex);
+    while (!gate->open) 
+        pthread_cond_wait(&gate->cond, &gate->mutex);
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+static void *asyncCompactThread(void *arg) 
+{
+    assert(kLogStoreOK == LogStoreCompact(arg, NULL, NULL));
+    return NULL;
+}
+
+#define kAsyncCompactCount (kAsyncCount / 2)
+
+void testAsyncCompact() 
+{
+    AsyncWait wait;
+    pthread_mutex_init(&wait.mutex, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    AsyncSlot slots[kAsyncCount];
+    for (int i = 0; i < kAsyncCount; ++i) 
+    {
+        slots[i].wait = &wait;
+        slots[i].index = i;
+    }
+
+    for (int pass = 0; pass < 2; ++pass) 
+    {
+        unlink("log");
+        unlink("log-index");
+
+        LogStoreOptions options;
+        memset(&options, 0, sizeof(options));
+        options.flags = pass == 1 ? kLogStoreOptionNoRing : 0;
+        options.asyncThreads = 1;
+
+        LogStore s = NULL;
+        assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+        LogStoreID first;
+        assert(kLogStoreOK == LogStoreMakeIDs(s, kAsyncCompactCount, &first));
+        for (uint64_t id = 0; id < kAsyncCompactCount; ++id) 
+            assert(kLogStoreOK == LogStorePut(s, id, &id, sizeof(id), 0));
+
+        AsyncGate gate;
+        pthread_mutex_init(&gate.mutex, NULL);
+        pthread_cond_init(&gate.cond, NULL);
+        gate.open = 0;
+        assert(kLogStoreOK == LogStoreSyncAsync(s, asyncWaitAtGate, &gate));
+
+        uint64_t values[kAsyncCompactCount];
+        wait.pending = kAsyncCompactCount * 2;
+        for (int i = 0; i < kAsyncCompactCount; ++i) 
+        {
+            values[i] = i * 7 + 1;
+            assert(kLogStoreOK == LogStorePutAsync(s, i, &values[i], 
+                                                   sizeof(uint64_t), 1, 
+                                                   asyncPut, &slots[2 * i]));
+            assert(kLogStoreOK == LogStoreGetAsync(s, i, asyncGot, 
+                                                   &slots[2 * i + 1]));
+        }
+
+        pthread_t thread;
+        assert(0 == pthread_create(&thread, NULL, asyncCompactThread, s));
+        usleep(100000);
+        pthread_mutex_lock(&gate.mutex);
+        gate.open = 1;
+        pthread_cond_broadcast(&gate.cond);
+        pthread_mutex_unlock(&gate.mutex);
+        asyncWaitAll(&wait);
+        assert(0 == pthread_join(thread, NULL));
+
+        for (int i = 0; i < kAsyncCompactCount; ++i) 
+        {
+            assert(kLogStoreOK == wait.results[2 * i]);
+            assert(kLogStoreOK == wait.results[2 * i + 1]);
+            uint64_t got = wait.values[2 * i + 1];
+            assert(got == i || got == values[i]);
+
+            void *data = NULL;
+            assert(kLogStoreOK == LogStoreGet(s, i, &data, NULL, NULL));
+            assert(*(uint64_t *)data == values[i]);
+            free(data);
+        }
+        assert(kLogStoreOK == LogStoreClose(&s));
+
+        pthread_mutex_destroy(&gate.mutex);
+        pthread_cond_destroy(&gate.cond);
+    }
+
+    pthread_mutex_destroy(&wait.mutex);
+    pthread_cond_destroy(&wait.cond);
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// Completing a read may submit more reads, even with the ring full: reads 
+// completed by the reaper, which makes room in the ring, and submitted by it
+// are done by the threads instead.  Closing the store finishes the reads 
+// submitted meanwhile too.
+
+#define kAsyncFanOutIDs   64
+#define kAsyncFanOutCount 4096
+
+typedef struct AsyncFanOut 
+{
+    LogStore s;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int submitted;
+    int done;
+    int failed;
+} AsyncFanOut;
+
+static void asyncFannedOut(void *context, int result, void *data, 
+                           size_t size, LogStoreRevision rev);
+
+static void asyncFanOut(AsyncFanOut *fan) 
+{
+    pthread_mutex_lock(&fan->mutex);
+    int id = fan->submitted < kAsyncFanOutCount ? fan->submitted++ : -1;
+    pthread_mutex_unlock(&fan->mutex);
+    if (id >= 0) 
+        assert(kLogStoreOK == LogStoreGetAsync(fan->s, id % kAsyncFanOutIDs, 
+                                               asyncFannedOut, fan));
+}
+
+static void asyncFannedOut(void *context, int result, void *data, 
+                           size_t size, LogStoreRevision rev) 
+{
+    AsyncFanOut *fan = context;
+    uint64_t value = kAsyncFanOutIDs;
+    if (kLogStoreOK == result && size == sizeof(value)) 
+        memcpy(&value, data, sizeof(value));
+    free(data);
+    pthread_mutex_lock(&fan->mutex);
+    fan->failed += value >= kAsyncFanOutIDs;
+    if (++fan->done == kAsyncFanOutCount) 
+        pthread_cond_signal(&fan->cond);
+    pthread_mutex_unlock(&fan->mutex);
+    asyncFanOut(fan);
+    asyncFanOut(fan);
+}
+
+void testAsyncFanOut() 
+{
+    for (int pass = 0; pass < 2; ++pass) 
+    {
+        unlink("log");
+        unlink("log-index");
+
+        LogStoreOptions options;
+        memset(&options, 0, sizeof(options));
+        options.asyncThreads = 1;
+
+        AsyncFanOut fan;
+        memset(&fan, 0, sizeof(fan));
+        pthread_mutex_init(&fan.mutex, NULL);
+        pthread_cond_init(&fan.cond, NULL);
+        assert(kLogStoreOK == LogStoreOpenWithOptions(&fan.s, "log", 
+                                                      &options));
+        assert(logStoreAsyncUsesRing(fan.s->async));
+
+        LogStoreID first;
+        assert(kLogStoreOK == LogStoreMakeIDs(fan.s, kAsyncFanOutIDs, 
+                                              &first));
+        for (uint64_t id = 0; id < kAsyncFanOutIDs; ++id) 
+            assert(kLogStoreOK == LogStorePut(fan.s, id, &id, sizeof(id), 
+                                              0));
+
+        // Each read completed submits two more, so the reads in flight grow
+        // until the ring is full.  The second time, the store is closed
+        // while they do.
+
+        asyncFanOut(&fan);
+        if (pass == 0) 
+        {
+            pthread_mutex_lock(&fan.mutex);
+            while (fan.done < kAsyncFanOutCount) 
+                pthread_cond_wait(&fan.cond, &fan.mutex);
+            pthread_mutex_unlock(&fan.mutex);
+        }
+        assert(kLogStoreOK == LogStoreClose(&fan.s));
+        assert(fan.done == kAsyncFanOutCount && fan.failed == 0);
+
+        pthread_mutex_destroy(&fan.mutex);
+        pthread_cond_destroy(&fan.cond);
+    }
+
+    unlink("log");
+    unlink("log-index");
+}
+
+// A direct store writes its log in whole blocks through its own buffer and
+// reads the blocks a record lies in.  Its log is buffered I/O's log to
+// anything that scans it or opens it later.
+
+#define kDirectCount 300
+
+static size_t directValueSize(int i) 
+{
+    return i % 50 == 7 ? 20000 : (size_t)(i * 37) % 3000 + 8;
+}
+
+static void makeDirectValue(char *value, int i) 
+{
+    size_t size = directValueSize(i);
+    for (size_t j = 0; j < size; ++j) 
+        value[j] = (char)(i + j);
+    memcpy(value, &i, sizeof(i));
+}
+
+static void checkDirectValues(LogStore s, int removed) 
+{
+    char expected[20000];
+    for (int i = 0; i < kDirectCount; ++i) 
+    {
+        void *data = NULL;
+        size_t size = 0;
+        int result = LogStoreGet(s, i, &data, &size, NULL);
+        if (i > 0 && i % removed == 0) 
+        {
+            assert(kLogStoreNotFound == result);
+            continue;
+        }
+        assert(kLogStoreOK == result);
+        makeDirectValue(expected, i);
+        assert(size == directValueSize(i));
+        assert(0 == memcmp(data, expected, size));
+        free(data);
+    }
+}
+
+static void *largestAllocate(void *context, size_t size)
+{
+    size_t *largest = context;
+    *largest = size > *largest ? size : *largest;
+    return malloc(size);
+}
+
+static void largestDeallocate(void *context, void *pointer)
+{
+    free(pointer);
+}
+
+void testDirect() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.flags = kLogStoreOptionDirect | kLogStoreOptionCompress;
+    options.appendBufferSize = 10000;   // rounded up to 12 KiB
+    options.asyncThreads = 1;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+    assert(12288 == s->appendBufferCapacity);
+
+    char value[20000];
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, kDirectCount, &first));
+    for (int i = 0; i < kDirectCount; ++i) 
+    {
+        makeDirectValue(value, i);
+        assert(kLogStoreOK == LogStorePut(s, i, value, directValueSize(i), 
+                                          0));
+    }
+
+    // Some of it is still buffered, and the file is whole blocks.
+
+    assert(s->appendBufferSize > 0);
+    assert(0 == logFileSizeOnDisk() % 4096);
+    checkDirectValues(s, kDirectCount + 1);
+
+    assert(kLogStoreOK == LogStoreSync(s));
+    assert(0 == s->appendBufferSize);
+    assert(0 == logFileSizeOnDisk() % 4096);
+    checkDirectValues(s, kDirectCount + 1);
+
+    AsyncWait wait;
+    pthread_mutex_init(&wait.mutex, NULL);
+    pthread_cond_init(&wait.cond, NULL);
+    AsyncSlot slots[kAsyncCount];
+    wait.pending = kAsyncCount;
+    for (int i = 0; i < kAsyncCount; ++i) 
+    {
+        slots[i].wait = &wait;
+        slots[i].index = i;
+        assert(kLogStoreOK == LogStoreGetAsync(s, i, asyncGot, &slots[i]));
+    }
+    asyncWaitAll(&wait);
+    for (int i = 0; i < kAsyncCount; ++i) 
+        assert(kLogStoreOK == wait.results[i] && wait.values[i] % 
+               ((uint64_t)1 << 32) == (uint64_t)i);
+
+    // Removals, then iterating and compacting, which read the log through
+    // the page cache.  ID 0 stays, as padding must not read as its removal.
+
+    for (int i = 3; i < kDirectCount; i += 3) 
+        assert(kLogStoreOK == LogStoreRemove(s, i));
+    int visits = 0;
+    assert(kLogStoreOK == LogStoreIterate(s, countVisit, &visits, 0));
+    assert(visits == kDirectCount - (kDirectCount - 1) / 3);
+
+    uint64_t reclaimed = 0;
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, &reclaimed));
+    assert(reclaimed > 0);
+    checkDirectValues(s, 3);
+    makeDirectValue(value, 1);
+    assert(kLogStoreOK == LogStorePut(s, 1, value, directValueSize(1), 1));
+    checkDirectValues(s, 3);
+
+    // Closing cuts the padding off.
+
+    off_t logFileSize = s->logFileSize + s->appendBufferSize;
+    assert(kLogStoreOK == LogStoreClose(&s));
+    assert(logFileSize == logFileSizeOnDisk());
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    checkDirectValues(s, 3);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // After a crash, the padding is cut off as a torn record would be; it
+    // does not read as records.
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (0 == pid) 
+    {
+        if (kLogStoreOK != LogStoreOpenWithOptions(&s, "log", &options))
+            _exit(1);
+        makeDirectValue(value, 2);
+        if (kLogStoreOK != LogStorePut(s, 2, value, directValueSize(2), 1) ||
+            kLogStoreOK != LogStoreSync(s) || 
+            s->logFileSize == logFileSizeOnDisk())
+            _exit(1);
+        _exit(0);   // without closing the store
+    }
+
+    int status = 0;
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->logFileSize == logFileSizeOnDisk());
+    checkDirectValues(s, 3);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // Padding followed by much preallocated space is cut off all the same,
+    // without reading it as the large record it looks like.
+
+    logFileSize = logFileSizeOnDisk();
+    memset(value, 0xfe, 4096);
+    int fd = open("log", O_WRONLY);
+    assert(fd != -1);
+    assert(4096 == pwrite(fd, value, 4096, logFileSize));
+    assert(0 == ftruncate(fd, (off_t)1 << 30));
+    close(fd);
+    unlink("log-index");
+
+    size_t largest = 0;
+    LogStoreOptions tracked;
+    memset(&tracked, 0, sizeof(tracked));
+    tracked.allocator.allocate = largestAllocate;
+    tracked.allocator.deallocate = largestDeallocate;
+    tracked.allocator.context = &largest;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &tracked));
+    assert(s->logFileSize == logFileSize);
+    assert(logFileSize == logFileSizeOnDisk());
+    assert(largest < 64 * 1024 * 1024);
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// Syncs at each durability level.  Only data and full syncs count as flushes
+// and move the checkpoint; each writes back only the index entries written
+// since the last.
+
+void testDurability() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.durability = kLogStoreDurabilityNone + 1;
+
+    LogStore s = NULL;
+    assert(kLogStoreInvalidParameter == 
+           LogStoreOpenWithOptions(&s, "log", &options));
+
+    options.durability = kLogStoreDurabilityData;
+    options.appendBufferSize = 4096;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, 100, &first));
+    for (int i = 0; i < 100; ++i) 
+        assert(kLogStoreOK == LogStorePut(s, i, &i, sizeof(i), 0));
+    assert(s->indexFileDirtyTo > s->indexFileDirtyFrom);
+
+    assert(kLogStoreOK == LogStoreSync(s));
+    assert(s->syncedSequence == s->writeSequence);
+    assert(s->indexFileCheckpoint == s->logFileSize);
+    assert(0 == s->indexFileDirtyTo);
+
+    // One entry written: the range is that entry's.
+
+    int value = 1000;
+    assert(kLogStoreOK == LogStorePut(s, 50, &value, sizeof(value), 1));
+    assert(s->indexFileDirtyTo - s->indexFileDirtyFrom == 
+           s->indexFileEntrySize);
+
+    // An ordered sync writes out the append buffer and leaves the rest.
+
+    assert(s->appendBufferSize > 0);
+    assert(kLogStoreOK == LogStoreSyncWith(s, kLogStoreDurabilityOrdered));
+    assert(0 == s->appendBufferSize);
+    assert(s->syncedSequence < s->writeSequence);
+    assert(s->indexFileCheckpoint < s->logFileSize);
+    assert(s->indexFileDirtyTo > 0);
+
+    assert(kLogStoreOK == LogStorePut(s, 51, &value, sizeof(value), 1));
+    assert(kLogStoreOK == LogStoreSyncWith(s, kLogStoreDurabilityNone));
+    assert(0 == s->appendBufferSize);
+    assert(s->syncedSequence < s->writeSequence);
+
+    assert(kLogStoreOK == LogStoreSyncWith(s, kLogStoreDurabilityFull));
+    assert(s->syncedSequence == s->writeSequence);
+    assert(s->indexFileCheckpoint == s->logFileSize);
+    assert(0 == s->indexFileDirtyTo);
+
+    // A data sync does not stand in for a full one.
+
+    assert(kLogStoreOK == LogStorePut(s, 52, &value, sizeof(value), 1));
+    assert(kLogStoreOK == LogStoreSyncWith(s, kLogStoreDurabilityData));
+    assert(s->syncedSequence == s->writeSequence);
+    assert(s->syncedFullSequence < s->writeSequence);
+    assert(kLogStoreOK == LogStoreSyncWith(s, kLogStoreDurabilityFull));
+    assert(s->syncedFullSequence == s->writeSequence);
+
+    assert(kLogStoreInvalidParameter == LogStoreSyncWith(s, -1));
+    assert(kLogStoreInvalidParameter == 
+           LogStoreSyncWith(s, kLogStoreDurabilityNone + 1));
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    for (int i = 0; i < 100; ++i) 
+    {
+        void *data = NULL;
+        assert(kLogStoreOK == LogStoreGet(s, i, &data, NULL, NULL));
+        assert(*(int *)data == (i >= 50 && i <= 52 ? 1000 : i));
+        free(data);
+    }
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // A sharded store syncs every shard at the level asked for.
+
+    for (int i = 0; i < kShardCount; ++i) 
+    {
+        char indexPath[64];
+        snprintf(indexPath, sizeof(indexPath), "%s-index", shardPaths[i]);
+        unlink(shardPaths[i]);
+        unlink(indexPath);
+    }
+
+    assert(kLogStoreOK == LogStoreOpenSharded(&s, shardPaths, kShardCount, 
+                                              &options));
+    for (int i = 0; i < kShardCount * 2; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, &i, sizeof(i), 0));
+    }
+    assert(kLogStoreOK == LogStoreSyncWith(s, kLogStoreDurabilityOrdered));
+    for (int i = 0; i < kShardCount; ++i) 
+        assert(s->shards[i]->syncedSequence < s->shards[i]->writeSequence);
+    assert(kLogStoreOK == LogStoreSync(s));
+    for (int i = 0; i < kShardCount; ++i) 
+        assert(s->shards[i]->syncedSequence == s->shards[i]->writeSequence);
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// A preallocating store extends its log ahead of the records, a chunk at a
+// time, and allocates its index densely.  Closing cuts the log back to its
+// records; after a crash, opening finds where they end.  A removal of ID 0
+// at the end of the log does not read as preallocated zeroes.
+
+#define kPreallocateSize (64 * 1024)
+
+static void checkPreallocatedValues(LogStore s, int updated) 
+{
+    for (int i = 1; i < 100; ++i) 
+    {
+        void *data = NULL;
+        assert(kLogStoreOK == LogStoreGet(s, i, &data, NULL, NULL));
+        assert(*(int *)data == (updated && i % 2 ? i + 1000 : i));
+        free(data);
+    }
+}
+
+void testPreallocate() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStoreOptions options;
+    memset(&options, 0, sizeof(options));
+    options.preallocateSize = kPreallocateSize;
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpenWithOptions(&s, "log", &options));
+
+    LogStoreID first;
+    assert(kLogStoreOK == LogStoreMakeIDs(s, 100, &first));
+    for (int i = 0; i < 100; ++i) 
+        assert(kLogStoreOK == LogStorePut(s, i, &i, sizeof(i), 0));
+    assert(s->logFileSize < kPreallocateSize);
+    assert(kPreallocateSize == logFileSizeOnDisk());
+
+    struct stat ist;
+    assert(0 == stat("log-index", &ist));
+    assert(ist.st_blocks * 512 >= ist.st_size);
+
+    // Appending past the preallocated space preallocates another chunk.
+
+    char big[kPreallocateSize];
+    memset(big, 'p', sizeof(big));
+    assert(kLogStoreOK == LogStorePut(s, 0, big, sizeof(big), 1));
+    assert(2 * kPreallocateSize == logFileSizeOnDisk());
+
+    // Compacting writes a new log; appends preallocate again after it.
+
+    assert(kLogStoreOK == LogStoreCompact(s, NULL, NULL));
+    assert(s->logFileSize == logFileSizeOnDisk());
+    LogStoreID id;
+    assert(kLogStoreOK == LogStoreMakeID(s, &id));
+    assert(kLogStoreOK == LogStorePut(s, id, &id, sizeof(id), 0));
+    assert(2 * kPreallocateSize == logFileSizeOnDisk());
+    checkPreallocatedValues(s, 0);
+
+    off_t logFileSize = s->logFileSize;
+    assert(kLogStoreOK == LogStoreClose(&s));
+    assert(logFileSize == logFileSizeOnDisk());
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(logFileSize == s->logFileSize);
+    checkPreallocatedValues(s, 0);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // After a crash, the zeroes past the records are cut off, even when the
+    // index is rebuilt from the whole log.  The removal of ID 0 that the
+    // records end with stays.
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (0 == pid) 
+    {
+        if (kLogStoreOK != LogStoreOpenWithOptions(&s, "log", &options))
+            _exit(1);
+        for (int i = 1; i < 100; i += 2) 
+        {
+            int value = i + 1000;
+            if (kLogStoreOK != LogStorePut(s, i, &value, sizeof(value), 1))
+                _exit(1);
+        }
+        if (kLogStoreOK != LogStoreRemove(s, 0) ||
+            kLogStoreOK != LogStoreSync(s) || 
+            s->logFileSize == logFileSizeOnDisk())
+            _exit(1);
+        _exit(0);   // without closing the store
+    }
+
+    int status = 0;
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    unlink("log-index");
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->logFileSize == logFileSizeOnDisk());
+    void *data = NULL;
+    assert(kLogStoreNotFound == LogStoreGet(s, 0, &data, NULL, NULL));
+    checkPreallocatedValues(s, 1);
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    // A crash may leave a hole past the checkpoint, with records past it that
+    // got to disk.  The log ends at the hole; it is not taken for a removal
+    // of ID 0.
+
+    unlink("log");
+    unlink("log-index");
+
+    pid = fork();
+    assert(pid != -1);
+    if (0 == pid) 
+    {
+        if (kLogStoreOK != LogStoreOpenWithOptions(&s, "log", &options) ||
+            kLogStoreOK != LogStoreMakeIDs(s, 2, &first))
+            _exit(1);
+        for (int i = 0; i < 2; ++i) 
+        {
+            if (kLogStoreOK != LogStorePut(s, i, &i, sizeof(i), 0))
+                _exit(1);
+        }
+        if (kLogStoreOK != LogStoreSync(s))
+            _exit(1);
+        off_t hole = s->logFileSize;
+        int64_t update = 1001;      // so the hole is whole descriptors
+        if (kLogStoreOK != LogStorePut(s, 1, &update, sizeof(update), 1))
+            _exit(1);
+        size_t holeSize = s->logFileSize - hole;
+        int value = 1000;
+        if (kLogStoreOK != LogStorePut(s, 0, &value, sizeof(value), 1))
+            _exit(1);
+        char zeroes[64];
+        memset(zeroes, 0, sizeof(zeroes));
+        int fd = open("log", O_WRONLY);
+        if (-1 == fd || holeSize > sizeof(zeroes) ||
+            holeSize != pwrite(fd, zeroes, holeSize, hole))
+            _exit(1);
+        _exit(0);   // without closing the store
+    }
+
+    assert(pid == waitpid(pid, &status, 0));
+    assert(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+    assert(s->logFileSize == logFileSizeOnDisk());
+    for (int i = 0; i < 2; ++i) 
+    {
+        LogStoreRevision rev = 0;
+        void *value = NULL;
+        assert(kLogStoreOK == LogStoreGet(s, i, &value, NULL, &rev));
+        assert(*(int *)value == i && 1 == rev);
+        free(value);
+    }
+    assert(kLogStoreOK == LogStoreClose(&s));
+}
+
+// IDs made and put while compaction runs survive it, whether their records
+// are copied in a batch of the first pass or in the last pass.
+
+#define kCompactingPutCount 20000
+
+static void *compactingPutThread(void *arg)
+{
+    LogStore s = arg;
+    for (int i = 0; i < kCompactingPutCount; ++i) 
+    {
+        LogStoreID id;
+        assert(kLogStoreOK == LogStoreMakeID(s, &id));
+        assert(kLogStoreOK == LogStorePut(s, id, &id, sizeof(id), 0));
+    }
+    return NULL;
+}
+
+void testCompactWhilePutting() 
+{
+    unlink("log");
+    unlink("log-index");
+
+    LogStore s = NULL;
+    assert(kLogStoreOK == LogStoreOpen(&s, "log"));
+
+    LogStoreCompactOptions options;
+    memset(&options, 0, sizeof(options));
+    options.bufferSize = 4096;
+    options.recordsPerLock = 4;
+
+    pthread_t thread;
+    assert(0 == pthread_create(&thread, NULL, compactingPutThread, s));
+    for (int i = 0; i < 20; ++i) 
+        assert(kLogStoreOK == LogStoreCompact(s, &options, NULL));
+    assert(0 == pthread_join(thread, NULL));
+    assert(kLogStoreOK == LogStoreCompact(s, &options, NULL));
+
+    assert(kCompactingPutCount == s->indexFileCount);
+    for (LogStoreID id = 0; id < kCompactingPutCount; ++id) 
+    {
+        void *data = NULL;
+        assert(kLogStoreOK == LogStoreGet(s, id, &data, NULL, NULL));
+        assert(*(LogStoreID *)data == id);
+        free(data);
+    }
+    assert(kLogStoreOK == LogStoreClose(&s));
+
+    unlink("log");
+    unlink("log-index");
+}
+
 int main(int argc, char **argv) 
 {
     unlink("log");
@@ -164,6 +2852,34 @@ int main(int argc, char **argv)
     testGet();
     testConfictDetection();
     testRemove();
+    testCompact();
+    testGroupCommit();
+    testConcurrentGets();
+    testPutMany();
+    testGetMany();
+    testGetView();
+    testGetInto();
+    testStat();
+    testAllocator();
+    testCache();
+    testCompression();
+    testChecksums();
+    testRecovery();
+    testSharded();
+    testMakeIDs();
+    testWideRecords();
+    testUpgrade();
+    testInlineValues();
+    testIterate();
+    testSnapshots();
+    testAppendBuffer();
+    testAsync();
+    testAsyncCompact();
+    testAsyncFanOut();
+    testDirect();
+    testDurability();
+    testPreallocate();
+    testCompactWhilePutting();
 
     return 0;
 }